@@ -1,2 +1,2 @@
 #!/bin/sh
-cc -Wall -Wno-unused-function -lm -lSDL3 -o bin/refpad refpad_sdl3.c
\ No newline at end of file
+cc -Wall -Wno-unused-function -pthread -lm -lSDL3 -o bin/refpad refpad_sdl3.c
\ No newline at end of file
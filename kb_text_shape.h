@@ -93,6 +93,11 @@
         #define KB_TEXT_SHAPE_STATIC
       then all functions will be declared as static.
 
+      If you do this:
+        #define KBTS_CHECK_SIMPLE_RUNS
+      then runs that skip the full shaping pipeline are also shaped with it, and we assert that both agree.
+      This is slow, and only meant for debug builds.
+
       If you do this:
         #define KB_TEXT_SHAPE_NO_CRT
       then we do not use the C runtime library.
@@ -515,6 +520,24 @@
 
             You do not need to be in manual break mode for this function to work.
 
+          :kbts_ShapeSetConfigProvider
+          :ShapeSetConfigProvider
+          void kbts_ShapeSetConfigProvider(kbts_shape_context *Context, kbts_shape_config_provider *Provider, void *ProviderData)
+            Makes [Context] ask [Provider] for the shape configs it does not have yet, instead of
+            creating its own.
+            Fonts and shape configs are read-only once created, so a single set of them can be
+            shared by contexts shaping on different threads. Only the contexts and scratchpads
+            are per-thread. [Provider] can be called from every one of those threads, so it has to
+            be thread-safe, and it has to keep returning the same config for the same font and script.
+            The context does not own the configs it gets, and never destroys them.
+
+          :kbts_ShapeSetBreakCache
+          :ShapeSetBreakCache
+          void kbts_ShapeSetBreakCache(kbts_shape_context *Context, kbts_break_cache *Cache)
+            Makes [Context] segment the text it gets from kbts_ShapeUtf32 and kbts_ShapeUtf32WithUserId
+            with kbts_BreakAddCodepoints and [Cache]. See kbts_BreakAddCodepoints.
+            The context does not own [Cache], and [Cache] has to outlive it or be unset with 0.
+
           :kbts_ShapeBeginManualRuns
           :ShapeBeginManualRuns
           void kbts_ShapeBeginManualRuns(kbts_shape_context *Context);
@@ -654,6 +677,9 @@
             You can free this buffer once this function returns.
             [OutputMemory] needs to be as big as the [OutputSize] returned by kbts_LoadFont.
             This buffer will be used by [Font] until it is freed by kbts_FreeFont.
+            The blob starts at [Font]->Blob, and might end before the end of [OutputMemory].
+            [Font]->Blob->SizeInBytes is its actual size, e.g. if you want to save it to a file.
+            Memory past that is never touched.
 
           :kbts_FreeFont
           :FreeFont
@@ -722,6 +748,14 @@
             If [Config] was allocated in kbts_CreateShapeConfig, frees all of [Config]'s data.
             Otherwise, nothing is done.
 
+          :kbts_FontSupportsScript
+          :FontSupportsScript
+          int kbts_FontSupportsScript(kbts_font *Font, kbts_script Script)
+            The [return value] is non-zero if [Font]'s GSUB or GPOS tables explicitly list
+            [Script], 0 if not.
+            Fonts that do not list a script can still be used to shape it, so this is only
+            a hint for deciding which shape configs are worth creating ahead of time.
+
         DIRECT:SHAPE SCRATCHPAD
           :kbts_SizeOfShapeScratchpad
           :SizeOfShapeScratchpad
@@ -1053,6 +1087,47 @@
                       scheme to work in fixed memory, so, while any given buffer is consistent
                       with itself, we cannot order multiple buffers together.
 
+          :kbts_BreakAddCodepoints
+          :BreakAddCodepoints
+          int kbts_BreakAddCodepoints(kbts_break_state *State, kbts_break_cache *Cache,
+                                      const int *Codepoints, int CodepointCount,
+                                      kbts_break *Breaks, int BreakCapacity, int *BreakCount)
+            Feeds [Codepoints] to [State], as if you had called kbts_BreakAddCodepoint with a
+            PositionIncrement of 1 on each of them, and kbts_Break after each of them.
+            The breaks are written to [Breaks] in the order kbts_Break would have returned them,
+            and their amount to [BreakCount].
+
+            Returns the number of codepoints that were added. This is less than [CodepointCount]
+            when [Breaks] fills up, in which case you should handle the breaks and call this
+            again with the rest of your codepoints. [BreakCapacity] must be at least 8.
+
+            [Cache] can be 0. Otherwise, [Cache] remembers what the break state machine does
+            on ASCII codepoints, so that runs of ASCII text do not have to go through it again.
+            The breaks are exactly the same as without a cache.
+            A cache can be shared by any number of break states, but not across threads.
+
+          :kbts_SizeOfBreakCache
+          :SizeOfBreakCache
+          int kbts_SizeOfBreakCache(void)
+            Returns the size of a kbts_break_cache, for use with kbts_PlaceBreakCache.
+
+          :kbts_PlaceBreakCache
+          :PlaceBreakCache
+          kbts_break_cache *kbts_PlaceBreakCache(void *Memory)
+            Initializes an empty kbts_break_cache in [Memory], which must be at least
+            kbts_SizeOfBreakCache() bytes, and returns it.
+
+          :kbts_CreateBreakCache
+          :CreateBreakCache
+          kbts_break_cache *kbts_CreateBreakCache(kbts_allocator_function *Allocator, void *AllocatorData)
+            Allocates an empty kbts_break_cache and returns it.
+
+          :kbts_DestroyBreakCache
+          :DestroyBreakCache
+          void kbts_DestroyBreakCache(kbts_break_cache *Cache)
+            If [Cache] was allocated in kbts_CreateBreakCache, frees it.
+            Otherwise, does nothing.
+
           :kbts_BreakEntireString
           :BreakEntireString
           void kbts_BreakEntireString(kbts_direction ParagraphDirection,
@@ -2389,8 +2464,10 @@ enum kbts_blob_version_enum
   KBTS_BLOB_VERSION_INVALID,
   KBTS_BLOB_VERSION_INITIAL,
   KBTS_BLOB_VERSION_REMOVED_SUBTABLE_INFOS_ALIGNED_TABLES,
+  KBTS_BLOB_VERSION_PAGED_GLYPH_MATRICES,
+  KBTS_BLOB_VERSION_DENSE_LOOKUP_TABLES,
 
-  KBTS_BLOB_VERSION_CURRENT = KBTS_BLOB_VERSION_REMOVED_SUBTABLE_INFOS_ALIGNED_TABLES,
+  KBTS_BLOB_VERSION_CURRENT = KBTS_BLOB_VERSION_DENSE_LOOKUP_TABLES,
 };
 
 typedef kbts_u32 kbts_font_style_flags;
@@ -3339,6 +3416,7 @@ typedef struct kbts_glyph_config kbts_glyph_config;
 typedef struct kbts_shape_context kbts_shape_context;
 typedef struct kbts_glyph_storage kbts_glyph_storage;
 typedef struct kbts_shape_scratchpad kbts_shape_scratchpad;
+typedef struct kbts_break_cache kbts_break_cache;
 
 typedef struct kbts_allocator_op_allocate
 {
@@ -3383,6 +3461,8 @@ typedef struct kbts_load_font_state
   
   kbts_u32 GlyphLookupMatrixSizeInBytes;
   kbts_u32 GlyphLookupSubtableMatrixSizeInBytes;
+  kbts_u32 GlyphMatrixPageCapacity;
+  kbts_u32 DenseLookupTableCapacity;
   kbts_u32 TotalSize;
 } kbts_load_font_state;
 
@@ -3402,6 +3482,12 @@ typedef struct kbts_blob_header
   kbts_u32 LookupSubtableIndexOffsetsOffsetFromStartOfFile;
   kbts_u32 SubtableInfosOffsetFromStartOfFile;
 
+  // When this is set, the glyph lookup matrices above are paged, and their pages live here.
+  kbts_u32 GlyphMatrixPagesOffsetFromStartOfFile;
+
+  // The output memory can be larger than the blob, since we do not know how many matrix pages we need until we build them.
+  kbts_u32 SizeInBytes;
+
   kbts_blob_table Tables[KBTS_BLOB_TABLE_ID_COUNT];
 } kbts_blob_header;
 
@@ -3421,6 +3507,10 @@ typedef struct kbts_font
   kbts_load_font_error Error;
 } kbts_font;
 
+// Fonts and shape configs are never written to while shaping, so they can be shared by any number of
+// contexts and scratchpads, on any number of threads.
+typedef kbts_shape_config *kbts_shape_config_provider(void *Data, kbts_font *Font, kbts_script Script, kbts_language Language);
+
 typedef struct kbts_font_info
 {
   char *Strings[KBTS_FONT_INFO_STRING_ID_COUNT];
@@ -3516,23 +3606,28 @@ typedef struct kbts_break_state
   kbts_break Breaks[8];
   kbts_u32 BreakCount;
 
-  kbts_direction ParagraphDirection;
-  kbts_direction UserParagraphDirection;
-
   kbts_u32 CurrentPosition;
   kbts_u32 ParagraphStartPosition;
 
   kbts_u32 LastScriptBreakPosition;
   kbts_u32 LastDirectionBreakPosition;
+
+  kbts_s16 ScriptPositionOffset;
+
+  kbts_bracket Brackets[64];
+  kbts_u32 BracketCount;
+
+  // Everything from here on does not depend on where we are in the text, only on what we have seen.
+  // kbts_break_cache uses this to recognize states it has already been in. See kbts_BreakAddCodepoints.
+  kbts_direction ParagraphDirection;
+  kbts_direction UserParagraphDirection;
+
   kbts_u8 LastScriptBreakScript;
   kbts_u8 LastDirectionBreakDirection;
 
-  kbts_s16 ScriptPositionOffset;
   kbts_u32 ScriptCount;
   kbts_u8 ScriptSet[KBTS_MAXIMUM_CODEPOINT_SCRIPTS];
 
-  kbts_bracket Brackets[64];
-  kbts_u32 BracketCount;
   kbts_break_state_flags Flags;
 
   kbts_u32 FlagState; // u8(kbts_break_flags)x4
@@ -3796,6 +3891,8 @@ KBTS_EXPORT void kbts_ShapeBeginManualRuns(kbts_shape_context *Context);
 KBTS_EXPORT void kbts_ShapeNextManualRun(kbts_shape_context *Context, kbts_direction Direction, kbts_script Script);
 KBTS_EXPORT void kbts_ShapeEndManualRuns(kbts_shape_context *Context);
 KBTS_EXPORT void kbts_ShapeManualBreak(kbts_shape_context *Context);
+KBTS_EXPORT void kbts_ShapeSetConfigProvider(kbts_shape_context *Context, kbts_shape_config_provider *Provider, void *ProviderData);
+KBTS_EXPORT void kbts_ShapeSetBreakCache(kbts_shape_context *Context, kbts_break_cache *Cache);
 KBTS_EXPORT kbts_shape_codepoint_iterator kbts_ShapeCurrentCodepointsIterator(kbts_shape_context *Context);
 KBTS_EXPORT int kbts_ShapeCodepointIteratorIsValid(kbts_shape_codepoint_iterator *It);
 KBTS_EXPORT int kbts_ShapeCodepointIteratorNext(kbts_shape_codepoint_iterator *It, kbts_shape_codepoint *Codepoint, int *CodepointIndex);
@@ -3825,6 +3922,7 @@ KBTS_EXPORT int kbts_SizeOfShapeConfig(kbts_font *Font, kbts_script Script, kbts
 KBTS_EXPORT kbts_shape_config *kbts_PlaceShapeConfig(kbts_font *Font, kbts_script Script, kbts_language Language, void *Memory);
 KBTS_EXPORT kbts_shape_config *kbts_CreateShapeConfig(kbts_font *Font, kbts_script Script, kbts_language Language, kbts_allocator_function *Allocator, void *AllocatorData);
 KBTS_EXPORT void kbts_DestroyShapeConfig(kbts_shape_config *Config);
+KBTS_EXPORT int kbts_FontSupportsScript(kbts_font *Font, kbts_script Script);
 
 // A glyph_storage holds and recycles glyph data.
 KBTS_EXPORT int kbts_InitializeGlyphStorage(kbts_glyph_storage *Storage, kbts_allocator_function *Allocator, void *AllocatorData);
@@ -3873,6 +3971,11 @@ KBTS_EXPORT void kbts_BreakBegin(kbts_break_state *State, kbts_direction Paragra
 KBTS_EXPORT void kbts_BreakAddCodepoint(kbts_break_state *State, int Codepoint, int PositionIncrement, int EndOfText);
 KBTS_EXPORT void kbts_BreakEnd(kbts_break_state *State);
 KBTS_EXPORT int kbts_Break(kbts_break_state *State, kbts_break *Break);
+KBTS_EXPORT int kbts_SizeOfBreakCache(void);
+KBTS_EXPORT kbts_break_cache *kbts_PlaceBreakCache(void *Memory);
+KBTS_EXPORT kbts_break_cache *kbts_CreateBreakCache(kbts_allocator_function *Allocator, void *AllocatorData);
+KBTS_EXPORT void kbts_DestroyBreakCache(kbts_break_cache *Cache);
+KBTS_EXPORT int kbts_BreakAddCodepoints(kbts_break_state *State, kbts_break_cache *Cache, const int *Codepoints, int CodepointCount, kbts_break *Breaks, int BreakCapacity, int *BreakCount);
 KBTS_EXPORT void kbts_BreakEntireString(kbts_direction Direction, kbts_japanese_line_break_style JapaneseLineBreakStyle, kbts_break_config_flags ConfigFlags, const void *Input, int InputSizeInBytes, kbts_text_format InputFormat, kbts_break *Breaks, int BreakCapacity, int *BreakCount, kbts_break_flags *BreakFlags, int BreakFlagCapacity, int *BreakFlagCount);
 KBTS_EXPORT void kbts_BreakEntireStringUtf32(kbts_direction Direction, kbts_japanese_line_break_style JapaneseLineBreakStyle, kbts_break_config_flags ConfigFlags, const int *Utf32, int Utf32Count, kbts_break *Breaks, int BreakCapacity, int *BreakCount, kbts_break_flags *BreakFlags, int BreakFlagCapacity, int *BreakFlagCount);
 KBTS_EXPORT void kbts_BreakEntireStringUtf8(kbts_direction Direction, kbts_japanese_line_break_style JapaneseLineBreakStyle, kbts_break_config_flags ConfigFlags, const char *Utf8, int Utf8Length, kbts_break *Breaks, int BreakCapacity, int *BreakCount, kbts_break_flags *BreakFlags, int BreakFlagCapacity, int *BreakFlagCount);
@@ -3889,6 +3992,7 @@ KBTS_EXPORT int  kbts_FontCoverageTestEnd(kbts_font_coverage_test *Test);
 KBTS_EXPORT kbts_decode kbts_DecodeUtf8(const char *Utf8, kbts_un Length);
 KBTS_EXPORT kbts_encode_utf8 kbts_EncodeUtf8(int Codepoint);
 KBTS_EXPORT kbts_direction kbts_ScriptDirection(kbts_script Script);
+KBTS_EXPORT kbts_unicode_bidirectional_class kbts_CodepointBidirectionalClass(int Codepoint);
 KBTS_EXPORT int kbts_ScriptIsComplex(kbts_script Script);
 KBTS_EXPORT kbts_script kbts_ScriptTagToScript(kbts_script_tag Tag);
 
@@ -3940,6 +4044,18 @@ KBTS_EXPORT kbts_script kbts_ScriptTagToScript(kbts_script_tag Tag);
 #define KBTS__DELETED_SORT_KEY 0xFFFFFFFF
 
 #define KBTS__BUCKETED_GLYPHS_PER_BLOCK 64
+
+#define KBTS__GLYPH_MATRIX_PAGE_SIZE 256 // In glyphs.
+#define KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT (KBTS__GLYPH_MATRIX_PAGE_SIZE / 32)
+#define KBTS__GLYPH_MATRIX_EMPTY_PAGE 0
+#define KBTS__GLYPH_MATRIX_FULL_PAGE 1
+#define KBTS__GLYPH_MATRIX_MAX_PAGE_COUNT 65536
+#define KBTS__DENSE_GLYPH_MATRICES_MAX_SIZE (64 * 1024) // In bytes.
+
+#define KBTS__DENSE_LOOKUP_TABLE_FORMAT 0x8000 // Not an OpenType format. See kbts__dense_lookup_table.
+#define KBTS__DENSE_LOOKUP_TABLE_MIN_COUNT 4 // In glyphs or ranges. Smaller tables are cheap to search, and too small to hold the header.
+#define KBTS__DENSE_LOOKUP_TABLE_MAX_GROWTH 16 // Values can take this many times the size of the table they replace.
+
 #define KBTS_LOOKUP_STACK_SIZE 32
 
 #  ifndef KBTS_ASSERT
@@ -4050,6 +4166,17 @@ KBTS_INLINE kbts_u32 kbts__LsbPositionOrBitWidth32(kbts_u32 X)
 #  endif
 #endif
 
+#include <stddef.h> // offsetof
+
+#ifndef KBTS__SSE2
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#    define KBTS__SSE2 1
+#  else
+#    define KBTS__SSE2 0
+#  endif
+#endif
+
 #define KBTS__FEATURE_FLAG0(Feature) (1ull << KBTS__FEATURE_ID_##Feature)
 #define KBTS__FEATURE_FLAG1(Feature) (1ull << (KBTS__FEATURE_ID_##Feature - 64))
 #define KBTS__FEATURE_FLAG2(Feature) (1ull << (KBTS__FEATURE_ID_##Feature - 128))
@@ -13357,6 +13484,28 @@ typedef struct kbts__bucketed_glyph_block
   kbts__bucketed_glyph Glyphs[KBTS__BUCKETED_GLYPHS_PER_BLOCK];
 } kbts__bucketed_glyph_block;
 
+typedef struct kbts__glyph_matrix_page_allocator
+{
+  kbts_u32 *Pages;
+  kbts_un PageCount;
+  kbts_un PageCapacity;
+} kbts__glyph_matrix_page_allocator;
+
+// A bit per (lookup or lookup subtable, glyph id) pair, set when the lookup might apply to the glyph.
+// Dense matrices are rows of GlyphCount bits. That is a lot for fonts with tens of thousands of glyphs and hundreds of
+// lookups, so those get paged matrices: rows are split in pages of KBTS__GLYPH_MATRIX_PAGE_SIZE glyphs, and PageIndices
+// says which of the font's pages holds each of them. Most lookups only cover a few pages, and all of the empty ones are
+// page KBTS__GLYPH_MATRIX_EMPTY_PAGE, so a lookup stays a couple of loads.
+typedef struct kbts__glyph_matrix
+{
+  kbts_u32 *Words;
+  kbts_u16 *PageIndices; // 0 when the matrix is dense.
+  kbts_un RowPageCount;
+  kbts_un GlyphCount;
+
+  kbts__glyph_matrix_page_allocator *PageAllocator; // Only while building the blob.
+} kbts__glyph_matrix;
+
 #define KBTS_MAX_SIMULTANEOUS_FEATURES 32
 typedef struct kbts_shape_scratchpad
 {
@@ -13368,7 +13517,7 @@ typedef struct kbts_shape_scratchpad
 
   kbts_shape_config *Config;
 
-  kbts_u32 *GlyphLookupSubtableMatrix;
+  kbts__glyph_matrix GlyphLookupSubtableMatrix;
   kbts_u32 *LookupSubtableIndexOffsets;
   kbts_u32 GlyphIdCount;
   kbts_u32 LookupSubtableCount;
@@ -13411,6 +13560,7 @@ typedef struct kbts__existing_shape_config
 
   kbts_font *Font;
   kbts_script Script;
+  kbts_language Language;
 } kbts__existing_shape_config;
 
 typedef kbts_u32 kbts__context_flags;
@@ -13509,6 +13659,11 @@ typedef struct kbts_shape_context
   kbts_shape_codepoint_iterator RunCodepointIterator;
   kbts_b32 DoneShapingRuns;
 
+  kbts_shape_config_provider *ConfigProvider;
+  void *ConfigProviderData;
+
+  kbts_break_cache *BreakCache;
+
   kbts__existing_shape_config_block_header ExistingShapeConfigBlockSentinel;
   kbts__existing_glyph_config_block_header ExistingGlyphConfigBlockSentinel;
 
@@ -13966,6 +14121,20 @@ typedef struct kbts__class_range_record
   kbts_u16 Class;
 } kbts__class_range_record;
 
+// Coverage and class definition tables get looked up for every glyph in every lookup we try, and binary searching
+// the big ones shows up in profiles of Arabic and Myanmar text.
+// kbts_PlaceBlob overwrites those tables with this header, which is never bigger than the table it replaces, and
+// stores one value per glyph at the end of the blob, so that a lookup is a single load.
+// Values are the glyph's coverage index or class plus one, and 0 for glyphs that the original table did not have.
+typedef struct kbts__dense_lookup_table
+{
+  kbts_u16 Format; // KBTS__DENSE_LOOKUP_TABLE_FORMAT.
+  kbts_u16 StartGlyphId;
+  kbts_u16 GlyphCount;
+  kbts_u16 Unused;
+  kbts_u32 ValuesOffset; // From the start of the table. Unaligned.
+} kbts__dense_lookup_table;
+
 typedef struct kbts__sequence_lookup_record
 {
   kbts_u16 SequenceIndex;
@@ -15243,9 +15412,33 @@ typedef struct kbts__byteswap_context
   kbts_un PointerCapacity;
   kbts_un PointerCount;
 
+  // Tables that we might turn into kbts__dense_lookup_tables, as (kbts__dense_lookup_table_kind, offset) pairs.
+  // They are stacked down from the end of Pointers, which gives up that space.
+  kbts_un DenseLookupTableCandidateCount;
+
   int Error;
 } kbts__byteswap_context;
 
+typedef kbts_u32 kbts__dense_lookup_table_kind;
+enum kbts__dense_lookup_table_kind_enum
+{
+  KBTS__DENSE_LOOKUP_TABLE_KIND_COVERAGE,
+  KBTS__DENSE_LOOKUP_TABLE_KIND_CLASS_DEFINITION,
+};
+
+static void kbts__PushDenseLookupTableCandidate(kbts__byteswap_context *Context, kbts__dense_lookup_table_kind Kind, void *Table)
+{
+  // Every candidate is at least 12 bytes of GSUB, GPOS or GDEF, and we have 2 pointers for every 4 bytes of those,
+  // so this leaves plenty of room for visited pointers.
+  if(!Context->Error && ((Context->PointerCount + 2) <= Context->PointerCapacity))
+  {
+    Context->PointerCapacity -= 2;
+    Context->Pointers[Context->PointerCapacity] = Kind;
+    Context->Pointers[Context->PointerCapacity + 1] = KBTS__POINTER_DIFF32(Table, Context->FileBase);
+    Context->DenseLookupTableCandidateCount += 1;
+  }
+}
+
 static int kbts__ByteSwapArray16Context(kbts_u16 *Array, kbts_un Count, kbts__byteswap_context *Context)
 {
   int Result = kbts__ByteSwapArray16(Array, Count, Context->FileEnd);
@@ -15574,6 +15767,11 @@ static void kbts__ByteSwapCoverage(kbts__byteswap_context *Context, kbts__covera
     }
 
     kbts__ByteSwapArray16Context(KBTS__POINTER_AFTER(kbts_u16, Coverage), U16Count, Context);
+
+    if(U16Count && (Coverage->Count >= KBTS__DENSE_LOOKUP_TABLE_MIN_COUNT))
+    {
+      kbts__PushDenseLookupTableCandidate(Context, KBTS__DENSE_LOOKUP_TABLE_KIND_COVERAGE, Coverage);
+    }
   }
 }
 
@@ -15735,6 +15933,12 @@ static void kbts__ByteSwapClassDefinition(kbts__byteswap_context *Context, kbts_
       ClassDef->Count = kbts__ByteSwap16(ClassDef->Count);
 
       kbts__ByteSwapArray16Context(KBTS__POINTER_AFTER(kbts_u16, ClassDef), ClassDef->Count * 3, Context);
+
+      // Format 1 is already an array.
+      if(ClassDef->Count >= KBTS__DENSE_LOOKUP_TABLE_MIN_COUNT)
+      {
+        kbts__PushDenseLookupTableCandidate(Context, KBTS__DENSE_LOOKUP_TABLE_KIND_CLASS_DEFINITION, ClassDef);
+      }
     }
   }
 }
@@ -15745,6 +15949,20 @@ typedef struct kbts__glyph_class_from_table_result
   kbts_u16 Class;
 } kbts__glyph_class_from_table_result;
 
+static kbts_un kbts__DenseLookupTableValue(kbts__dense_lookup_table *Table, kbts_un GlyphId)
+{
+  kbts_un Result = 0;
+
+  kbts_un Offset = GlyphId - Table->StartGlyphId;
+  if(Offset < Table->GlyphCount)
+  {
+    kbts_u16 *Values = KBTS__POINTER_OFFSET(kbts_u16, Table, kbts__ReadU32Unaligned(&Table->ValuesOffset));
+    Result = Values[Offset];
+  }
+
+  return Result;
+}
+
 static kbts__glyph_class_from_table_result kbts__GlyphClassFromTable(kbts_u16 *ClassDefinitionBase, kbts_un Id)
 {
   kbts__glyph_class_from_table_result Result = KBTS__ZERO;
@@ -15792,6 +16010,16 @@ static kbts__glyph_class_from_table_result kbts__GlyphClassFromTable(kbts_u16 *C
       }
     }
   }
+  else if(*ClassDefinitionBase == KBTS__DENSE_LOOKUP_TABLE_FORMAT)
+  {
+    kbts_un Value = kbts__DenseLookupTableValue((kbts__dense_lookup_table *)ClassDefinitionBase, Id);
+
+    if(Value)
+    {
+      Result.Class = (kbts_u16)(Value - 1);
+      Result.Found = 1;
+    }
+  }
 
   return Result;
 }
@@ -15802,7 +16030,17 @@ static kbts__cover_glyph_result kbts__CoverGlyph(kbts__coverage *Coverage, kbts_
   kbts__cover_glyph_result Result = KBTS__ZERO;
   kbts_un Count = Coverage->Count;
 
-  if(Count)
+  if(Coverage->Format == KBTS__DENSE_LOOKUP_TABLE_FORMAT)
+  {
+    kbts_un Value = kbts__DenseLookupTableValue((kbts__dense_lookup_table *)Coverage, GlyphId);
+
+    if(Value)
+    {
+      Result.Valid = 1;
+      Result.Index = (kbts_u32)(Value - 1);
+    }
+  }
+  else if(Count)
   {
     if(Coverage->Format == 1)
     {
@@ -16130,6 +16368,69 @@ static kbts__matrix_index kbts__GlyphLookupSubtableMatrixIndex(kbts_un SubtableI
   return Result;
 }
 
+static kbts_un kbts__GlyphMatrixRowPageCount(kbts_un GlyphCount)
+{
+  kbts_un Result = (GlyphCount + KBTS__GLYPH_MATRIX_PAGE_SIZE - 1) / KBTS__GLYPH_MATRIX_PAGE_SIZE;
+  return Result;
+}
+
+static kbts__glyph_matrix kbts__GetGlyphMatrix(kbts_blob_header *Blob, kbts_un OffsetFromStartOfFile)
+{
+  kbts__glyph_matrix Result = KBTS__ZERO;
+
+  if(OffsetFromStartOfFile)
+  {
+    Result.GlyphCount = Blob->GlyphCount;
+
+    if(Blob->GlyphMatrixPagesOffsetFromStartOfFile)
+    {
+      Result.Words = KBTS__POINTER_OFFSET(kbts_u32, Blob, Blob->GlyphMatrixPagesOffsetFromStartOfFile);
+      Result.PageIndices = KBTS__POINTER_OFFSET(kbts_u16, Blob, OffsetFromStartOfFile);
+      Result.RowPageCount = kbts__GlyphMatrixRowPageCount(Blob->GlyphCount);
+    }
+    else
+    {
+      Result.Words = KBTS__POINTER_OFFSET(kbts_u32, Blob, OffsetFromStartOfFile);
+    }
+  }
+
+  return Result;
+}
+
+static kbts__matrix_index kbts__GlyphMatrixIndex(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_un GlyphId)
+{
+  kbts__matrix_index Result;
+
+  if(Matrix->PageIndices)
+  {
+    kbts_un PageIndex = Matrix->PageIndices[Row * Matrix->RowPageCount + GlyphId / KBTS__GLYPH_MATRIX_PAGE_SIZE];
+    kbts_un FlatIndex = PageIndex * KBTS__GLYPH_MATRIX_PAGE_SIZE + GlyphId % KBTS__GLYPH_MATRIX_PAGE_SIZE;
+
+    Result.WordIndex = FlatIndex / 32;
+    Result.BitIndex = FlatIndex % 32;
+  }
+  else
+  {
+    Result = kbts__GlyphLookupMatrixIndex(Row, GlyphId, Matrix->GlyphCount);
+  }
+
+  return Result;
+}
+
+static kbts_b32 kbts__GlyphMatrixContains(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_un GlyphId)
+{
+  kbts__matrix_index Index = kbts__GlyphMatrixIndex(Matrix, Row, GlyphId);
+  kbts_b32 Result = (Matrix->Words[Index.WordIndex] >> Index.BitIndex) & 1;
+  return Result;
+}
+
+// Pages of dense matrices are never empty, since we do not know without looking at their bits.
+static kbts_b32 kbts__GlyphMatrixPageIsEmpty(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_un PageIndex)
+{
+  kbts_b32 Result = Matrix->PageIndices && (Matrix->PageIndices[Row * Matrix->RowPageCount + PageIndex] == KBTS__GLYPH_MATRIX_EMPTY_PAGE);
+  return Result;
+}
+
 static kbts_un kbts__FlatLookupIndex(kbts_shape_scratchpad *Scratchpad, kbts_shaping_table ShapingTable, kbts_un LookupIndex)
 {
   kbts_un Result = (ShapingTable == KBTS_SHAPING_TABLE_GSUB) ? LookupIndex : (LookupIndex + Scratchpad->GposLookupIndexOffset);
@@ -16143,12 +16444,10 @@ static kbts_b32 kbts__GlyphIncludedInLookupSubtable(kbts_shape_scratchpad *Scrat
   KBTS_INSTRUMENT_FUNCTION_BEGIN;
   kbts_b32 Result = 1;
 
-  if(Scratchpad->GlyphLookupSubtableMatrix)
+  if(Scratchpad->GlyphLookupSubtableMatrix.Words)
   {
-    kbts_u32 *GlyphLookupSubtableMatrix = Scratchpad->GlyphLookupSubtableMatrix;
     kbts_u32 *LookupSubtableIndexOffsets = Scratchpad->LookupSubtableIndexOffsets;
     kbts_un GlyphCount = Scratchpad->GlyphIdCount;
-    kbts_un SubtableCount = Scratchpad->LookupSubtableCount;
 
     kbts_un FlatLookupIndex = kbts__FlatLookupIndex(Scratchpad, ShapingTable, LookupIndex);
     kbts_un FlatSubtableIndex = LookupSubtableIndexOffsets[FlatLookupIndex] + SubtableIndex;
@@ -16157,8 +16456,7 @@ static kbts_b32 kbts__GlyphIncludedInLookupSubtable(kbts_shape_scratchpad *Scrat
 
     if(Id < GlyphCount)
     {
-      kbts__matrix_index MatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(FlatSubtableIndex, SubtableCount, Id, GlyphCount);
-      if(!(GlyphLookupSubtableMatrix[MatrixIndex.WordIndex] & (1u << MatrixIndex.BitIndex)))
+      if(!kbts__GlyphMatrixContains(&Scratchpad->GlyphLookupSubtableMatrix, FlatSubtableIndex, Id))
       {
         Result = 0;
       }
@@ -16826,6 +17124,44 @@ static int kbts__ShaperRtl(kbts_shaper Shaper)
   return Result;
 }
 
+KBTS_EXPORT int kbts_FontSupportsScript(kbts_font *Font, kbts_script Script)
+{
+  int Result = 0;
+
+  if(Font && Font->Blob && (Script < KBTS_SCRIPT_COUNT))
+  {
+    kbts__gsub_gpos *ShapingTables[2] = {
+      kbts__BlobTableDataType(Font->Blob, KBTS_BLOB_TABLE_ID_GSUB, kbts__gsub_gpos),
+      kbts__BlobTableDataType(Font->Blob, KBTS_BLOB_TABLE_ID_GPOS, kbts__gsub_gpos),
+    };
+    kbts_u32 DesiredTag = kbts__ScriptProperties[Script].Tag;
+
+    KBTS__FOR(ShapingTableIndex, 0, KBTS_SHAPING_TABLE_COUNT)
+    {
+      kbts__gsub_gpos *ShapingTable = ShapingTables[ShapingTableIndex];
+      if(ShapingTable && !Result)
+      {
+        kbts__script_list *ScriptList = KBTS__POINTER_OFFSET(kbts__script_list, ShapingTable, ShapingTable->ScriptListOffset);
+
+        KBTS__FOR(ScriptIndex, 0, ScriptList->Count)
+        {
+          kbts_u32 Tag = kbts__GetScript(ScriptList, ScriptIndex).Tag;
+
+          // Same Indic3 matching as kbts__PlaceShapeConfig.
+          kbts_u32 MatchMask = ((Tag >> 24) == '3') ? 0xFFFFFF : 0xFFFFFFFF;
+          if(!((Tag ^ DesiredTag) & MatchMask))
+          {
+            Result = 1;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  return Result;
+}
+
 KBTS_EXPORT int kbts_CodepointToGlyphId(kbts_font *Font, int ICodepoint)
 {
   int Result = 0;
@@ -17663,10 +17999,7 @@ KBTS_EXPORT kbts_shape_scratchpad *kbts_PlaceShapeScratchpad(kbts_shape_config *
       Result->LookupSubtableCount = Blob->LookupSubtableCount;
       Result->GposLookupIndexOffset = Blob->GposLookupIndexOffset;
 
-      if(Blob->GlyphLookupSubtableMatrixOffsetFromStartOfFile)
-      {
-        Result->GlyphLookupSubtableMatrix = KBTS__POINTER_OFFSET(kbts_u32, Blob, Blob->GlyphLookupSubtableMatrixOffsetFromStartOfFile);
-      }
+      Result->GlyphLookupSubtableMatrix = kbts__GetGlyphMatrix(Blob, Blob->GlyphLookupSubtableMatrixOffsetFromStartOfFile);
 
       if(Blob->LookupSubtableIndexOffsetsOffsetFromStartOfFile)
       {
@@ -23224,7 +23557,8 @@ static kbts_shape_config *kbts__PlaceShapeConfig(kbts_font *Font, kbts_script Sc
     { // Initialize sequential lookups.
       kbts_un GlyphCount = Font->Blob->GlyphCount;
 
-      kbts_u32 *GlyphLookupMatrix = KBTS__POINTER_OFFSET(kbts_u32, Font->Blob, Font->Blob->GlyphLookupMatrixOffsetFromStartOfFile);
+      kbts__glyph_matrix GlyphLookupMatrix = kbts__GetGlyphMatrix(Font->Blob, Font->Blob->GlyphLookupMatrixOffsetFromStartOfFile);
+      kbts_un GlyphPageCount = kbts__GlyphMatrixRowPageCount(GlyphCount);
       kbts_un GposLookupIndexOffset = Font->Blob->GposLookupIndexOffset;
 
       kbts__sequential_lookup *SequentialLookups = 0;
@@ -23408,13 +23742,21 @@ static kbts_shape_config *kbts__PlaceShapeConfig(kbts_font *Font, kbts_script Sc
                   if(Iter && Memory && DefaultEnabled)
                   {
                     kbts_un FlatLookupIndex = (ShapingTable == KBTS_SHAPING_TABLE_GSUB) ? LowestLookupIndex : (LowestLookupIndex + GposLookupIndexOffset);
-                    KBTS__FOR(GlyphIndex, 0, GlyphCount)
+                    KBTS__FOR(GlyphPageIndex, 0, GlyphPageCount)
                     {
-                      kbts__matrix_index MatrixIndex = kbts__GlyphLookupMatrixIndex(FlatLookupIndex, GlyphIndex, GlyphCount);
-                      if(GlyphLookupMatrix[MatrixIndex.WordIndex] & (1u << MatrixIndex.BitIndex))
+                      if(!kbts__GlyphMatrixPageIsEmpty(&GlyphLookupMatrix, FlatLookupIndex, GlyphPageIndex))
                       {
-                        kbts__matrix_index SequentialMatrixIndex = kbts__IdSequentialLookupMatrixIndex(ThisSequentialLookupCount, GlyphIndex, SequentialLookupCount);
-                        IdSequentialLookupMatrix[SequentialMatrixIndex.WordIndex] |= 1u << SequentialMatrixIndex.BitIndex;
+                        kbts_un FirstGlyphIndex = GlyphPageIndex * KBTS__GLYPH_MATRIX_PAGE_SIZE;
+                        kbts_un OnePastLastGlyphIndex = KBTS__MIN(FirstGlyphIndex + KBTS__GLYPH_MATRIX_PAGE_SIZE, GlyphCount);
+
+                        KBTS__FOR(GlyphIndex, FirstGlyphIndex, OnePastLastGlyphIndex)
+                        {
+                          if(kbts__GlyphMatrixContains(&GlyphLookupMatrix, FlatLookupIndex, GlyphIndex))
+                          {
+                            kbts__matrix_index SequentialMatrixIndex = kbts__IdSequentialLookupMatrixIndex(ThisSequentialLookupCount, GlyphIndex, SequentialLookupCount);
+                            IdSequentialLookupMatrix[SequentialMatrixIndex.WordIndex] |= 1u << SequentialMatrixIndex.BitIndex;
+                          }
+                        }
                       }
                     }
                   }
@@ -23638,6 +23980,14 @@ KBTS_EXPORT kbts_direction kbts_ScriptDirection(kbts_script Script)
   return Result;
 }
 
+// Segmentation already resolves every codepoint to a direction. This is for callers that need to
+// tell numbers apart, e.g. to compute embedding levels.
+KBTS_EXPORT kbts_unicode_bidirectional_class kbts_CodepointBidirectionalClass(int Codepoint)
+{
+  kbts_unicode_bidirectional_class Result = kbts__GetUnicodeBidirectionalClass((kbts_u32)Codepoint);
+  return Result;
+}
+
 static kbts__context_font *kbts__ShapePushFont(kbts_shape_context *Context)
 {
   kbts__context_font *Result = 0;
@@ -24236,72 +24586,77 @@ KBTS_EXPORT int kbts_ShapeGetShapeCodepoint(kbts_shape_context *Context, int Cod
   return Result;
 }
 
-static void kbts__UpdateBreaks(kbts_shape_context *Context)
+static void kbts__ApplyBreak(kbts_shape_context *Context, kbts_break *Break)
 {
-  if(!(Context->Flags & KBTS__CONTEXT_FLAG_MANUAL_SEGMENTATION))
+  // Strictly speaking, we do not need all of the flags, but we record them all anyway so we can expose them to the user.
+  kbts_un BreakPosition = (kbts_u32)Break->Position + Context->BreakStartIndex;
+  kbts_shape_codepoint *InputCodepoint = kbts__InputCodepoint(Context, BreakPosition);
+
+  if(Break->Flags & KBTS_BREAK_FLAG_LINE_HARD)
   {
-    kbts_break Break;
-    while(kbts_Break(&Context->BreakState, &Break))
-    {
-      // Strictly speaking, we do not need all of the flags, but we record them all anyway so we can expose them to the user.
-      kbts_un BreakPosition = (kbts_u32)Break.Position + Context->BreakStartIndex;
-      kbts_shape_codepoint *InputCodepoint = kbts__InputCodepoint(Context, BreakPosition);
+    Context->LastLineBreakIndex = (kbts_u32)BreakPosition;
+  }
 
-      if(Break.Flags & KBTS_BREAK_FLAG_LINE_HARD)
-      {
-        Context->LastLineBreakIndex = (kbts_u32)BreakPosition;
-      }
+  if(Break->Flags & KBTS_BREAK_FLAG_GRAPHEME)
+  {
+    // Try fonts, potentially break run.
+    kbts_font *MatchFont = 0;
 
-      if(Break.Flags & KBTS_BREAK_FLAG_GRAPHEME)
-      {
-        // Try fonts, potentially break run.
-        kbts_font *MatchFont = 0;
+    for(kbts_un FontIndex = Context->FontCount;
+        FontIndex;
+        --FontIndex)
+    {
+      kbts_font *Font = Context->Fonts[FontIndex - 1].Font;
+      kbts_font_coverage_test CoverageTest;
+      kbts_FontCoverageTestBegin(&CoverageTest, Font);
 
-        for(kbts_un FontIndex = Context->FontCount;
-            FontIndex;
-            --FontIndex)
-        {
-          kbts_font *Font = Context->Fonts[FontIndex - 1].Font;
-          kbts_font_coverage_test CoverageTest;
-          kbts_FontCoverageTestBegin(&CoverageTest, Font);
+      kbts_shape_codepoint_iterator It = kbts__InputCodepointIterator(Context, Context->LastGraphemeBreakIndex, BreakPosition);
 
-          kbts_shape_codepoint_iterator It = kbts__InputCodepointIterator(Context, Context->LastGraphemeBreakIndex, BreakPosition);
+      while(kbts__NextInputCodepoint(&It, 0))
+      {
+        kbts_shape_codepoint *GraphemeCodepoint = It.Codepoint;
 
-          while(kbts__NextInputCodepoint(&It, 0))
-          {
-            kbts_shape_codepoint *GraphemeCodepoint = It.Codepoint;
+        kbts_FontCoverageTestCodepoint(&CoverageTest, GraphemeCodepoint->Codepoint);
+      }
 
-            kbts_FontCoverageTestCodepoint(&CoverageTest, GraphemeCodepoint->Codepoint);
-          }
+      kbts_FontCoverageTestEnd(&CoverageTest);
 
-          kbts_FontCoverageTestEnd(&CoverageTest);
+      if(!CoverageTest.Error)
+      {
+        MatchFont = Font;
 
-          if(!CoverageTest.Error)
-          {
-            MatchFont = Font;
+        break;
+      }
+    }
 
-            break;
-          }
-        }
+    Context->LastGraphemeBreak->Font = MatchFont;
+    Context->LastGraphemeBreak = InputCodepoint;
+    Context->LastGraphemeBreakIndex = (kbts_u32)BreakPosition;
+  }
 
-        Context->LastGraphemeBreak->Font = MatchFont;
-        Context->LastGraphemeBreak = InputCodepoint;
-        Context->LastGraphemeBreakIndex = (kbts_u32)BreakPosition;
-      }
+  InputCodepoint->BreakFlags |= Break->Flags;
+  if(Break->Flags & KBTS_BREAK_FLAG_SCRIPT)
+  {
+    InputCodepoint->Script = Break->Script;
+  }
+  if(Break->Flags & KBTS_BREAK_FLAG_DIRECTION)
+  {
+    InputCodepoint->Direction = Break->Direction;
+  }
+  if(Break->Flags & KBTS_BREAK_FLAG_PARAGRAPH_DIRECTION)
+  {
+    InputCodepoint->ParagraphDirection = Break->ParagraphDirection;
+  }
+}
 
-      InputCodepoint->BreakFlags |= Break.Flags;
-      if(Break.Flags & KBTS_BREAK_FLAG_SCRIPT)
-      {
-        InputCodepoint->Script = Break.Script;
-      }
-      if(Break.Flags & KBTS_BREAK_FLAG_DIRECTION)
-      {
-        InputCodepoint->Direction = Break.Direction;
-      }
-      if(Break.Flags & KBTS_BREAK_FLAG_PARAGRAPH_DIRECTION)
-      {
-        InputCodepoint->ParagraphDirection = Break.ParagraphDirection;
-      }
+static void kbts__UpdateBreaks(kbts_shape_context *Context)
+{
+  if(!(Context->Flags & KBTS__CONTEXT_FLAG_MANUAL_SEGMENTATION))
+  {
+    kbts_break Break;
+    while(kbts_Break(&Context->BreakState, &Break))
+    {
+      kbts__ApplyBreak(Context, &Break);
     }
   }
 }
@@ -24354,114 +24709,125 @@ KBTS_EXPORT void kbts_ShapeManualBreak(kbts_shape_context *Context)
   kbts_ShapeEndManualRuns(Context);
 }
 
-KBTS_EXPORT void kbts_ShapeCodepointWithUserId(kbts_shape_context *Context, int Codepoint, int UserId)
+static void kbts__UpdateGlyphConfig(kbts_shape_context *Context)
 {
-  if(!Context->Error)
+  if(Context->NeedNewGlyphConfig)
   {
-    if(Context->NeedNewGlyphConfig)
+    kbts_un NewFeatureOverrideCount = Context->ScratchFeatureOverrideCount;
+
+    if(Context->ScratchFeatureOverrideCount)
     {
-      kbts_un NewFeatureOverrideCount = Context->ScratchFeatureOverrideCount;
+      kbts_feature_override UniqueFeatureOverrides[KBTS_MAX_SIMULTANEOUS_FEATURES];
+      kbts_un UniqueFeatureOverrideCount = 0;
 
-      if(Context->ScratchFeatureOverrideCount)
+      for(kbts_un ScratchFeatureOverrideIndex = Context->ScratchFeatureOverrideCount;
+          ScratchFeatureOverrideIndex;
+          --ScratchFeatureOverrideIndex)
       {
-        kbts_feature_override UniqueFeatureOverrides[KBTS_MAX_SIMULTANEOUS_FEATURES];
-        kbts_un UniqueFeatureOverrideCount = 0;
+        kbts_feature_override *ScratchOverride = &Context->ScratchFeatureOverrides[ScratchFeatureOverrideIndex - 1];
+        kbts_u32 ScratchTag = ScratchOverride->Tag;
 
-        for(kbts_un ScratchFeatureOverrideIndex = Context->ScratchFeatureOverrideCount;
-            ScratchFeatureOverrideIndex;
-            --ScratchFeatureOverrideIndex)
+        kbts_b32 Dupe = 0;
+        KBTS__FOR(UniqueFeatureOverrideIndex, 0, UniqueFeatureOverrideCount)
         {
-          kbts_feature_override *ScratchOverride = &Context->ScratchFeatureOverrides[ScratchFeatureOverrideIndex - 1];
-          kbts_u32 ScratchTag = ScratchOverride->Tag;
+          kbts_feature_override *UniqueOverride = &UniqueFeatureOverrides[UniqueFeatureOverrideIndex];
 
-          kbts_b32 Dupe = 0;
-          KBTS__FOR(UniqueFeatureOverrideIndex, 0, UniqueFeatureOverrideCount)
+          if(UniqueOverride->Tag == ScratchTag)
           {
-            kbts_feature_override *UniqueOverride = &UniqueFeatureOverrides[UniqueFeatureOverrideIndex];
-
-            if(UniqueOverride->Tag == ScratchTag)
-            {
-              Dupe = 1;
-              break;
-            }
-          }
-
-          if(!Dupe)
-          {
-            UniqueFeatureOverrides[UniqueFeatureOverrideCount++] = *ScratchOverride;
+            Dupe = 1;
+            break;
           }
         }
 
-        kbts_feature_override *Hoisted = kbts__PushArray(&Context->ScratchArena, kbts_feature_override, UniqueFeatureOverrideCount);
-        if(!Hoisted)
+        if(!Dupe)
         {
-          Context->Error = KBTS_SHAPE_ERROR_OUT_OF_MEMORY;
-          return;
+          UniqueFeatureOverrides[UniqueFeatureOverrideCount++] = *ScratchOverride;
         }
-        KBTS_MEMCPY(Hoisted, Context->ScratchFeatureOverrides, sizeof(*Hoisted) * UniqueFeatureOverrideCount);
-        
-        Context->CurrentFeatureOverrides = Hoisted;
-        NewFeatureOverrideCount = UniqueFeatureOverrideCount;
       }
 
-      Context->CurrentFeatureOverrideCount = (kbts_u32)NewFeatureOverrideCount;
-      Context->NeedNewGlyphConfig = 0;
-    }
-
-    { // Add the codepoint.
-      kbts_un FlatCodepointIndex = Context->InputCodepointCount;
-      kbts_shape_codepoint InputCodepoint = KBTS__ZERO;
-      InputCodepoint.Codepoint = Codepoint;
-      InputCodepoint.UserId = UserId;
-      InputCodepoint.FeatureOverrides = Context->CurrentFeatureOverrides;
-      InputCodepoint.FeatureOverrideCount = Context->CurrentFeatureOverrideCount;
-
-      // @Robustness: There is probably a saner way of doing this.
-      // When we do a manual break, we may have line breaks go out-of-bounds, and we
-      // do not want to lose that information.
-      if(FlatCodepointIndex &&
-         (FlatCodepointIndex == Context->LastLineBreakIndex))
+      kbts_feature_override *Hoisted = kbts__PushArray(&Context->ScratchArena, kbts_feature_override, UniqueFeatureOverrideCount);
+      if(!Hoisted)
       {
-        InputCodepoint.BreakFlags |= KBTS_BREAK_FLAG_LINE;
+        Context->Error = KBTS_SHAPE_ERROR_OUT_OF_MEMORY;
+        return;
       }
+      KBTS_MEMCPY(Hoisted, Context->ScratchFeatureOverrides, sizeof(*Hoisted) * UniqueFeatureOverrideCount);
+      
+      Context->CurrentFeatureOverrides = Hoisted;
+      NewFeatureOverrideCount = UniqueFeatureOverrideCount;
+    }
 
-      if(Context->Flags & KBTS__CONTEXT_FLAG_START_OF_MANUAL_RUN)
-      {
-        InputCodepoint.BreakFlags |= KBTS_BREAK_FLAG_MANUAL;
-
-        if(Context->Flags & KBTS__CONTEXT_FLAG_USE_MANUAL_BREAK_INFO)
-        {
-          InputCodepoint.Direction = Context->ManualRunDirection;
-          InputCodepoint.Script = Context->ManualRunScript;
-        }
+    Context->CurrentFeatureOverrideCount = (kbts_u32)NewFeatureOverrideCount;
+    Context->NeedNewGlyphConfig = 0;
+  }
+}
 
-        Context->Flags &= ~KBTS__CONTEXT_FLAG_START_OF_MANUAL_RUN;
-      }
+static void kbts__PushInputCodepoint(kbts_shape_context *Context, int Codepoint, int UserId)
+{
+  kbts_un FlatCodepointIndex = Context->InputCodepointCount;
+  kbts_shape_codepoint InputCodepoint = KBTS__ZERO;
+  InputCodepoint.Codepoint = Codepoint;
+  InputCodepoint.UserId = UserId;
+  InputCodepoint.FeatureOverrides = Context->CurrentFeatureOverrides;
+  InputCodepoint.FeatureOverrideCount = Context->CurrentFeatureOverrideCount;
 
-      kbts_shape_codepoint *To = kbts__InputCodepoint(Context, FlatCodepointIndex);
-      if(To)
-      {
-        *To = InputCodepoint;
-      }
+  // @Robustness: There is probably a saner way of doing this.
+  // When we do a manual break, we may have line breaks go out-of-bounds, and we
+  // do not want to lose that information.
+  if(FlatCodepointIndex &&
+     (FlatCodepointIndex == Context->LastLineBreakIndex))
+  {
+    InputCodepoint.BreakFlags |= KBTS_BREAK_FLAG_LINE;
+  }
 
-      if(!Context->LastGraphemeBreak)
-      {
-        Context->LastGraphemeBreak = To;
-      }
+  if(Context->Flags & KBTS__CONTEXT_FLAG_START_OF_MANUAL_RUN)
+  {
+    InputCodepoint.BreakFlags |= KBTS_BREAK_FLAG_MANUAL;
 
-      Context->InputCodepointCount += 1;
+    if(Context->Flags & KBTS__CONTEXT_FLAG_USE_MANUAL_BREAK_INFO)
+    {
+      InputCodepoint.Direction = Context->ManualRunDirection;
+      InputCodepoint.Script = Context->ManualRunScript;
     }
 
-    if(!(Context->Flags & KBTS__CONTEXT_FLAG_MANUAL_SEGMENTATION))
-    {
-      // Check for breaks.
-      kbts_BreakAddCodepoint(&Context->BreakState, Codepoint, 1, 0);
+    Context->Flags &= ~KBTS__CONTEXT_FLAG_START_OF_MANUAL_RUN;
+  }
 
-      kbts__UpdateBreaks(Context);
-    }
+  kbts_shape_codepoint *To = kbts__InputCodepoint(Context, FlatCodepointIndex);
+  if(To)
+  {
+    *To = InputCodepoint;
+  }
+
+  if(!Context->LastGraphemeBreak)
+  {
+    Context->LastGraphemeBreak = To;
   }
+
+  Context->InputCodepointCount += 1;
 }
-static void kbts__ShapeCodepoint(kbts_shape_context *Context, int Codepoint, int UserIdIncrement)
+
+KBTS_EXPORT void kbts_ShapeCodepointWithUserId(kbts_shape_context *Context, int Codepoint, int UserId)
+{
+  if(!Context->Error)
+  {
+    kbts__UpdateGlyphConfig(Context);
+  }
+
+  if(!Context->Error)
+  {
+    kbts__PushInputCodepoint(Context, Codepoint, UserId);
+
+    if(!(Context->Flags & KBTS__CONTEXT_FLAG_MANUAL_SEGMENTATION))
+    {
+      // Check for breaks.
+      kbts_BreakAddCodepoint(&Context->BreakState, Codepoint, 1, 0);
+
+      kbts__UpdateBreaks(Context);
+    }
+  }
+}
+static void kbts__ShapeCodepoint(kbts_shape_context *Context, int Codepoint, int UserIdIncrement)
 {
   int UserId = Context->NextUserId;
   Context->NextUserId += UserIdIncrement;
@@ -24475,13 +24841,46 @@ KBTS_EXPORT void kbts_ShapeCodepoint(kbts_shape_context *Context, int Codepoint)
   }
 }
 
-KBTS_EXPORT void kbts_ShapeUtf32WithUserId(kbts_shape_context *Context, int *Utf32, int Length, int BaseUserId, int UserIdIncrement)
+static void kbts__ShapeUtf32(kbts_shape_context *Context, int *Utf32, kbts_un Length, int UserId, int UserIdIncrement)
 {
-  if(!Context->Error && (Length > 0))
+  if(Context->BreakCache && !(Context->Flags & KBTS__CONTEXT_FLAG_MANUAL_SEGMENTATION))
   {
-    int UserId = BaseUserId;
+    kbts__UpdateGlyphConfig(Context);
+
+    while(!Context->Error && Length)
+    {
+      // Breaks are never reported past the codepoint that caused them, so it does not matter that we
+      // add the whole chunk before we look at its breaks.
+      kbts_un ChunkLength = KBTS__MIN(Length, 64);
+
+      KBTS__FOR(ChunkIndex, 0, ChunkLength)
+      {
+        kbts__PushInputCodepoint(Context, Utf32[ChunkIndex], UserId);
+
+        UserId += UserIdIncrement;
+      }
+
+      kbts_un ChunkAt = 0;
+      while(!Context->Error && (ChunkAt < ChunkLength))
+      {
+        kbts_break Breaks[32];
+        int BreakCount = 0;
+        ChunkAt += (kbts_un)kbts_BreakAddCodepoints(&Context->BreakState, Context->BreakCache, Utf32 + ChunkAt, (int)(ChunkLength - ChunkAt),
+                                                    Breaks, (int)KBTS__ARRAY_LENGTH(Breaks), &BreakCount);
+
+        KBTS__FOR(BreakIndex, 0, (kbts_un)BreakCount)
+        {
+          kbts__ApplyBreak(Context, &Breaks[BreakIndex]);
+        }
+      }
 
-    KBTS__FOR(Utf32Index, 0, (kbts_un)Length)
+      Utf32 += ChunkLength;
+      Length -= ChunkLength;
+    }
+  }
+  else
+  {
+    KBTS__FOR(Utf32Index, 0, Length)
     {
       int Codepoint = Utf32[Utf32Index];
       kbts_ShapeCodepointWithUserId(Context, Codepoint, UserId);
@@ -24490,15 +24889,20 @@ KBTS_EXPORT void kbts_ShapeUtf32WithUserId(kbts_shape_context *Context, int *Utf
     }
   }
 }
+KBTS_EXPORT void kbts_ShapeUtf32WithUserId(kbts_shape_context *Context, int *Utf32, int Length, int BaseUserId, int UserIdIncrement)
+{
+  if(!Context->Error && (Length > 0))
+  {
+    kbts__ShapeUtf32(Context, Utf32, (kbts_un)Length, BaseUserId, UserIdIncrement);
+  }
+}
 KBTS_EXPORT void kbts_ShapeUtf32(kbts_shape_context *Context, int *Utf32, int Length)
 {
   if(!Context->Error && (Length > 0))
   {
-    KBTS__FOR(Utf32Index, 0, (kbts_un)Length)
-    {
-      int Codepoint = Utf32[Utf32Index];
-      kbts_ShapeCodepoint(Context, Codepoint);
-    }
+    int UserId = Context->NextUserId;
+    Context->NextUserId += Length;
+    kbts__ShapeUtf32(Context, Utf32, (kbts_un)Length, UserId, 1);
   }
 }
 
@@ -24811,9 +25215,14 @@ KBTS_EXPORT void kbts_DestroyShapeScratchpad(kbts_shape_scratchpad *Scratchpad)
   }
 }
 
+static kbts_b32 kbts__TryShapeSimpleRun(kbts_shape_config *Config, kbts_glyph_storage *Storage, kbts_direction RunDirection);
+
 KBTS_EXPORT kbts_shape_error kbts_ShapeDirect(kbts_shape_scratchpad *Scratchpad, kbts_glyph_storage *Storage, kbts_direction RunDirection, kbts_glyph_iterator *Output)
 {
-  kbts__ShapeDirect(Scratchpad, Storage, RunDirection);
+  if(!kbts__TryShapeSimpleRun(Scratchpad->Config, Storage, RunDirection))
+  {
+    kbts__ShapeDirect(Scratchpad, Storage, RunDirection);
+  }
   kbts_shape_error Result = Scratchpad->Error;
 
   if(!Result)
@@ -24872,7 +25281,8 @@ static kbts_shape_config *kbts__FindOrCreateShapeConfig(kbts_shape_context *Cont
       kbts__existing_shape_config *Existing = &ExistingBlock->Items[ExistingIndex];
 
       if((Existing->Font == Font) &&
-         (Existing->Script == Script))
+         (Existing->Script == Script) &&
+         (Existing->Language == Language))
       {
         Result = Existing->Config;
 
@@ -24901,18 +25311,37 @@ static kbts_shape_config *kbts__FindOrCreateShapeConfig(kbts_shape_context *Cont
       Last = NewBlock;
     }
 
-    Result = kbts_CreateShapeConfig(Font, Script, Language, kbts__ArenaAllocator, &Context->ConfigArena);
+    if(Context->ConfigProvider)
+    {
+      Result = Context->ConfigProvider(Context->ConfigProviderData, Font, Script, Language);
+    }
+    else
+    {
+      Result = kbts_CreateShapeConfig(Font, Script, Language, kbts__ArenaAllocator, &Context->ConfigArena);
+    }
 
     KBTS_ASSERT(Last->Count < KBTS__EXISTING_SHAPE_CONFIGS_PER_BLOCK);
     kbts__existing_shape_config *NewExisting = &Last->Items[Last->Count++];
     NewExisting->Config = Result;
     NewExisting->Font = Font;
     NewExisting->Script = Script;
+    NewExisting->Language = Language;
   }
 
   return Result;
 }
 
+KBTS_EXPORT void kbts_ShapeSetConfigProvider(kbts_shape_context *Context, kbts_shape_config_provider *Provider, void *ProviderData)
+{
+  Context->ConfigProvider = Provider;
+  Context->ConfigProviderData = ProviderData;
+}
+
+KBTS_EXPORT void kbts_ShapeSetBreakCache(kbts_shape_context *Context, kbts_break_cache *Cache)
+{
+  Context->BreakCache = Cache;
+}
+
 static kbts_glyph_config *kbts__FindOrCreateGlyphConfig(kbts_shape_context *Context, kbts_shape_config *ShapeConfig, kbts_feature_override *FeatureOverrides, int FeatureOverrideCount)
 {
   kbts_glyph_config *Result = 0;
@@ -24970,6 +25399,361 @@ static kbts_glyph_config *kbts__FindOrCreateGlyphConfig(kbts_shape_context *Cont
   return Result;
 }
 
+// 64 words is 2048 sequential lookups. Fonts with more than that always go through full shaping.
+#define KBTS__SIMPLE_RUN_MAX_LOOKUP_MASK_WORD_COUNT 64
+
+// Returns a mask of (1 << LookupType) for every subtable of a lookup, with extensions resolved.
+static kbts_u32 kbts__LookupSubtableTypes(kbts__lookup *Lookup, kbts_u16 ExtensionType)
+{
+  kbts_u32 Result = 0;
+  kbts_u16 *SubtableOffsets = KBTS__POINTER_AFTER(kbts_u16, Lookup);
+
+  KBTS__FOR(SubtableIndex, 0, Lookup->SubtableCount)
+  {
+    kbts_u16 *Base = KBTS__POINTER_OFFSET(kbts_u16, Lookup, SubtableOffsets[SubtableIndex]);
+    kbts_u16 Type = Lookup->Type;
+
+    while(Type == ExtensionType)
+    {
+      kbts__extension *Extension = (kbts__extension *)Base;
+
+      Type = Extension->LookupType;
+      Base = KBTS__POINTER_OFFSET(kbts_u16, Extension, Extension->Offset);
+    }
+
+    Result |= 1u << (Type & 31);
+  }
+
+  return Result;
+}
+
+static kbts_b32 kbts__GlyphIsSimple(kbts_glyph *Glyph)
+{
+  // Fraction slashes turn neighboring digits into numerators/denominators.
+  kbts_b32 Result = !Glyph->Config &&
+                    !Glyph->Flags &&
+                    !Glyph->CombiningClass &&
+                    (Glyph->Codepoint != 0x2044) &&
+                    !(Glyph->UnicodeFlags & KBTS_UNICODE_FLAG_DEFAULT_IGNORABLE) &&
+                    (Glyph->Classes.Class != KBTS__GLYPH_CLASS_MARK);
+  return Result;
+}
+
+// A base glyph followed by other base glyphs only ever recomposes with a parent that is a singleton decomposition
+// of it, e.g. K -> U+212A KELVIN SIGN. NORMALIZE picks the first such parent the font supports.
+static kbts_u32 kbts__SupportedSingletonParent(kbts_font *Font, kbts_glyph *Glyph)
+{
+  kbts_u32 Result = 0;
+  kbts_s32 *ParentDeltas = kbts__GetParentInfoDeltas(Glyph->ParentInfo);
+
+  KBTS__FOR(ParentIndex, 0, kbts__GetParentInfoCount(Glyph->ParentInfo))
+  {
+    kbts_u32 ParentCodepoint = Glyph->Codepoint + (kbts_u32)ParentDeltas[ParentIndex];
+
+    if((kbts__GetDecompositionSize(kbts__GetUnicodeDecomposition(ParentCodepoint)) == 1) &&
+       kbts_CodepointToGlyphId(Font, (int)ParentCodepoint))
+    {
+      Result = ParentCodepoint;
+      break;
+    }
+  }
+
+  return Result;
+}
+
+// Most runs of Latin/Greek/Cyrillic text are left untouched by GSUB, and only get kerned by GPOS.
+// For those runs, bucketing glyphs and going through the op machinery is a lot of work for nothing, so we do
+// the equivalent work directly:
+// - NORMALIZE only ever swaps plain base glyphs for singleton parents, which we replicate.
+// - Every GSUB lookup that covers a glyph is run in check-only mode. If any of them would match, we bail.
+// - GPOS lookups are only allowed to be single/pair adjustments, which we apply in lookup order, just like
+//   GPOS_FEATURES does, on top of hmtx advances.
+// If anything does not qualify, we put the run back the way it was and return 0, and the caller does full shaping.
+// For the runs we accept, the output is identical to that of full shaping.
+static kbts_b32 kbts__ShapeSimpleRun(kbts_shape_config *Config, kbts_glyph_storage *Storage, kbts_direction RunDirection)
+{
+  KBTS_INSTRUMENT_FUNCTION_BEGIN;
+  kbts_b32 Result = 0;
+  kbts_font *Font = Config->Font;
+  kbts_blob_header *Blob = Font->Blob;
+
+  kbts__hea *Hea = kbts__BlobTableDataType(Blob, KBTS_BLOB_TABLE_ID_HHEA, kbts__hea);
+  kbts__long_mtx *LongMetrics = kbts__BlobTableDataType(Blob, KBTS_BLOB_TABLE_ID_HMTX, kbts__long_mtx);
+
+  kbts_un SequentialLookupCount = kbts__SequentialLookupCount(Config);
+  kbts_un RowWordCount = (SequentialLookupCount + 31) / 32;
+
+  // Every GPOS lookup used by the run, so that we do not walk the run once per lookup in the font.
+  kbts_u32 UsedLookupMask[KBTS__SIMPLE_RUN_MAX_LOOKUP_MASK_WORD_COUNT] = KBTS__ZERO;
+
+  if((Config->Shaper == KBTS_SHAPER_DEFAULT) &&
+     (RunDirection == KBTS_DIRECTION_LTR) &&
+     (RowWordCount <= KBTS__SIMPLE_RUN_MAX_LOOKUP_MASK_WORD_COUNT) &&
+     Hea && LongMetrics && Hea->MetricCount)
+  {
+    kbts__gsub_gpos *Gsub = kbts__BlobTableDataType(Blob, KBTS_BLOB_TABLE_ID_GSUB, kbts__gsub_gpos);
+    kbts__gsub_gpos *Gpos = kbts__BlobTableDataType(Blob, KBTS_BLOB_TABLE_ID_GPOS, kbts__gsub_gpos);
+    kbts__gdef *Gdef = kbts__BlobTableDataType(Blob, KBTS_BLOB_TABLE_ID_GDEF, kbts__gdef);
+    kbts_lookup_list *GsubLookupList = Gsub ? kbts__GetLookupList(Gsub) : 0;
+    kbts_lookup_list *GposLookupList = Gpos ? kbts__GetLookupList(Gpos) : 0;
+    kbts_u32 *IdSequentialLookupMatrix = Config->IdSequentialLookupMatrix;
+    kbts_un GsubSequentialLookupCount = kbts__GsubSequentialLookupCount(Config);
+    kbts_glyph *Sentinel = (kbts_glyph *)&Storage->GlyphSentinel;
+    kbts_glyph *OnePastLastNormalizedGlyph = Sentinel;
+
+    // This only holds what GSUB/GPOS lookups read from the scratchpad.
+    kbts_shape_scratchpad Scratchpad = KBTS__ZERO;
+    Scratchpad.Config = Config;
+    Scratchpad.RunDirection = RunDirection;
+    Scratchpad.GlyphIdCount = Blob->GlyphCount;
+    Scratchpad.LookupSubtableCount = Blob->LookupSubtableCount;
+    Scratchpad.GposLookupIndexOffset = Blob->GposLookupIndexOffset;
+    if(Blob->GlyphLookupSubtableMatrixOffsetFromStartOfFile && Blob->LookupSubtableIndexOffsetsOffsetFromStartOfFile)
+    {
+      Scratchpad.GlyphLookupSubtableMatrix = kbts__GetGlyphMatrix(Blob, Blob->GlyphLookupSubtableMatrixOffsetFromStartOfFile);
+      Scratchpad.LookupSubtableIndexOffsets = KBTS__POINTER_OFFSET(kbts_u32, Blob, Blob->LookupSubtableIndexOffsetsOffsetFromStartOfFile);
+    }
+
+    Result = 1;
+
+    // NORMALIZE.
+    kbts_un Uid = 0;
+    KBTS__FOR_GLYPH(Storage, Glyph)
+    {
+      if(!kbts__GlyphIsSimple(Glyph) || kbts__GetDecompositionSize(Glyph->Decomposition))
+      {
+        Result = 0;
+        OnePastLastNormalizedGlyph = Glyph;
+        break;
+      }
+
+      while(Result)
+      {
+        // Recomposition goes back over the recomposed glyph, which gives it a new Uid.
+        Glyph->Uid = (kbts_u16)++Uid;
+
+        kbts_u32 ParentCodepoint = kbts__SupportedSingletonParent(Font, Glyph);
+        if(!ParentCodepoint)
+        {
+          break;
+        }
+
+        kbts_glyph ParentGlyph = kbts_CodepointToGlyph(Font, (int)ParentCodepoint, Glyph->Config, 0);
+        if(kbts__GlyphIsSimple(&ParentGlyph))
+        {
+          kbts__SetGlyphPreserveLinksAndUserId(Glyph, &ParentGlyph);
+        }
+        else
+        {
+          Result = 0;
+        }
+      }
+
+      if(!Result)
+      {
+        OnePastLastNormalizedGlyph = Glyph->Next;
+        break;
+      }
+    }
+
+    // GSUB_FEATURES. Nothing has been substituted in the run, so it is enough to check every glyph against the
+    // original sequence.
+    KBTS__FOR_GLYPH(Storage, Glyph)
+    {
+      if(!Result || (Glyph->Id >= Config->GlyphCount))
+      {
+        break;
+      }
+
+      kbts__matrix_index RowIndex = kbts__IdSequentialLookupMatrixIndex(0, Glyph->Id, SequentialLookupCount);
+      kbts_u32 *Row = &IdSequentialLookupMatrix[RowIndex.WordIndex];
+
+      KBTS__FOR(WordIndex, 0, RowWordCount)
+      {
+        kbts_u32 Bits = Row[WordIndex];
+        UsedLookupMask[WordIndex] |= Bits;
+
+        while(Result && Bits)
+        {
+          kbts_un SequentialLookupIndex = WordIndex * 32 + kbts__LsbPositionOrBitWidth32(Bits);
+          kbts__sequential_lookup *SequentialLookup = &Config->SequentialLookups[SequentialLookupIndex];
+          Bits &= Bits - 1;
+
+          if(SequentialLookupIndex < GsubSequentialLookupCount)
+          {
+            // Lookups that are filtered on glyph flags (numr, dnom, frac...) cannot apply to glyphs with no flags.
+            if(!(SequentialLookup->GlyphFilter & KBTS__GLYPH_FEATURE_MASK))
+            {
+              kbts__lookup *PackedLookup = kbts__GetLookup(GsubLookupList, SequentialLookup->LookupIndex);
+
+              // Reverse chaining substitutions substitute even when checking, so assume they apply.
+              if(kbts__LookupSubtableTypes(PackedLookup, 7) & (1u << 8))
+              {
+                Result = 0;
+              }
+              else
+              {
+                kbts__gsub_frame Frames[2] = KBTS__ZERO;
+                Frames[0].LookupIndex = SequentialLookup->LookupIndex;
+                Frames[0].InputGlyph = Glyph;
+                kbts_un FrameCount = 1;
+
+                kbts__BeginLookupApplication(&Scratchpad, Glyph);
+                kbts__DoSubstitution(&Scratchpad, Config, Storage, GsubLookupList, SequentialLookupIndex, 1, Frames, &FrameCount, 1, SequentialLookup->SkipFlags, 0);
+
+                // Matching a subtable, substitution or sequence, skips the remaining subtables.
+                if(Frames[0].SubtableIndex > PackedLookup->SubtableCount)
+                {
+                  Result = 0;
+                }
+              }
+            }
+          }
+          else if(kbts__LookupSubtableTypes(kbts__GetLookup(GposLookupList, SequentialLookup->LookupIndex), 9) & ~((1u << 1) | (1u << 2)))
+          {
+            // Only single and pair adjustments, which never look further than the next glyph, are supported.
+            Result = 0;
+          }
+        }
+      }
+    }
+
+    if(Result)
+    {
+      // GPOS_METRICS.
+      KBTS__FOR_GLYPH(Storage, Glyph)
+      {
+        kbts_u32 Id = Glyph->Id;
+
+        Glyph->AdvanceX = (Id < Hea->MetricCount) ? LongMetrics[Id].Advance : LongMetrics[Hea->MetricCount - 1].Advance;
+        kbts__SetCursiveFlags(Glyph, 0);
+      }
+
+      // GPOS_FEATURES.
+      KBTS__FOR(SequentialLookupIndex, GsubSequentialLookupCount, SequentialLookupCount)
+      {
+        if(!(UsedLookupMask[SequentialLookupIndex / 32] & (1u << (SequentialLookupIndex % 32))))
+        {
+          continue;
+        }
+
+        kbts__sequential_lookup *SequentialLookup = &Config->SequentialLookups[SequentialLookupIndex];
+        kbts_un LookupIndex = SequentialLookup->LookupIndex;
+        kbts__lookup *PackedLookup = kbts__GetLookup(GposLookupList, LookupIndex);
+        kbts__unpacked_lookup Lookup = kbts__UnpackLookup(Gdef, PackedLookup);
+
+        for(kbts_glyph *Glyph = Storage->GlyphSentinel.Next;
+            kbts__GlyphIsValid(Storage, Glyph);
+            )
+        {
+          kbts_glyph *Next = Glyph->Next;
+
+          if(Glyph->Id < Config->GlyphCount)
+          {
+            kbts__matrix_index MatrixIndex = kbts__IdSequentialLookupMatrixIndex(SequentialLookupIndex, Glyph->Id, SequentialLookupCount);
+
+            if(IdSequentialLookupMatrix[MatrixIndex.WordIndex] & (1u << MatrixIndex.BitIndex))
+            {
+              kbts__BeginLookupApplication(&Scratchpad, Glyph);
+
+              kbts_u16 *SubtableOffsets = KBTS__POINTER_AFTER(kbts_u16, PackedLookup);
+              KBTS__FOR(SubtableIndex, 0, PackedLookup->SubtableCount)
+              {
+                kbts_u16 *Subtable = KBTS__POINTER_OFFSET(kbts_u16, PackedLookup, SubtableOffsets[SubtableIndex]);
+
+                if(kbts__DoSingleAdjustment(&Scratchpad, Config, Storage,
+                                            GposLookupList, LookupIndex, SubtableIndex, &Lookup, Subtable,
+                                            Glyph, 0, SequentialLookup->SkipFlags))
+                {
+                  break;
+                }
+              }
+
+              // A pair adjustment that moves the second glyph also consumes it for this lookup.
+              Next = kbts__EndLookupApplication(&Scratchpad);
+            }
+          }
+
+          Glyph = Next;
+        }
+      }
+    }
+    else
+    {
+      // Undo normalization. Originals never decompose, so anything that does is a recomposed parent.
+      for(kbts_glyph *Glyph = Storage->GlyphSentinel.Next;
+          Glyph != OnePastLastNormalizedGlyph;
+          Glyph = Glyph->Next)
+      {
+        while(kbts__GetDecompositionSize(Glyph->Decomposition))
+        {
+          kbts_glyph Original = kbts_CodepointToGlyph(Font, (int)kbts__GetDecompositionCodepoint(Glyph->Decomposition, 0), Glyph->Config, 0);
+          kbts__SetGlyphPreserveLinksAndUserId(Glyph, &Original);
+        }
+
+        Glyph->Uid = 0;
+      }
+    }
+  }
+
+  KBTS_INSTRUMENT_FUNCTION_END;
+  return Result;
+}
+
+// With KBTS_CHECK_SIMPLE_RUNS defined, every run that takes the simple path is shaped again with the full
+// pipeline, and we assert that both give the same glyphs. This is slow and goes to the CRT heap, so it is opt-in.
+static kbts_b32 kbts__TryShapeSimpleRun(kbts_shape_config *Config, kbts_glyph_storage *Storage, kbts_direction RunDirection)
+{
+  // Runs that none of the fonts cover have no config. Those always go through the full pipeline.
+  kbts_b32 Result = Config && kbts__ShapeSimpleRun(Config, Storage, RunDirection);
+
+#if defined(KBTS_CHECK_SIMPLE_RUNS) && !defined(KB_TEXT_SHAPE_NO_CRT)
+  // Rejected runs are left as they came in, so only accepted runs are checked.
+  // The simple path maps glyphs one to one, and only recomposes singletons, so we can rebuild its input from its output.
+  kbts_shape_scratchpad *Scratchpad = Result ? kbts_CreateShapeScratchpad(Config, 0, 0) : 0;
+  if(Scratchpad)
+  {
+    kbts_glyph_storage Reference = KBTS__ZERO;
+    kbts_InitializeGlyphStorage(&Reference, 0, 0);
+    KBTS__FOR_GLYPH(Storage, Glyph)
+    {
+      kbts_u32 Codepoint = Glyph->Codepoint;
+      kbts_u64 Decomposition = Glyph->Decomposition;
+      while(kbts__GetDecompositionSize(Decomposition))
+      {
+        Codepoint = kbts__GetDecompositionCodepoint(Decomposition, 0);
+        Decomposition = kbts__GetUnicodeDecomposition(Codepoint);
+      }
+
+      kbts_PushGlyph(&Reference, Config->Font, (int)Codepoint, Glyph->Config, Glyph->UserIdOrCodepointIndex);
+    }
+
+    kbts__ShapeDirect(Scratchpad, &Reference, RunDirection);
+
+    if(!Scratchpad->Error && !Reference.Error)
+    {
+      kbts_glyph *Expected = Reference.GlyphSentinel.Next;
+      KBTS__FOR_GLYPH(Storage, Glyph)
+      {
+        KBTS_ASSERT(kbts__GlyphIsValid(&Reference, Expected));
+        KBTS_ASSERT((Glyph->Id == Expected->Id) &&
+                    (Glyph->Codepoint == Expected->Codepoint) &&
+                    (Glyph->UserIdOrCodepointIndex == Expected->UserIdOrCodepointIndex) &&
+                    (Glyph->OffsetX == Expected->OffsetX) && (Glyph->OffsetY == Expected->OffsetY) &&
+                    (Glyph->AdvanceX == Expected->AdvanceX) && (Glyph->AdvanceY == Expected->AdvanceY));
+        Expected = Expected->Next;
+      }
+      KBTS_ASSERT(!kbts__GlyphIsValid(&Reference, Expected));
+    }
+
+    kbts_FreeAllGlyphs(&Reference);
+    kbts_DestroyShapeScratchpad(Scratchpad);
+  }
+#endif
+
+  return Result;
+}
+
 KBTS_EXPORT int kbts_ShapeRun(kbts_shape_context *Context, kbts_run *Run)
 {
   int Result = 0;
@@ -25126,15 +25910,18 @@ KBTS_EXPORT int kbts_ShapeRun(kbts_shape_context *Context, kbts_run *Run)
           }
         }
 
-        // @Memory: Store this alongside the shape_config!
-        kbts_un ScratchpadSize = kbts_SizeOfShapeScratchpad(ShapeConfig);
-        kbts_shape_scratchpad *Scratchpad = kbts_PlaceShapeScratchpad(ShapeConfig, kbts__PushSize(&Context->ScratchArena, ScratchpadSize, 8), kbts__ArenaAllocator, &Context->ScratchArena);
+        if(!kbts__TryShapeSimpleRun(ShapeConfig, &Context->GlyphStorage, RunDirection))
+        {
+          // @Memory: Store this alongside the shape_config!
+          kbts_un ScratchpadSize = kbts_SizeOfShapeScratchpad(ShapeConfig);
+          kbts_shape_scratchpad *Scratchpad = kbts_PlaceShapeScratchpad(ShapeConfig, kbts__PushSize(&Context->ScratchArena, ScratchpadSize, 8), kbts__ArenaAllocator, &Context->ScratchArena);
 
-        kbts__ShapeDirect(Scratchpad, &Context->GlyphStorage, RunDirection);
+          kbts__ShapeDirect(Scratchpad, &Context->GlyphStorage, RunDirection);
 
-        if(Scratchpad->Error)
-        {
-          Context->Error = Scratchpad->Error;
+          if(Scratchpad->Error)
+          {
+            Context->Error = Scratchpad->Error;
+          }
         }
       }
     }
@@ -25427,6 +26214,28 @@ KBTS_EXPORT kbts_load_font_error kbts_LoadFont(kbts_font *Font, kbts_load_font_s
         GlyphLookupSubtableMatrixSizeInWords = LastIndex.WordIndex + 1;
       }
 
+      kbts_un GlyphLookupMatrixSizeInBytes = GlyphLookupMatrixSizeInWords * sizeof(kbts_u32);
+      kbts_un GlyphLookupSubtableMatrixSizeInBytes = GlyphLookupSubtableMatrixSizeInWords * sizeof(kbts_u32);
+      kbts_un GlyphMatrixPageCapacity = 0;
+
+      if((GlyphLookupMatrixSizeInBytes + GlyphLookupSubtableMatrixSizeInBytes) > KBTS__DENSE_GLYPH_MATRICES_MAX_SIZE)
+      {
+        // Dense matrices would be too big, so page them. See kbts__glyph_matrix.
+        kbts_un RowPageCount = kbts__GlyphMatrixRowPageCount(State->GlyphCount);
+        kbts_un PageIndexCount = (State->LookupCount + State->LookupSubtableCount) * RowPageCount;
+
+        GlyphLookupMatrixSizeInBytes = State->LookupCount * RowPageCount * sizeof(kbts_u16);
+        GlyphLookupSubtableMatrixSizeInBytes = State->LookupSubtableCount * RowPageCount * sizeof(kbts_u16);
+
+        // We only know how many pages we need once we have gone through every lookup, so this is a guess.
+        // Every page we use comes from a coverage or class definition, which takes a few bytes of GSUB or GPOS
+        // per glyph or glyph range, so this is plenty in practice. If it runs out anyway, the pages that did not
+        // fit are marked full, which makes us try lookups on glyphs that they might not apply to, but is still correct.
+        GlyphMatrixPageCapacity = (State->Tables[KBTS_BLOB_TABLE_ID_GSUB].Length + State->Tables[KBTS_BLOB_TABLE_ID_GPOS].Length) / 16;
+        GlyphMatrixPageCapacity = KBTS__MIN(GlyphMatrixPageCapacity, PageIndexCount);
+        GlyphMatrixPageCapacity = KBTS__MIN(GlyphMatrixPageCapacity + KBTS__GLYPH_MATRIX_FULL_PAGE + 1, KBTS__GLYPH_MATRIX_MAX_PAGE_COUNT);
+      }
+
       kbts__pointer_bump_allocator Bump = kbts__PointerBumpAllocator(0);
 
       kbts__PointerPushType(&Bump, kbts_blob_header);
@@ -25436,9 +26245,16 @@ KBTS_EXPORT kbts_load_font_error kbts_LoadFont(kbts_font *Font, kbts_load_font_s
         kbts__PointerPush(&Bump, State->Tables[TableId].Length, 4);
       }
 
-      kbts__PointerPushArray(&Bump, kbts_u32, GlyphLookupMatrixSizeInWords);
-      kbts__PointerPushArray(&Bump, kbts_u32, GlyphLookupSubtableMatrixSizeInWords);
+      kbts__PointerPush(&Bump, GlyphLookupMatrixSizeInBytes, KBTS_ALIGNOF(kbts_u32));
+      kbts__PointerPush(&Bump, GlyphLookupSubtableMatrixSizeInBytes, KBTS_ALIGNOF(kbts_u32));
       kbts__PointerPushArray(&Bump, kbts_u32, State->LookupCount);
+      kbts__PointerPushArray(&Bump, kbts_u32, GlyphMatrixPageCapacity * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT);
+
+      // Dense lookup tables go after the pages that we use, and stop when they run out of room. See kbts__dense_lookup_table.
+      kbts_un DenseLookupTableCapacity = (State->Tables[KBTS_BLOB_TABLE_ID_GSUB].Length +
+                                          State->Tables[KBTS_BLOB_TABLE_ID_GPOS].Length +
+                                          State->Tables[KBTS_BLOB_TABLE_ID_GDEF].Length) / 2;
+      kbts__PointerPush(&Bump, DenseLookupTableCapacity, KBTS_ALIGNOF(kbts_u16));
 
       // Add the align just to make sure we can accept any pointer.
       kbts_un OutputSize = Bump.At + KBTS_ALIGNOF(kbts_blob_header);
@@ -25447,37 +26263,100 @@ KBTS_EXPORT kbts_load_font_error kbts_LoadFont(kbts_font *Font, kbts_load_font_s
       *OutputSize_ = (int)OutputSize;
 
       State->ScratchSize = (kbts_u32)ScratchSize;
-      State->GlyphLookupMatrixSizeInBytes = (kbts_u32)(GlyphLookupMatrixSizeInWords * sizeof(kbts_u32));
-      State->GlyphLookupSubtableMatrixSizeInBytes = (kbts_u32)(GlyphLookupSubtableMatrixSizeInWords * sizeof(kbts_u32));
+      State->GlyphLookupMatrixSizeInBytes = (kbts_u32)GlyphLookupMatrixSizeInBytes;
+      State->GlyphLookupSubtableMatrixSizeInBytes = (kbts_u32)GlyphLookupSubtableMatrixSizeInBytes;
+      State->GlyphMatrixPageCapacity = (kbts_u32)GlyphMatrixPageCapacity;
+      State->DenseLookupTableCapacity = (kbts_u32)DenseLookupTableCapacity;
       State->TotalSize = (kbts_u32)OutputSize;
     }
     else if(Magic == KBTS_FOURCC('k', 'b', 't', 's'))
     {
       kbts_blob_header *Header = (kbts_blob_header *)FontData;
 
-      if(Header->Version != KBTS_BLOB_VERSION_CURRENT)
+      if(Header->Version != KBTS_BLOB_VERSION_CURRENT)
+      {
+        Result = KBTS_LOAD_FONT_ERROR_INVALID_FONT;
+      }
+
+      // @Incomplete: Bounds check or something.
+
+      Font->Blob = Header;
+      kbts__cmap_subtable_pointer PreferredSubtable = kbts__SelectCmapSubtable(Header, &Header->Tables[KBTS_BLOB_TABLE_ID_CMAP], &Font->Cmap14, 0);
+      Font->Cmap = PreferredSubtable.Subtable;
+    }
+  }
+
+  return Result;
+}
+
+KBTS_EXPORT int kbts_FontIsValid(kbts_font *Font)
+{
+  int Result = !Font->Error;
+  return Result;
+}
+
+// Runs out into full pages, which are always correct, since the matrices only tell us which lookups we can skip.
+static kbts_un kbts__AllocateGlyphMatrixPage(kbts__glyph_matrix_page_allocator *Allocator)
+{
+  kbts_un Result = KBTS__GLYPH_MATRIX_FULL_PAGE;
+
+  if(Allocator->PageCount < Allocator->PageCapacity)
+  {
+    Result = Allocator->PageCount++;
+    KBTS_MEMSET(&Allocator->Pages[Result * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT], 0, KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT * sizeof(kbts_u32));
+  }
+
+  return Result;
+}
+
+static void kbts__MarkMatrixGlyphRange(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_un FirstGlyphId, kbts_un OnePastLastGlyphId)
+{
+  OnePastLastGlyphId = KBTS__MIN(OnePastLastGlyphId, Matrix->GlyphCount);
+
+  kbts_un GlyphId = FirstGlyphId;
+  while(GlyphId < OnePastLastGlyphId)
+  {
+    kbts_un FirstGlyphIdInPage = GlyphId - (GlyphId % KBTS__GLYPH_MATRIX_PAGE_SIZE);
+    kbts_un OnePastLastGlyphIdInPage = KBTS__MIN(FirstGlyphIdInPage + KBTS__GLYPH_MATRIX_PAGE_SIZE, Matrix->GlyphCount);
+    kbts_un OnePastLastMarkedGlyphId = KBTS__MIN(OnePastLastGlyphIdInPage, OnePastLastGlyphId);
+    kbts_b32 PageIsFull = 0;
+
+    if(Matrix->PageIndices)
+    {
+      kbts_u16 *PageIndex = &Matrix->PageIndices[Row * Matrix->RowPageCount + FirstGlyphIdInPage / KBTS__GLYPH_MATRIX_PAGE_SIZE];
+
+      if((*PageIndex == KBTS__GLYPH_MATRIX_EMPTY_PAGE) &&
+         (GlyphId == FirstGlyphIdInPage) && (OnePastLastMarkedGlyphId == OnePastLastGlyphIdInPage))
       {
-        Result = KBTS_LOAD_FONT_ERROR_INVALID_FONT;
+        *PageIndex = KBTS__GLYPH_MATRIX_FULL_PAGE;
+      }
+      else if(*PageIndex == KBTS__GLYPH_MATRIX_EMPTY_PAGE)
+      {
+        *PageIndex = (kbts_u16)kbts__AllocateGlyphMatrixPage(Matrix->PageAllocator);
       }
 
-      // @Incomplete: Bounds check or something.
+      PageIsFull = *PageIndex == KBTS__GLYPH_MATRIX_FULL_PAGE;
+    }
 
-      Font->Blob = Header;
-      kbts__cmap_subtable_pointer PreferredSubtable = kbts__SelectCmapSubtable(Header, &Header->Tables[KBTS_BLOB_TABLE_ID_CMAP], &Font->Cmap14, 0);
-      Font->Cmap = PreferredSubtable.Subtable;
+    if(!PageIsFull)
+    {
+      KBTS__FOR(MarkedGlyphId, GlyphId, OnePastLastMarkedGlyphId)
+      {
+        kbts__matrix_index MatrixIndex = kbts__GlyphMatrixIndex(Matrix, Row, MarkedGlyphId);
+        Matrix->Words[MatrixIndex.WordIndex] |= 1u << MatrixIndex.BitIndex;
+      }
     }
-  }
 
-  return Result;
+    GlyphId = OnePastLastMarkedGlyphId;
+  }
 }
 
-KBTS_EXPORT int kbts_FontIsValid(kbts_font *Font)
+static void kbts__MarkMatrixGlyph(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_un GlyphId)
 {
-  int Result = !Font->Error;
-  return Result;
+  kbts__MarkMatrixGlyphRange(Matrix, Row, GlyphId, GlyphId + 1);
 }
 
-static void kbts__MarkMatrixCoverage(kbts_u32 *Matrix, kbts_un TableIndex, kbts_un TableCount, kbts_un GlyphCount, kbts__coverage *Coverage, int SubtableMatrix)
+static void kbts__MarkMatrixCoverage(kbts__glyph_matrix *Matrix, kbts_un Row, kbts__coverage *Coverage)
 {
   if(Coverage)
   {
@@ -25488,14 +26367,7 @@ static void kbts__MarkMatrixCoverage(kbts_u32 *Matrix, kbts_un TableIndex, kbts_
       KBTS__FOR(GlyphIndex, 0, Coverage->Count)
       {
         kbts_un GlyphId = GlyphIds[GlyphIndex];
-        kbts__matrix_index MatrixIndex = SubtableMatrix ? 
-          kbts__GlyphLookupSubtableMatrixIndex(TableIndex, TableCount, GlyphId, GlyphCount) :
-          kbts__GlyphLookupMatrixIndex(TableIndex, GlyphId, GlyphCount);
-
-        if(GlyphId < GlyphCount)
-        {
-          Matrix[MatrixIndex.WordIndex] |= 1u << MatrixIndex.BitIndex;
-        }
+        kbts__MarkMatrixGlyph(Matrix, Row, GlyphId);
       }
     }
     else if(Coverage->Format == 2)
@@ -25505,23 +26377,13 @@ static void kbts__MarkMatrixCoverage(kbts_u32 *Matrix, kbts_un TableIndex, kbts_
       KBTS__FOR(RangeIndex, 0, Coverage->Count)
       {
         kbts__range_record *Range = &Ranges[RangeIndex];
-        KBTS__FOR(GlyphId, Range->StartGlyphId, (kbts_un)Range->EndGlyphId + 1)
-        {
-          kbts__matrix_index MatrixIndex = SubtableMatrix ? 
-            kbts__GlyphLookupSubtableMatrixIndex(TableIndex, TableCount, GlyphId, GlyphCount) :
-            kbts__GlyphLookupMatrixIndex(TableIndex, GlyphId, GlyphCount);
-
-          if(GlyphId < GlyphCount)
-          {
-            Matrix[MatrixIndex.WordIndex] |= 1u << MatrixIndex.BitIndex;
-          }
-        }
+        kbts__MarkMatrixGlyphRange(Matrix, Row, Range->StartGlyphId, (kbts_un)Range->EndGlyphId + 1);
       }
     }
   }
 }
 
-static void kbts__MarkMatrixClassDef(kbts_u32 *Matrix, kbts_un SubtableIndex, kbts_un SubtableCount, kbts_un GlyphCount, kbts_u16 *ClassDefBase, kbts_u64 *ClassesIncluded, kbts_un ClassesIncludedLength)
+static void kbts__MarkMatrixClassDef(kbts__glyph_matrix *Matrix, kbts_un Row, kbts_u16 *ClassDefBase, kbts_u64 *ClassesIncluded, kbts_un ClassesIncludedLength)
 {
   if(ClassDefBase)
   {
@@ -25538,8 +26400,7 @@ static void kbts__MarkMatrixClassDef(kbts_u32 *Matrix, kbts_un SubtableIndex, kb
         if((GlyphId >= (ClassesIncludedLength * 64)) ||
            (ClassesIncluded[GlyphClass / 64] & (1ull << (GlyphClass % 64))))
         {
-          kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(SubtableIndex, SubtableCount, GlyphId, GlyphCount);
-          Matrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+          kbts__MarkMatrixGlyph(Matrix, Row, GlyphId);
         }
       }
     }
@@ -25556,21 +26417,96 @@ static void kbts__MarkMatrixClassDef(kbts_u32 *Matrix, kbts_un SubtableIndex, kb
         if((RangeClass >= (ClassesIncludedLength * 64)) ||
            (ClassesIncluded[RangeClass / 64] & (1ull << (RangeClass % 64))))
         {
-          kbts_un OnePastLastGlyphId = Range->EndGlyphId + 1;
-          if(OnePastLastGlyphId > GlyphCount)
-          {
-            OnePastLastGlyphId = GlyphCount;
-          }
+          kbts__MarkMatrixGlyphRange(Matrix, Row, Range->StartGlyphId, (kbts_un)Range->EndGlyphId + 1);
+        }
+      }
+    }
+  }
+}
+
+// Returns how many bytes of values it used.
+static kbts_un kbts__MakeDenseLookupTable(kbts__pointer_bump_allocator *Bump, kbts__dense_lookup_table_kind Kind, kbts_u16 *Base, kbts_un Capacity)
+{
+  kbts_un Result = 0;
+
+  // Coverage format 2 and class definition format 2 ranges look the same; only the last field means something else.
+  kbts_un Format = Base[0];
+  kbts_un Count = Base[1];
+  kbts_u16 *GlyphIds = KBTS__POINTER_AFTER(kbts_u16, (kbts__coverage *)Base);
+  kbts__range_record *Ranges = KBTS__POINTER_AFTER(kbts__range_record, (kbts__coverage *)Base);
+  kbts_un TableSize = sizeof(kbts__coverage) + Count * ((Format == 1) ? sizeof(kbts_u16) : sizeof(kbts__range_record));
+
+  kbts_un FirstGlyphId = 0xFFFF;
+  kbts_un LastGlyphId = 0;
+  kbts_b32 Fits = 1;
+
+  KBTS__FOR(Index, 0, Count)
+  {
+    if(Format == 1)
+    {
+      FirstGlyphId = KBTS__MIN(FirstGlyphId, GlyphIds[Index]);
+      LastGlyphId = KBTS__MAX(LastGlyphId, GlyphIds[Index]);
+    }
+    else
+    {
+      kbts__range_record *Range = &Ranges[Index];
+      kbts_un LastValue = (Kind == KBTS__DENSE_LOOKUP_TABLE_KIND_COVERAGE) ?
+                          (kbts_un)Range->StartCoverageIndex + Range->EndGlyphId - Range->StartGlyphId : Range->StartCoverageIndex;
+
+      FirstGlyphId = KBTS__MIN(FirstGlyphId, Range->StartGlyphId);
+      LastGlyphId = KBTS__MAX(LastGlyphId, Range->EndGlyphId);
+      Fits &= (Range->StartGlyphId <= Range->EndGlyphId) && (LastValue < 0xFFFF);
+    }
+  }
 
-          KBTS__FOR(GlyphId, Range->StartGlyphId, OnePastLastGlyphId)
+  kbts_un GlyphCount = (LastGlyphId >= FirstGlyphId) ? (LastGlyphId - FirstGlyphId + 1) : 0;
+  kbts_un ValuesSize = GlyphCount * sizeof(kbts_u16);
+
+  if(Fits && GlyphCount && (GlyphCount <= 0xFFFF) &&
+     (ValuesSize <= TableSize * KBTS__DENSE_LOOKUP_TABLE_MAX_GROWTH) &&
+     (ValuesSize <= Capacity))
+  {
+    kbts_u16 *Values = kbts__PointerPushArray(Bump, kbts_u16, GlyphCount);
+    KBTS_MEMSET(Values, 0, ValuesSize);
+
+    // When glyphs show up more than once, keep the first one, like the binary searches do.
+    KBTS__FOR(Index, 0, Count)
+    {
+      if(Format == 1)
+      {
+        kbts_u16 *Value = &Values[GlyphIds[Index] - FirstGlyphId];
+        if(!*Value)
+        {
+          *Value = (kbts_u16)(Index + 1);
+        }
+      }
+      else
+      {
+        kbts__range_record *Range = &Ranges[Index];
+
+        KBTS__FOR(GlyphId, Range->StartGlyphId, (kbts_un)Range->EndGlyphId + 1)
+        {
+          kbts_u16 *Value = &Values[GlyphId - FirstGlyphId];
+          if(!*Value)
           {
-            kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(SubtableIndex, SubtableCount, GlyphId, GlyphCount);
-            Matrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+            *Value = (kbts_u16)(((Kind == KBTS__DENSE_LOOKUP_TABLE_KIND_COVERAGE) ? (Range->StartCoverageIndex + GlyphId - Range->StartGlyphId) : Range->StartCoverageIndex) + 1);
           }
         }
       }
     }
+
+    // The header overwrites the start of the table, so write it once we are done reading.
+    kbts__dense_lookup_table *Table = (kbts__dense_lookup_table *)Base;
+    Table->Format = KBTS__DENSE_LOOKUP_TABLE_FORMAT;
+    Table->StartGlyphId = (kbts_u16)FirstGlyphId;
+    Table->GlyphCount = (kbts_u16)GlyphCount;
+    Table->Unused = 0;
+    kbts__WriteU32Unaligned(&Table->ValuesOffset, KBTS__POINTER_DIFF32(Values, Table));
+
+    Result = ValuesSize;
   }
+
+  return Result;
 }
 
 KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_state *State, void *ScratchMemory, void *OutputMemory)
@@ -26111,18 +27047,36 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
 
     if(!Result && Header->Tables[KBTS_BLOB_TABLE_ID_MAXP].Length)
     {
-      kbts_un GlyphCount = Header->GlyphCount;
-      kbts_un LookupCount = Header->LookupCount;
-      kbts_un SubtableCount = Header->LookupSubtableCount;
-
-      kbts_u32 *GlyphLookupMatrix = kbts__PointerPushArray(&Bump, kbts_u32, State->GlyphLookupMatrixSizeInBytes / sizeof(kbts_u32));
-      kbts_u32 *GlyphLookupSubtableMatrix = kbts__PointerPushArray(&Bump, kbts_u32, State->GlyphLookupSubtableMatrixSizeInBytes / sizeof(kbts_u32));
+      void *GlyphLookupMatrixData = kbts__PointerPush(&Bump, State->GlyphLookupMatrixSizeInBytes, KBTS_ALIGNOF(kbts_u32));
+      void *GlyphLookupSubtableMatrixData = kbts__PointerPush(&Bump, State->GlyphLookupSubtableMatrixSizeInBytes, KBTS_ALIGNOF(kbts_u32));
       kbts_u32 *LookupSubtableIndexOffsets = kbts__PointerPushArray(&Bump, kbts_u32, State->LookupCount);
 
-      KBTS_MEMSET(GlyphLookupMatrix, 0, State->GlyphLookupMatrixSizeInBytes);
-      KBTS_MEMSET(GlyphLookupSubtableMatrix, 0, State->GlyphLookupSubtableMatrixSizeInBytes);
+      KBTS_MEMSET(GlyphLookupMatrixData, 0, State->GlyphLookupMatrixSizeInBytes);
+      KBTS_MEMSET(GlyphLookupSubtableMatrixData, 0, State->GlyphLookupSubtableMatrixSizeInBytes);
       KBTS_MEMSET(LookupSubtableIndexOffsets, 0, sizeof(kbts_u32) * State->LookupCount);
 
+      Header->GlyphLookupMatrixOffsetFromStartOfFile = KBTS__POINTER_DIFF32(GlyphLookupMatrixData, Header);
+      Header->GlyphLookupSubtableMatrixOffsetFromStartOfFile = KBTS__POINTER_DIFF32(GlyphLookupSubtableMatrixData, Header);
+
+      // The pages go last, so that the pages we end up not using are not part of the blob.
+      kbts__glyph_matrix_page_allocator PageAllocator = KBTS__ZERO;
+      if(State->GlyphMatrixPageCapacity)
+      {
+        PageAllocator.Pages = kbts__PointerPushArray(&Bump, kbts_u32, State->GlyphMatrixPageCapacity * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT);
+        PageAllocator.PageCapacity = State->GlyphMatrixPageCapacity;
+
+        KBTS_MEMSET(&PageAllocator.Pages[KBTS__GLYPH_MATRIX_EMPTY_PAGE * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT], 0, KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT * sizeof(kbts_u32));
+        KBTS_MEMSET(&PageAllocator.Pages[KBTS__GLYPH_MATRIX_FULL_PAGE * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT], 0xFF, KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT * sizeof(kbts_u32));
+        PageAllocator.PageCount = KBTS__GLYPH_MATRIX_FULL_PAGE + 1;
+
+        Header->GlyphMatrixPagesOffsetFromStartOfFile = KBTS__POINTER_DIFF32(PageAllocator.Pages, Header);
+      }
+
+      kbts__glyph_matrix GlyphLookupMatrix = kbts__GetGlyphMatrix(Header, Header->GlyphLookupMatrixOffsetFromStartOfFile);
+      kbts__glyph_matrix GlyphLookupSubtableMatrix = kbts__GetGlyphMatrix(Header, Header->GlyphLookupSubtableMatrixOffsetFromStartOfFile);
+      GlyphLookupMatrix.PageAllocator = &PageAllocator;
+      GlyphLookupSubtableMatrix.PageAllocator = &PageAllocator;
+
       kbts_un GposLookupIndexOffset = 0;
       kbts_un RunningLookupIndex = 0;
       kbts_un RunningSubtableIndex = 0;
@@ -26187,8 +27141,7 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                       {
                         kbts_un GlyphId = Ids[IdIndex - 1];
 
-                        kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(RunningSubtableIndex, SubtableCount, GlyphId, GlyphCount);
-                        GlyphLookupSubtableMatrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+                        kbts__MarkMatrixGlyph(&GlyphLookupSubtableMatrix, RunningSubtableIndex, GlyphId);
                       }
                     }
                   }
@@ -26216,8 +27169,7 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                           {
                             kbts_un GlyphId = SequenceGlyphIds[InputIndex - 1];
 
-                            kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(RunningSubtableIndex, SubtableCount, GlyphId, GlyphCount);
-                            GlyphLookupSubtableMatrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+                            kbts__MarkMatrixGlyph(&GlyphLookupSubtableMatrix, RunningSubtableIndex, GlyphId);
                           }
                         }
                       }
@@ -26254,7 +27206,7 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                       }
                     }
 
-                    kbts__MarkMatrixClassDef(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, ClassDefBase, ClassesIncluded, KBTS__ARRAY_LENGTH(ClassesIncluded));
+                    kbts__MarkMatrixClassDef(&GlyphLookupSubtableMatrix, RunningSubtableIndex, ClassDefBase, ClassesIncluded, KBTS__ARRAY_LENGTH(ClassesIncluded));
                   } break;
 
                   case 3:
@@ -26266,7 +27218,7 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                     {
                       kbts__coverage *SubstCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, CoverageOffsets[CoverageIndex]);
 
-                      kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubstCoverage, 1);
+                      kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubstCoverage);
                     }
 
                     Coverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, CoverageOffsets[0]);
@@ -26294,22 +27246,19 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                         KBTS__FOR(BacktrackIndex, 0, Unpacked.BacktrackCount)
                         {
                           kbts_un GlyphId = Unpacked.Backtrack[BacktrackIndex];
-                          kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(RunningSubtableIndex, SubtableCount, GlyphId, GlyphCount);
-                          GlyphLookupSubtableMatrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+                          kbts__MarkMatrixGlyph(&GlyphLookupSubtableMatrix, RunningSubtableIndex, GlyphId);
                         }
 
                         KBTS__FOR(InputIndex, 1, Unpacked.InputCount)
                         {
                           kbts_un GlyphId = Unpacked.Input[InputIndex - 1];
-                          kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(RunningSubtableIndex, SubtableCount, GlyphId, GlyphCount);
-                          GlyphLookupSubtableMatrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+                          kbts__MarkMatrixGlyph(&GlyphLookupSubtableMatrix, RunningSubtableIndex, GlyphId);
                         }
 
                         KBTS__FOR(LookaheadIndex, 0, Unpacked.LookaheadCount)
                         {
                           kbts_un GlyphId = Unpacked.Lookahead[LookaheadIndex];
-                          kbts__matrix_index SubtableMatrixIndex = kbts__GlyphLookupSubtableMatrixIndex(RunningSubtableIndex, SubtableCount, GlyphId, GlyphCount);
-                          GlyphLookupSubtableMatrix[SubtableMatrixIndex.WordIndex] |= 1u << SubtableMatrixIndex.BitIndex;
+                          kbts__MarkMatrixGlyph(&GlyphLookupSubtableMatrix, RunningSubtableIndex, GlyphId);
                         }
                       }
                     }
@@ -26381,9 +27330,9 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                       }
                     }
 
-                    kbts__MarkMatrixClassDef(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, BacktrackClassDefinition, BacktrackClassesIncluded, KBTS__ARRAY_LENGTH(BacktrackClassesIncluded));
-                    kbts__MarkMatrixClassDef(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, InputClassDefinition, InputClassesIncluded, KBTS__ARRAY_LENGTH(InputClassesIncluded));
-                    kbts__MarkMatrixClassDef(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, LookaheadClassDefinition, LookaheadClassesIncluded, KBTS__ARRAY_LENGTH(LookaheadClassesIncluded));
+                    kbts__MarkMatrixClassDef(&GlyphLookupSubtableMatrix, RunningSubtableIndex, BacktrackClassDefinition, BacktrackClassesIncluded, KBTS__ARRAY_LENGTH(BacktrackClassesIncluded));
+                    kbts__MarkMatrixClassDef(&GlyphLookupSubtableMatrix, RunningSubtableIndex, InputClassDefinition, InputClassesIncluded, KBTS__ARRAY_LENGTH(InputClassesIncluded));
+                    kbts__MarkMatrixClassDef(&GlyphLookupSubtableMatrix, RunningSubtableIndex, LookaheadClassDefinition, LookaheadClassesIncluded, KBTS__ARRAY_LENGTH(LookaheadClassesIncluded));
                   } break;
 
                   case 3:
@@ -26396,20 +27345,20 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                     KBTS__FOR(BacktrackCoverageIndex, 0, Unpacked.BacktrackCount)
                     {
                       kbts__coverage *SubCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, Unpacked.BacktrackCoverageOffsets[BacktrackCoverageIndex]);
-                      kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubCoverage, 1);
+                      kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubCoverage);
                     }
 
                     KBTS__FOR(InputCoverageIndex, 1, Unpacked.InputCount)
                     {
                       kbts__coverage *SubCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, Unpacked.InputCoverageOffsets[InputCoverageIndex]);
-                      kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubCoverage, 1);
+                      kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubCoverage);
                     }
 
 
                     KBTS__FOR(LookaheadCoverageIndex, 0, Unpacked.LookaheadCount)
                     {
                       kbts__coverage *SubCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, Unpacked.LookaheadCoverageOffsets[LookaheadCoverageIndex]);
-                      kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubCoverage, 1);
+                      kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubCoverage);
                     }
                   } break;
                   }
@@ -26422,18 +27371,18 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
                   KBTS__FOR(BacktrackIndex, 0, Unpacked.BacktrackCount)
                   {
                     kbts__coverage *SubCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, Unpacked.BacktrackCoverageOffsets[BacktrackIndex]);
-                    kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubCoverage, 1);
+                    kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubCoverage);
                   }
 
                   KBTS__FOR(LookaheadIndex, 0, Unpacked.LookaheadCount)
                   {
                     kbts__coverage *SubCoverage = KBTS__POINTER_OFFSET(kbts__coverage, Subst, Unpacked.LookaheadCoverageOffsets[LookaheadIndex]);
-                    kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, SubCoverage, 1);
+                    kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, SubCoverage);
                   }
                 }
 
-                kbts__MarkMatrixCoverage(GlyphLookupMatrix, RunningLookupIndex, LookupCount, GlyphCount, Coverage, 0);
-                kbts__MarkMatrixCoverage(GlyphLookupSubtableMatrix, RunningSubtableIndex, SubtableCount, GlyphCount, Coverage, 1);
+                kbts__MarkMatrixCoverage(&GlyphLookupMatrix, RunningLookupIndex, Coverage);
+                kbts__MarkMatrixCoverage(&GlyphLookupSubtableMatrix, RunningSubtableIndex, Coverage);
 
                 RunningSubtableIndex += 1;
               }
@@ -26450,10 +27399,31 @@ KBTS_EXPORT kbts_load_font_error kbts_PlaceBlob(kbts_font *Font, kbts_load_font_
       }
 
       Header->GposLookupIndexOffset = (kbts_u32)GposLookupIndexOffset;
-      Header->GlyphLookupMatrixOffsetFromStartOfFile = KBTS__POINTER_DIFF32(GlyphLookupMatrix, Header);
-      Header->GlyphLookupSubtableMatrixOffsetFromStartOfFile = KBTS__POINTER_DIFF32(GlyphLookupSubtableMatrix, Header);
       Header->LookupSubtableIndexOffsetsOffsetFromStartOfFile = KBTS__POINTER_DIFF32(LookupSubtableIndexOffsets, Header);
+
+      if(PageAllocator.Pages)
+      {
+        Bump.At = (kbts_uptr)&PageAllocator.Pages[PageAllocator.PageCount * KBTS__GLYPH_MATRIX_PAGE_WORD_COUNT];
+      }
+    }
+
+    // This has to come after the matrices, which read the tables as the font has them.
+    if(!Result)
+    {
+      kbts_un DenseLookupTableCapacity = State->DenseLookupTableCapacity;
+      kbts_u32 *Candidates = ByteSwapContext.Pointers + ByteSwapContext.PointerCapacity;
+
+      // Candidates are stacked down, so go backwards to do them in file order, which starts with GDEF.
+      for(kbts_un CandidateIndex = ByteSwapContext.DenseLookupTableCandidateCount; CandidateIndex--;)
+      {
+        kbts__dense_lookup_table_kind Kind = Candidates[CandidateIndex * 2];
+        kbts_u16 *Base = KBTS__POINTER_OFFSET(kbts_u16, Header, Candidates[CandidateIndex * 2 + 1]);
+
+        DenseLookupTableCapacity -= kbts__MakeDenseLookupTable(&Bump, Kind, Base, DenseLookupTableCapacity);
+      }
     }
+
+    Header->SizeInBytes = (kbts_u32)(Bump.At - (kbts_uptr)Header);
   }
 
   if(Result != KBTS_LOAD_FONT_ERROR_NONE)
@@ -28153,6 +29123,385 @@ KBTS_EXPORT int kbts_Break(kbts_break_state *State, kbts_break *Break)
   return Result;
 }
 
+// The break cache memoizes kbts__BreakAddCodepoint on ASCII codepoints.
+// A state is the part of kbts_break_state that starts at ParagraphDirection, which does not depend on where we are
+// in the text. A transition from a state on a codepoint stores the state we end up in, and the breaks we found,
+// relative to the codepoint. A run of ASCII text then only costs a table lookup per codepoint.
+//
+// We only store transitions that cannot depend on anything but the state, i.e. on the fields in front of it:
+// - Brackets are pushed, popped and resolved by position, so bracket codepoints are never stored.
+// - Script, direction and paragraph direction breaks read and write positions, so steps that find one are not stored.
+// - Steps that start a paragraph set ParagraphStartPosition.
+// - kbts__DoBreak drops breaks that would land before the start of the text. Steps that are far enough into the text
+//   to not drop any are replayed anywhere they do not drop any either. Steps that may have dropped some are only
+//   replayed at the same position, which still covers every text that starts the same way.
+#define KBTS__BREAK_STATE_KEY_OFFSET offsetof(kbts_break_state, ParagraphDirection)
+// ParagraphDirection is a kbts_u32, and the struct is padded to a multiple of its alignment, so this is exact.
+#define KBTS__BREAK_STATE_KEY_WORD_COUNT ((sizeof(kbts_break_state) - KBTS__BREAK_STATE_KEY_OFFSET) / sizeof(kbts_u32))
+#define KBTS__BREAK_CACHE_STATE_CAPACITY 1024
+#define KBTS__BREAK_CACHE_STATE_SLOT_COUNT 2048 // Power of two.
+#define KBTS__BREAK_CACHE_TRANSITION_COUNT_LOG2 13
+#define KBTS__BREAK_CACHE_TRANSITION_BREAK_CAPACITY 3
+
+typedef struct kbts__break_cache_transition
+{
+  kbts_u16 State; // One-based, so that a cleared transition is empty.
+  kbts_u16 NextState;
+  kbts_u8 Codepoint;
+  kbts_u8 BreakCount;
+  kbts_u16 MinimumPosition; // Before this, some of the breaks would land before the start of the text.
+  kbts_u8 OnlyAtMinimumPosition;
+  kbts_s16 BreakOffsets[KBTS__BREAK_CACHE_TRANSITION_BREAK_CAPACITY];
+  kbts_u8 BreakFlags[KBTS__BREAK_CACHE_TRANSITION_BREAK_CAPACITY];
+} kbts__break_cache_transition;
+
+struct kbts_break_cache
+{
+  kbts_allocator_function *Allocator;
+  void *AllocatorData;
+
+  kbts_u32 StateCount;
+  // Bumped every time the cache fills up and starts over, which invalidates all state indices.
+  kbts_u32 Generation;
+
+  kbts_u16 StateSlots[KBTS__BREAK_CACHE_STATE_SLOT_COUNT]; // One-based state indices, by key hash.
+  kbts__break_cache_transition Transitions[1 << KBTS__BREAK_CACHE_TRANSITION_COUNT_LOG2]; // By state and codepoint.
+  kbts_u32 StateKeys[KBTS__BREAK_CACHE_STATE_CAPACITY][KBTS__BREAK_STATE_KEY_WORD_COUNT];
+};
+
+KBTS_EXPORT int kbts_SizeOfBreakCache(void)
+{
+  int Result = sizeof(kbts_break_cache);
+  return Result;
+}
+
+KBTS_EXPORT kbts_break_cache *kbts_PlaceBreakCache(void *Memory)
+{
+  kbts_break_cache *Result = (kbts_break_cache *)Memory;
+
+  if(Memory)
+  {
+    KBTS_MEMSET(Result, 0, sizeof(*Result));
+  }
+
+  return Result;
+}
+
+KBTS_EXPORT kbts_break_cache *kbts_CreateBreakCache(kbts_allocator_function *Allocator, void *AllocatorData)
+{
+  if(!Allocator)
+  {
+    Allocator = kbts__DefaultAllocator;
+  }
+
+  kbts_break_cache *Result = kbts_PlaceBreakCache(kbts__AllocatorAllocate(Allocator, AllocatorData, sizeof(kbts_break_cache)));
+
+  if(Result)
+  {
+    Result->Allocator = Allocator;
+    Result->AllocatorData = AllocatorData;
+  }
+
+  return Result;
+}
+
+KBTS_EXPORT void kbts_DestroyBreakCache(kbts_break_cache *Cache)
+{
+  if(Cache && Cache->Allocator)
+  {
+    kbts__AllocatorFree(Cache->Allocator, Cache->AllocatorData, Cache);
+  }
+}
+
+KBTS_INLINE kbts_u32 *kbts__BreakStateKey(kbts_break_state *State)
+{
+  kbts_u32 *Result = (kbts_u32 *)((char *)State + KBTS__BREAK_STATE_KEY_OFFSET);
+  return Result;
+}
+
+// Returns the index of the cached state that matches State, adding it if it is new.
+static kbts_un kbts__BreakCacheState(kbts_break_cache *Cache, kbts_break_state *State)
+{
+  kbts_u32 *Key = kbts__BreakStateKey(State);
+  kbts_u32 Hash = 0;
+
+  KBTS__FOR(WordIndex, 0, KBTS__BREAK_STATE_KEY_WORD_COUNT)
+  {
+    Hash = (Hash ^ Key[WordIndex]) * 0x9E3779B1;
+    Hash ^= Hash >> 15;
+  }
+
+  kbts_un SlotIndex = Hash & (KBTS__BREAK_CACHE_STATE_SLOT_COUNT - 1);
+  kbts_un Result = 0;
+
+  for(;;)
+  {
+    kbts_u16 Slot = Cache->StateSlots[SlotIndex];
+
+    if(!Slot)
+    {
+      if(Cache->StateCount == KBTS__BREAK_CACHE_STATE_CAPACITY)
+      {
+        // Start over, so that the cache follows the text instead of whatever it saw first.
+        Cache->StateCount = 0;
+        Cache->Generation += 1;
+        KBTS_MEMSET(Cache->StateSlots, 0, sizeof(Cache->StateSlots));
+        KBTS_MEMSET(Cache->Transitions, 0, sizeof(Cache->Transitions));
+
+        SlotIndex = Hash & (KBTS__BREAK_CACHE_STATE_SLOT_COUNT - 1);
+      }
+
+      Result = Cache->StateCount++;
+      KBTS_MEMCPY(Cache->StateKeys[Result], Key, sizeof(Cache->StateKeys[Result]));
+      Cache->StateSlots[SlotIndex] = (kbts_u16)(Result + 1);
+
+      break;
+    }
+
+    kbts_u32 *SlotKey = Cache->StateKeys[Slot - 1];
+    kbts_b32 Match = 1;
+
+    KBTS__FOR(WordIndex, 0, KBTS__BREAK_STATE_KEY_WORD_COUNT)
+    {
+      if(SlotKey[WordIndex] != Key[WordIndex])
+      {
+        Match = 0;
+        break;
+      }
+    }
+
+    if(Match)
+    {
+      Result = (kbts_un)(Slot - 1);
+
+      break;
+    }
+
+    SlotIndex = (SlotIndex + 1) & (KBTS__BREAK_CACHE_STATE_SLOT_COUNT - 1);
+  }
+
+  return Result;
+}
+
+KBTS_INLINE kbts__break_cache_transition *kbts__BreakCacheTransition(kbts_break_cache *Cache, kbts_un StateIndex, kbts_u32 Codepoint)
+{
+  kbts_u32 Hash = (kbts_u32)((StateIndex << 7) | Codepoint) * 0x9E3779B1;
+  kbts__break_cache_transition *Result = &Cache->Transitions[Hash >> (32 - KBTS__BREAK_CACHE_TRANSITION_COUNT_LOG2)];
+  return Result;
+}
+
+// Returns how far back kbts__BreakAddCodepoint can put a break when adding the next codepoint.
+// These are all of the offsets that kbts__DoBreak gets called with, except for script and paragraph direction breaks.
+static kbts_s32 kbts__BreakReach(kbts_break_state *State)
+{
+  kbts_s32 Result = 0;
+  Result = KBTS__MAX(Result, -(State->PositionOffset2 + State->WordBreak2PositionOffset));
+  Result = KBTS__MAX(Result, -(State->PositionOffset2 + State->LineBreak2PositionOffset));
+  Result = KBTS__MAX(Result, -(State->PositionOffset3 + State->LineBreak3PositionOffset));
+  Result = KBTS__MAX(Result, -State->PositionOffset3);
+  Result = KBTS__MAX(Result, -State->Bidirectional1PositionOffset);
+  Result = KBTS__MAX(Result, -State->Bidirectional2PositionOffset);
+  return Result;
+}
+
+// Returns how many of the first Count codepoints are ASCII.
+static kbts_un kbts__AsciiPrefixLength(const int *Codepoints, kbts_un Count)
+{
+  kbts_un Result = 0;
+
+#if KBTS__SSE2
+  __m128i NonAsciiMask = _mm_set1_epi32(~0x7F);
+
+  while((Result + 16) <= Count)
+  {
+    const __m128i *At = (const __m128i *)&Codepoints[Result];
+    __m128i Any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(At), _mm_loadu_si128(At + 1)),
+                               _mm_or_si128(_mm_loadu_si128(At + 2), _mm_loadu_si128(At + 3)));
+    __m128i IsAscii = _mm_cmpeq_epi32(_mm_and_si128(Any, NonAsciiMask), _mm_setzero_si128());
+
+    if(_mm_movemask_epi8(IsAscii) != 0xFFFF)
+    {
+      break;
+    }
+
+    Result += 16;
+  }
+#endif
+
+  while((Result < Count) && !(Codepoints[Result] & ~0x7F))
+  {
+    Result += 1;
+  }
+
+  return Result;
+}
+
+KBTS_EXPORT int kbts_BreakAddCodepoints(kbts_break_state *State, kbts_break_cache *Cache, const int *Codepoints, int ICodepointCount, kbts_break *Breaks, int IBreakCapacity, int *BreakCount_)
+{
+  kbts_un CodepointCount = (ICodepointCount > 0) ? (kbts_un)ICodepointCount : 0;
+  kbts_un BreakCapacity = (IBreakCapacity > 0) ? (kbts_un)IBreakCapacity : 0;
+  kbts_un BreakCount = 0;
+  kbts_un CodepointIndex = 0;
+  kbts_un AsciiEnd = 0;
+
+  // Breaks that are still buffered from kbts_BreakAddCodepoint come first.
+  while((BreakCount < BreakCapacity) && kbts_Break(State, &Breaks[BreakCount]))
+  {
+    BreakCount += 1;
+  }
+
+  // While we replay cached transitions, only CurrentPosition and ScriptPositionOffset are kept up to date.
+  // The rest of the state is Cache->StateKeys[StateIndex], and has to be copied back before we use State.
+  kbts_b32 StateIsCached = 0;
+  kbts_s32 StateIndex = -1;
+  kbts_u32 Generation = Cache ? Cache->Generation : 0;
+
+  while((CodepointIndex < CodepointCount) &&
+        !State->BreakCount &&
+        ((BreakCapacity - BreakCount) >= KBTS__ARRAY_LENGTH(State->Breaks)))
+  {
+    if(CodepointIndex >= AsciiEnd)
+    {
+      // We may run out of room for breaks soon, so do not look too far ahead.
+      kbts_un ScanCount = KBTS__MIN(CodepointCount - CodepointIndex, 64);
+      AsciiEnd = CodepointIndex + kbts__AsciiPrefixLength(Codepoints + CodepointIndex, ScanCount);
+    }
+
+    kbts_u32 Codepoint = (kbts_u32)Codepoints[CodepointIndex];
+    kbts_b32 Cacheable = Cache && (CodepointIndex < AsciiEnd);
+    kbts__break_cache_transition *Transition = 0;
+
+    if(Cacheable)
+    {
+      if(StateIndex < 0)
+      {
+        StateIndex = (kbts_s32)kbts__BreakCacheState(Cache, State);
+        Generation = Cache->Generation;
+      }
+
+      Transition = kbts__BreakCacheTransition(Cache, (kbts_un)StateIndex, Codepoint);
+
+      if((Transition->State != (kbts_u32)(StateIndex + 1)) ||
+         (Transition->Codepoint != Codepoint) ||
+         (State->CurrentPosition < Transition->MinimumPosition) ||
+         (Transition->OnlyAtMinimumPosition && (State->CurrentPosition != Transition->MinimumPosition)))
+      {
+        Transition = 0;
+      }
+    }
+
+    if(Transition)
+    {
+      KBTS__FOR(TransitionBreakIndex, 0, Transition->BreakCount)
+      {
+        kbts_break *Break = &Breaks[BreakCount++];
+        *Break = KBTS__ZERO_TYPE(kbts_break);
+        Break->Position = (int)(State->CurrentPosition + (kbts_u32)(kbts_s32)Transition->BreakOffsets[TransitionBreakIndex]);
+        Break->Flags = Transition->BreakFlags[TransitionBreakIndex];
+      }
+
+      State->CurrentPosition += 1;
+      State->ScriptPositionOffset -= 1;
+      StateIndex = Transition->NextState;
+      StateIsCached = 1;
+    }
+    else
+    {
+      if(StateIsCached)
+      {
+        KBTS_MEMCPY(kbts__BreakStateKey(State), Cache->StateKeys[StateIndex], sizeof(Cache->StateKeys[StateIndex]));
+        StateIsCached = 0;
+      }
+
+      kbts_u32 CurrentPosition = State->CurrentPosition;
+      kbts_u32 ParagraphStartPosition = State->ParagraphStartPosition;
+      kbts_u32 LastScriptBreakPosition = State->LastScriptBreakPosition;
+      kbts_u32 LastDirectionBreakPosition = State->LastDirectionBreakPosition;
+      kbts_s16 ScriptPositionOffset = State->ScriptPositionOffset;
+      kbts_u32 BracketCount = State->BracketCount;
+      kbts_direction ParagraphDirection = State->ParagraphDirection;
+      kbts_s32 Reach = kbts__BreakReach(State);
+
+      kbts__BreakAddCodepoint(State, Codepoint, 1, 0);
+
+      kbts_un FirstBreakIndex = BreakCount;
+      while(kbts_Break(State, &Breaks[BreakCount]))
+      {
+        BreakCount += 1;
+      }
+
+      Cacheable = Cacheable &&
+                  (Reach <= 0x7FFF) &&
+                  !(kbts__GetUnicodeFlags(Codepoint) & KBTS_UNICODE_FLAG_MIRRORED) &&
+                  ((BreakCount - FirstBreakIndex) <= KBTS__BREAK_CACHE_TRANSITION_BREAK_CAPACITY) &&
+                  (State->ParagraphStartPosition == ParagraphStartPosition) &&
+                  (State->LastScriptBreakPosition == LastScriptBreakPosition) &&
+                  (State->LastDirectionBreakPosition == LastDirectionBreakPosition) &&
+                  (State->ScriptPositionOffset == (kbts_s16)(ScriptPositionOffset - 1)) &&
+                  (State->BracketCount == BracketCount) &&
+                  (State->ParagraphDirection == ParagraphDirection);
+
+      KBTS__FOR(BreakIndex, FirstBreakIndex, BreakCount)
+      {
+        kbts_break *Break = &Breaks[BreakIndex];
+
+        Cacheable = Cacheable &&
+                    !(Break->Flags & (KBTS_BREAK_FLAG_SCRIPT | KBTS_BREAK_FLAG_DIRECTION | KBTS_BREAK_FLAG_PARAGRAPH_DIRECTION)) &&
+                    !Break->Direction && !Break->ParagraphDirection && !Break->Script;
+      }
+
+      kbts_s32 FromStateIndex = StateIndex;
+      StateIndex = -1;
+
+      if(Cacheable)
+      {
+        kbts_un NextStateIndex = kbts__BreakCacheState(Cache, State);
+
+        if(Cache->Generation == Generation)
+        {
+          Transition = kbts__BreakCacheTransition(Cache, (kbts_un)FromStateIndex, Codepoint);
+          Transition->State = (kbts_u16)(FromStateIndex + 1);
+          Transition->NextState = (kbts_u16)NextStateIndex;
+          Transition->Codepoint = (kbts_u8)Codepoint;
+          Transition->BreakCount = (kbts_u8)(BreakCount - FirstBreakIndex);
+          Transition->MinimumPosition = 0;
+          Transition->OnlyAtMinimumPosition = (kbts_s32)CurrentPosition < Reach;
+
+          KBTS__FOR(BreakIndex, FirstBreakIndex, BreakCount)
+          {
+            kbts_s32 Offset = Breaks[BreakIndex].Position - (kbts_s32)CurrentPosition;
+            Transition->BreakOffsets[BreakIndex - FirstBreakIndex] = (kbts_s16)Offset;
+            Transition->BreakFlags[BreakIndex - FirstBreakIndex] = (kbts_u8)Breaks[BreakIndex].Flags;
+            Transition->MinimumPosition = (kbts_u16)KBTS__MAX(Transition->MinimumPosition, -Offset);
+          }
+
+          if(Transition->OnlyAtMinimumPosition)
+          {
+            Transition->MinimumPosition = (kbts_u16)CurrentPosition;
+          }
+        }
+
+        StateIndex = (kbts_s32)NextStateIndex;
+        Generation = Cache->Generation;
+      }
+    }
+
+    CodepointIndex += 1;
+  }
+
+  if(StateIsCached)
+  {
+    KBTS_MEMCPY(kbts__BreakStateKey(State), Cache->StateKeys[StateIndex], sizeof(Cache->StateKeys[StateIndex]));
+  }
+
+  if(BreakCount_)
+  {
+    *BreakCount_ = (int)BreakCount;
+  }
+
+  return (int)CodepointIndex;
+}
+
 KBTS_EXPORT void kbts_GuessTextProperties(void *Text, int TextSizeInBytes, kbts_text_format Format, kbts_direction *Direction_, kbts_script *Script_)
 {
   kbts_script Script = KBTS_SCRIPT_DONT_KNOW;
@@ -3,6 +3,26 @@
 #include <stddef.h>
 #include <limits.h>
 #include <float.h> // for FLT_MAX
+#include <stdio.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h> // For culling, see OffsetAndCullCommands.
+#define HAS_SSE2 1
+#else
+#define HAS_SSE2 0
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 #ifdef __clang__
 #pragma clang diagnostic push
@@ -20,6 +40,10 @@
 
 #define KB_TEXT_SHAPE_IMPLEMENTATION
 #define KB_TEXT_SHAPE_STATIC
+// Build with -DREFPAD_SELF_TEST to run the editor's regression checks. They are slow, so they are never on by default.
+#ifdef REFPAD_SELF_TEST
+#define KBTS_CHECK_SIMPLE_RUNS
+#endif
 #include "kb_text_shape.h"
 
 #ifdef __clang__
@@ -39,6 +63,10 @@
 
 #define TEXT_CAPACITY (1024*1024)
 #define LINE_CAPACITY 65536
+#define SHAPER_MEMORY_SIZE (256ull * 1024ull * 1024ull) // @Hardcoded. kbts holds on to the glyphs of the whole text while shaping it.
+#define MAX_WORKER_THREAD_COUNT 7 // @Hardcoded. On top of the main thread.
+#define FONT_MEMORY_SIZE (256ull * 1024ull * 1024ull) // @Hardcoded. Blobs of the fonts we load that are not in the blob cache.
+#define SHAPE_CONFIG_MEMORY_SIZE (64ull * 1024ull * 1024ull) // @Hardcoded. Shape configs for every font, script and language we shape.
 
 //
 // Arena
@@ -83,7 +111,7 @@ static void *PushSize(arena *Arena, size_t Size, int DoNotZero)
         Arena->At = NewAt;
     }
 
-    if(!DoNotZero)
+    if(Result && !DoNotZero)
     {
         memset(Result, 0, Size);
     }
@@ -93,6 +121,16 @@ static void *PushSize(arena *Arena, size_t Size, int DoNotZero)
 #define PushType(Arena, Type, DoNotZero) (Type *)PushSize((Arena), sizeof(Type), (DoNotZero))
 #define PushArray(Arena, Type, Count, DoNotZero) (Type *)PushSize((Arena), sizeof(Type) * (Count), (DoNotZero))
 
+// Carves out a region that lives by its own rules, e.g. one that is never part of a lifetime.
+static arena SubArena(arena *Parent, size_t Size)
+{
+    arena Result = ZERO;
+    Result.Base = (char *)PushSize(Parent, Size, 1);
+    Result.At = Result.Base;
+    Result.End = Result.Base + Size;
+    return Result;
+}
+
 static arena_lifetime ArenaBeginLifetime(arena *Arena)
 {
     arena_lifetime Result = ZERO;
@@ -179,6 +217,398 @@ static int RingAllocationIsValid(ring_allocator *Alloc, ring_allocation *Allocat
     return Result;
 }
 
+//
+// Pool allocator
+//
+
+// Power-of-two size classes on top of a fixed arena, so that the shaper never has to go to the CRT heap.
+// kbts allocates 4KB arena blocks and recycles them internally, so we rarely see a free outside of shutdown.
+#define POOL_MIN_SIZE_CLASS 6
+#define POOL_SIZE_CLASS_COUNT 32
+
+typedef struct pool_allocation_header
+{
+    struct pool_allocation_header *NextFree;
+    uint32_t SizeClass;
+} pool_allocation_header;
+
+typedef struct pool_frame_stats
+{
+    size_t PeakBytesInUse;
+    int AllocationCount;
+    int FreeCount;
+    int FailedAllocationCount;
+} pool_frame_stats;
+
+typedef struct pool_allocator
+{
+    arena Arena;
+    pool_allocation_header *FreeLists[POOL_SIZE_CLASS_COUNT];
+
+    // Totals since startup. Steady-state frames should not allocate at all, the frontend can log these on demand.
+    size_t BytesInUse;
+    size_t PeakBytesInUse;
+    int AllocationCount;
+    int FreeCount;
+    int FailedAllocationCount;
+
+    // Frame is reset by PoolBeginFrame, and LastFrame keeps what the previous frame did.
+    pool_frame_stats Frame;
+    pool_frame_stats LastFrame;
+} pool_allocator;
+
+static pool_allocator PoolAllocatorInit(void *Memory, size_t Size)
+{
+    pool_allocator Result = ZERO;
+    Result.Arena.Base = (char *)Memory;
+    Result.Arena.At = Result.Arena.Base;
+    Result.Arena.End = Result.Arena.Base + Size;
+    return Result;
+}
+
+// The header sits in front of the size class, so that power-of-two requests (which is what kbts mostly does) do not
+// spill into the next class.
+#define POOL_HEADER_SIZE ((sizeof(pool_allocation_header) + 15) & ~(size_t)15)
+
+static void *PoolAllocate(pool_allocator *Pool, size_t Size)
+{
+    void *Result = 0;
+
+    uint32_t SizeClass = POOL_MIN_SIZE_CLASS;
+    while((SizeClass < POOL_SIZE_CLASS_COUNT) && (((size_t)1 << SizeClass) < Size))
+    {
+        SizeClass += 1;
+    }
+
+    if(SizeClass < POOL_SIZE_CLASS_COUNT)
+    {
+        size_t ClassSize = (size_t)1 << SizeClass;
+        pool_allocation_header *Header = Pool->FreeLists[SizeClass];
+
+        if(Header)
+        {
+            Pool->FreeLists[SizeClass] = Header->NextFree;
+        }
+        else if((size_t)(Pool->Arena.End - Pool->Arena.At) >= (POOL_HEADER_SIZE + ClassSize))
+        {
+            Header = (pool_allocation_header *)Pool->Arena.At;
+            Pool->Arena.At += POOL_HEADER_SIZE + ClassSize;
+        }
+
+        if(Header)
+        {
+            Header->NextFree = 0;
+            Header->SizeClass = SizeClass;
+            Result = POINTER_OFFSET(void, Header, POOL_HEADER_SIZE);
+
+            Pool->BytesInUse += ClassSize;
+            Pool->PeakBytesInUse = MAXIMUM(Pool->PeakBytesInUse, Pool->BytesInUse);
+            Pool->Frame.PeakBytesInUse = MAXIMUM(Pool->Frame.PeakBytesInUse, Pool->BytesInUse);
+        }
+    }
+
+    Pool->AllocationCount += 1;
+    Pool->Frame.AllocationCount += 1;
+    if(!Result)
+    {
+        Pool->FailedAllocationCount += 1;
+        Pool->Frame.FailedAllocationCount += 1;
+    }
+
+    return Result;
+}
+
+static void PoolFree(pool_allocator *Pool, void *Pointer)
+{
+    if(Pointer)
+    {
+        pool_allocation_header *Header = POINTER_OFFSET(pool_allocation_header, Pointer, -(ptrdiff_t)POOL_HEADER_SIZE);
+
+        Header->NextFree = Pool->FreeLists[Header->SizeClass];
+        Pool->FreeLists[Header->SizeClass] = Header;
+
+        Pool->BytesInUse -= (size_t)1 << Header->SizeClass;
+        Pool->FreeCount += 1;
+        Pool->Frame.FreeCount += 1;
+    }
+}
+
+static void PoolBeginFrame(pool_allocator *Pool)
+{
+    Pool->LastFrame = Pool->Frame;
+
+    pool_frame_stats EmptyStats = ZERO;
+    Pool->Frame = EmptyStats;
+    Pool->Frame.PeakBytesInUse = Pool->BytesInUse;
+}
+
+static void PoolKbtsAllocator(void *Data, kbts_allocator_op *Op)
+{
+    pool_allocator *Pool = (pool_allocator *)Data;
+
+    switch(Op->Kind)
+    {
+    case KBTS_ALLOCATOR_OP_KIND_ALLOCATE: Op->Allocate.Pointer = PoolAllocate(Pool, Op->Allocate.Size); break;
+    case KBTS_ALLOCATOR_OP_KIND_FREE: PoolFree(Pool, Op->Free.Pointer); break;
+    }
+}
+
+//
+// Files
+//
+
+// Maps a whole file read-only. The pages are shared with every other process that maps the same file.
+static void *MapEntireFile(const char *Path, size_t *Size)
+{
+    void *Result = 0;
+    *Size = 0;
+
+#ifdef _WIN32
+    HANDLE File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(File != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER FileSize;
+        if(GetFileSizeEx(File, &FileSize) && (FileSize.QuadPart > 0))
+        {
+            HANDLE Mapping = CreateFileMappingA(File, 0, PAGE_READONLY, 0, 0, 0);
+            if(Mapping)
+            {
+                Result = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+                if(Result)
+                {
+                    *Size = (size_t)FileSize.QuadPart;
+                }
+
+                // The view keeps the mapping alive.
+                CloseHandle(Mapping);
+            }
+        }
+
+        CloseHandle(File);
+    }
+#else
+    int File = open(Path, O_RDONLY);
+    if(File >= 0)
+    {
+        struct stat Stat;
+        if((fstat(File, &Stat) == 0) && (Stat.st_size > 0))
+        {
+            void *Mapping = mmap(0, (size_t)Stat.st_size, PROT_READ, MAP_SHARED, File, 0);
+            if(Mapping != MAP_FAILED)
+            {
+                Result = Mapping;
+                *Size = (size_t)Stat.st_size;
+            }
+        }
+
+        // The mapping stays valid after the file is closed.
+        close(File);
+    }
+#endif
+
+    return Result;
+}
+
+static void UnmapEntireFile(void *Memory, size_t Size)
+{
+#ifdef _WIN32
+    (void)Size;
+    UnmapViewOfFile(Memory);
+#else
+    munmap(Memory, Size);
+#endif
+}
+
+// Size and last write time, to tell whether a file changed without reading it.
+static int GetFileStamp(const char *Path, uint64_t *Size, uint64_t *WriteTime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA Data;
+    int Result = GetFileAttributesExA(Path, GetFileExInfoStandard, &Data) != 0;
+
+    if(Result)
+    {
+        *Size = ((uint64_t)Data.nFileSizeHigh << 32) | Data.nFileSizeLow;
+        *WriteTime = ((uint64_t)Data.ftLastWriteTime.dwHighDateTime << 32) | Data.ftLastWriteTime.dwLowDateTime;
+    }
+#else
+    struct stat Stat;
+    int Result = stat(Path, &Stat) == 0;
+
+    if(Result)
+    {
+        *Size = (uint64_t)Stat.st_size;
+        *WriteTime = (uint64_t)Stat.st_mtime;
+    }
+#endif
+
+    return Result;
+}
+
+static void *AtomicLoadPointer(void *volatile *Pointer)
+{
+#ifdef _WIN32
+    void *Result = InterlockedCompareExchangePointer(Pointer, 0, 0);
+#else
+    void *Result = __atomic_load_n(Pointer, __ATOMIC_ACQUIRE);
+#endif
+    return Result;
+}
+
+// Returns what was in *Destination before. The exchange happened if that is Comparand.
+static void *AtomicCompareExchangePointer(void *volatile *Destination, void *Exchange, void *Comparand)
+{
+#ifdef _WIN32
+    void *Result = InterlockedCompareExchangePointer(Destination, Exchange, Comparand);
+#else
+    void *Result = __sync_val_compare_and_swap(Destination, Comparand, Exchange);
+#endif
+    return Result;
+}
+
+// Returns the new value.
+static long AtomicIncrement(volatile long *Value)
+{
+#ifdef _WIN32
+    long Result = InterlockedIncrement(Value);
+#else
+    long Result = __sync_add_and_fetch(Value, 1);
+#endif
+    return Result;
+}
+
+// Writes Header then Data to a temporary file first, so that other processes never map a partially written file.
+// The temporary name is unique to this process and call, so that concurrent writers never share one.
+static int WriteEntireFileAtomically(const char *Path, void *Header, size_t HeaderSize, void *Data, size_t Size)
+{
+    static volatile long TempFileCounter;
+    int Result = 0;
+
+#ifdef _WIN32
+    unsigned long ProcessId = (unsigned long)GetCurrentProcessId();
+#else
+    unsigned long ProcessId = (unsigned long)getpid();
+#endif
+
+    char TempPath[1024];
+    int Length = snprintf(TempPath, sizeof(TempPath), "%s.%lu-%ld.tmp", Path, ProcessId, AtomicIncrement(&TempFileCounter));
+    if((Length >= 0) && ((size_t)Length < sizeof(TempPath)))
+    {
+        FILE *File = fopen(TempPath, "wb");
+        if(File)
+        {
+            int Written = (!HeaderSize || (fwrite(Header, HeaderSize, 1, File) == 1)) &&
+                          (!Size || (fwrite(Data, Size, 1, File) == 1));
+            Written = (fclose(File) == 0) && Written;
+
+            Result = Written && (rename(TempPath, Path) == 0);
+
+            if(!Result)
+            {
+                remove(TempPath);
+            }
+        }
+    }
+
+    return Result;
+}
+
+//
+// Threads
+//
+
+typedef void parallel_job(void *Data, int Index);
+
+typedef struct parallel_for
+{
+    parallel_job *Job;
+    void *Data;
+    long Count;
+    volatile long TakenCount;
+} parallel_for;
+
+static void RunParallelJobs(parallel_for *For)
+{
+    for(long Index = AtomicIncrement(&For->TakenCount) - 1;
+        Index < For->Count;
+        Index = AtomicIncrement(&For->TakenCount) - 1)
+    {
+        For->Job(For->Data, (int)Index);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ParallelForThread(LPVOID Parameter)
+{
+    RunParallelJobs((parallel_for *)Parameter);
+    return 0;
+}
+#else
+static void *ParallelForThread(void *Parameter)
+{
+    RunParallelJobs((parallel_for *)Parameter);
+    return 0;
+}
+#endif
+
+// Calls Job for every index in [0, Count), and returns once they are all done.
+// Threads are started for the occasion, so this is meant for a few big jobs, e.g. at startup.
+// The calling thread takes jobs too, so this still works if we cannot start any thread.
+static void ParallelFor(int Count, parallel_job *Job, void *Data)
+{
+    parallel_for For = ZERO;
+    For.Job = Job;
+    For.Data = Data;
+    For.Count = Count;
+
+    int ThreadCount = 0;
+#ifdef _WIN32
+    HANDLE Threads[MAX_WORKER_THREAD_COUNT];
+#else
+    pthread_t Threads[MAX_WORKER_THREAD_COUNT];
+#endif
+
+    int Started = 1;
+    while(Started && (ThreadCount < MAX_WORKER_THREAD_COUNT) && (ThreadCount < Count - 1))
+    {
+#ifdef _WIN32
+        Threads[ThreadCount] = CreateThread(0, 0, ParallelForThread, &For, 0, 0);
+        Started = Threads[ThreadCount] != 0;
+#else
+        Started = pthread_create(&Threads[ThreadCount], 0, ParallelForThread, &For) == 0;
+#endif
+        ThreadCount += Started;
+    }
+
+    RunParallelJobs(&For);
+
+    for(int ThreadIndex = 0;
+        ThreadIndex < ThreadCount;
+        ++ThreadIndex)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(Threads[ThreadIndex], INFINITE);
+        CloseHandle(Threads[ThreadIndex]);
+#else
+        pthread_join(Threads[ThreadIndex], 0);
+#endif
+    }
+}
+
+// 64-bit FNV-1a.
+static uint64_t HashBytes(void *Data, size_t Size)
+{
+    uint64_t Result = 0xcbf29ce484222325ull;
+
+    for(size_t Index = 0; Index < Size; ++Index)
+    {
+        Result ^= ((uint8_t *)Data)[Index];
+        Result *= 0x100000001b3ull;
+    }
+
+    return Result;
+}
+
 //
 //
 //
@@ -203,13 +633,56 @@ typedef struct cell_cache_entry
     uint8_t *Pixels; // [CellWidth * CellHeight]
 } cell_cache_entry;
 
+// What we need to know about a font without loading it: enough to sort it by style, to lay out lines
+// and to tell which text it might cover. Saved next to the blob cache, see LoadFonts.
+#define FONT_SUMMARY_VERSION 1
+#define FONT_SUMMARY_BMP_WORD_COUNT (0x10000 / 64)
+#define FONT_SUMMARY_BLOCK_SIZE 256
+#define FONT_SUMMARY_BLOCK_WORD_COUNT ((0x110000 - 0x10000) / FONT_SUMMARY_BLOCK_SIZE / 64)
+typedef struct font_summary
+{
+    uint32_t Version;
+    kbts_font_style_flags StyleFlags;
+
+    // hhea metrics in font units, like stbtt_GetFontVMetrics.
+    int Ascent;
+    int Descent;
+    int LineGap;
+
+    // One bit per codepoint in the BMP that has a glyph. Above the BMP, one bit per block of
+    // FONT_SUMMARY_BLOCK_SIZE codepoints that has any glyph, so those bits only say that the font might have one.
+    uint64_t BmpCodepoints[FONT_SUMMARY_BMP_WORD_COUNT];
+    uint64_t SupplementaryBlocks[FONT_SUMMARY_BLOCK_WORD_COUNT];
+} font_summary;
+
+typedef uint32_t font_load_state;
+enum
+{
+    FONT_LOAD_STATE_NOT_LOADED,
+    FONT_LOAD_STATE_LOADED,
+    FONT_LOAD_STATE_FAILED,
+};
+
 typedef struct font
 {
     kbts_font Kbts;
     stbtt_fontinfo Stbtt;
     kbts_font_style_flags StyleFlags;
+
+    // Fonts are registered with only their summary, and loaded the first time some text needs them. See LoadFont.
+    const char *Path;
+    font_summary *Summary;
+    font_load_state LoadState;
 } font;
 
+// One per font, script and language that we shape. Entries are never removed, see GetShapeConfig.
+typedef struct shape_config_entry
+{
+    struct shape_config_entry *Next;
+    kbts_language Language;
+    kbts_shape_config *Config;
+} shape_config_entry;
+
 typedef uint32_t text_style;
 enum
 {
@@ -221,12 +694,16 @@ enum
     TEXT_STYLE_COUNT,
 };
 
+// Direction and script changes are tracked by the shaped runs. Their break flags depend on the bidi resolution of
+// the whole paragraph, which we do not redo when reshaping part of it, so we only keep the segmentation flags.
+#define CHARACTER_BREAK_FLAGS (KBTS_BREAK_FLAG_GRAPHEME | KBTS_BREAK_FLAG_WORD | KBTS_BREAK_FLAG_LINE)
+
 // Finest grain atom of editing. Something like a grapheme cluster.
 typedef struct character {
     int Codepoint;
     text_style Style;
 
-    // Filled in by the editor.
+    // Filled in by the editor. Only holds CHARACTER_BREAK_FLAGS.
     kbts_break_flags BreakFlags;
 
     // #TODO: Going to get much fatter.
@@ -257,6 +734,11 @@ typedef struct edit_line
 {
     draw_box GlyphBox;
 
+    // Vertical extent of the whole line, including the line gap. Lines are stacked without gaps,
+    // so these increase with the line index, whatever the height of each line. See LineIndexAtY.
+    float MinY;
+    float MaxY;
+
     int MinCodepointIndex;
     int MaxCodepointIndex;
 
@@ -266,6 +748,9 @@ typedef struct edit_line
     int FirstSelectionIndex;
     int OnePastLastSelectionIndex;
 
+    // Carets of [MinCodepointIndex, MaxCodepointIndex] start here in draw_command_list.CaretsX.
+    int FirstCaretIndex;
+
     kbts_direction Direction;
 
     text_alignment PreferredAlignment;
@@ -286,8 +771,8 @@ static int BoxOverlap(float Ax0, float Ay0, float Ax1, float Ay1, float Bx0, flo
 {
     int Result = (Ax1 >= Bx0) &&
                  (Ax0 < Bx1) &&
-                 (By1 >= By0) &&
-                 (By0 < By1);
+                 (Ay1 >= By0) &&
+                 (Ay0 < By1);
     return Result;
 }
 
@@ -358,22 +843,16 @@ enum draw_command_flags_enum
 {
     DRAW_COMMAND_FLAG_NONE,
     DRAW_COMMAND_FLAG_SELECTED = (1 << 0),
-    DRAW_COMMAND_FLAG_VISIBLE = (1 << 1),
 };
 
+// Positions and sizes are kept in the parallel arrays of draw_command_list. See CommandX.
 typedef struct draw_command
 {
     font *Font;
     int GlyphIndex;
     int CodepointIndex;
-    float X;
-    float Y;
     float Scale;
     draw_command_flags Flags;
-
-    // These aren't strictly necessary, but useful for hit-testing and/or placeholders.
-    float ScaledWidth;
-    float ScaledHeight;
 } draw_command;
 
 typedef struct draw_command_list
@@ -382,10 +861,40 @@ typedef struct draw_command_list
     size_t Count;
     size_t Capacity;
 
+    // Parallel to Commands. The bitmap box of each glyph, relative to the top-left of its line as computed by
+    // FlushLine. These are never moved, so that the layout can be kept across frames that only scroll.
+    // Split out so that the offset-and-cull pass can go over several commands at a time. See OffsetAndCullCommands.
+    float *CommandX;
+    float *CommandY;
+    float *CommandWidth;
+    float *CommandHeight;
+
+    // Indices of the commands that overlap the viewport, in order, and where they go on the screen.
+    // This is all the renderer needs to look at.
+    int *VisibleCommandIndices;
+    float *VisibleX;
+    float *VisibleY;
+    size_t VisibleCount;
+
+    // Parallel to Commands. Running maximum of the glyph centers on each line, in visual order, in line
+    // coordinates. Only the first command of each codepoint counts, since that is where the cursor can snap.
+    // This is monotone, so hit-testing can binary search it. See LineCodepointIndexAtX.
+    float *HitEdgesX;
+
+    // In the layout, one box per direction run of selected glyphs, in line coordinates for X and text coordinates
+    // for Y. In the list that Draw returns, only the ones that overlap the viewport, in screen coordinates.
     draw_box *Selections;
     size_t SelectionsCount;
     size_t SelectionsCapacity;
 
+    // Where the cursor goes before each codepoint, in line coordinates, with one entry per codepoint of each line.
+    // The cursor position is in codepoints. However, glyph substitutions are free to delete any number of glyphs,
+    // so codepoints that have no glyph of their own snap to the highest-index codepoint before them that does.
+    // See LocateCodepoint.
+    float *CaretsX;
+    size_t CaretsCount;
+    size_t CaretsCapacity;
+
     // In [0, 1]. Useful for drawing the scrollbar.
     float ScrollMinX;
     float ScrollMaxX;
@@ -393,10 +902,6 @@ typedef struct draw_command_list
     float ScrollMaxY;
 
     draw_cursor Cursor;
-    // The cursor position is in codepoints. However, glyph substitutions are free to
-    // delete and number of glyphs, so we need to robustly snap the cursor to the highest-index
-    // codepoint that still belongs before the cursor.
-    int ClosestCodepointIndexToCursorPlusOne;
 } draw_command_list;
 
 typedef uint32_t editor_flags;
@@ -409,6 +914,7 @@ enum editor_flags_enum
     EDITOR_FLAG_MOVE_VIEWPOINT_TO_INCLUDE_CURSOR = (1 << 2),
     EDITOR_FLAG_WRAP_LINES = (1 << 3),
     EDITOR_FLAG_DISPLAY_NEWLINES = (1 << 4),
+    EDITOR_FLAG_TEXT_CHANGED = (1 << 5), // The shaped text is stale between DirtyFirst/OnePastLastCodepointIndex.
 };
 
 typedef struct edit_position
@@ -455,6 +961,7 @@ typedef struct layout_glyph
     int Id;
     int CodepointIndex;
     kbts_direction Direction;
+    int BidiLevel; // UAX #9 embedding level. Lines are put in visual order with these. See FlushLine.
     int AdvanceX;
     int AdvanceY;
     int OffsetX;
@@ -463,12 +970,68 @@ typedef struct layout_glyph
     kbts_break_flags BreakFlags;
     int NoShapeBreak;
     int IsNewline;
+
+    // Sum of the advances of the preceding glyphs in the paragraph, in logical order.
+    // Expressed in pixels per pixel of font height, so that it holds for any font size.
+    float ParagraphAdvance;
 } layout_glyph;
 
+// Shaping output only depends on the text, so we keep it around until the text changes.
+// Glyphs are stored in logical order with their metrics in font units. Scale is filled in at layout time.
+typedef struct shaped_run
+{
+    int FirstGlyphIndex;
+    int OnePastLastGlyphIndex;
+    int FirstCodepointIndex;
+    font *Font;
+    kbts_script Script;
+    kbts_direction Direction;
+    kbts_direction ParagraphDirection;
+    int StartsParagraph;
+
+    // Right edge of the furthest glyph of the run, in paragraph advance units.
+    // Paragraphs that fit in the window don't need to look at their glyphs to wrap.
+    float MaxParagraphAdvance;
+} shaped_run;
+
+#define SHAPED_GLYPH_CAPACITY (2 * TEXT_CAPACITY) // @Hardcoded. Decomposition can produce more glyphs than codepoints.
+#define SHAPED_RUN_CAPACITY (TEXT_CAPACITY + 1) // @Hardcoded. Every run has at least one codepoint, and there is the EOF.
+
 #define MAX_FONT_COUNT 32
+
+// Bitmap boxes of the glyphs we have laid out, so that we only go through outline data the first time we see a
+// glyph at a given size. Shared with the renderer. Open addressing with linear probing, see GetGlyphMetrics.
+#define GLYPH_METRICS_CAPACITY 65536 // @Hardcoded. Must be a power of 2.
+typedef struct glyph_metrics
+{
+    // Key. FontIndexPlusOne is 0 for empty slots.
+    float Scale;
+    uint16_t FontIndexPlusOne;
+    uint16_t GlyphId;
+
+    // Same as stbtt_GetGlyphBitmapBoxSubpixel, with no shift.
+    int16_t MinX;
+    int16_t MinY;
+    int16_t MaxX;
+    int16_t MaxY;
+} glyph_metrics;
+
+// Font fallback is resolved per grapheme. Single-codepoint graphemes in the BMP, which is
+// pretty much all of the text we ever see, go through this table instead of running coverage
+// tests on every font.
+#define FONT_CACHE_CODEPOINT_COUNT 0x10000
+enum font_cache_entry_enum
+{
+    FONT_CACHE_ENTRY_UNKNOWN = 0,
+    FONT_CACHE_ENTRY_NO_FONT = -1,
+    // Otherwise, the entry is FontIndex + 1.
+};
+
 typedef struct editor
 {
     arena Arena;
+    // The layout lives below the frame, so that frames which only scroll can keep it. See Draw.
+    arena_lifetime LayoutLifetime;
     arena_lifetime FrameLifetime;
     ring_allocator UndoAllocator;
 
@@ -482,7 +1045,6 @@ typedef struct editor
     int MouseX;
     int MouseY;
 
-    float RunningAdvance; // X cursor for wrapping.
     float CursorY;
 
     float CurrentScrollX;
@@ -501,23 +1063,63 @@ typedef struct editor
 
     int FontPixelHeight;
 
+    // Where processed font blobs are cached between runs. Must end with a path separator. 0 disables the cache.
+    const char *FontBlobCacheDirectory;
+
+    // Fonts and shape configs are read-only once created, so they can be shared by shape contexts on any
+    // thread. Everything that shaping writes to lives in the contexts and scratchpads, which are per-thread.
+    // Both tables are indexed by FontIndex * KBTS_SCRIPT_COUNT + Script. See GetShapeConfig.
+    shape_config_entry **ShapeConfigs;
+    arena ShapeConfigArena; // Only pushed to with PushSizeConcurrent.
+
     kbts_shape_context *KbtsContext;
+    pool_allocator ShaperAllocator;
+    // Remembers what break analysis does on ASCII text, for both the context and ShapeWithinRun.
+    kbts_break_cache *BreakCache;
+
+    // For edits inside of a run, see ShapeWithinRun. Created on first use.
+    kbts_shape_scratchpad **DirectScratchpads;
+    kbts_glyph_storage DirectGlyphStorage;
 
     edit_line *Lines;
     int LineCount;
     int LineCapacity;
 
+    // Layout buffers. Their capacities are kept across layouts, so that they only grow once.
+    // See EnsureDrawCommandCapacity, EnsureSelectionCapacity, EnsureCaretCapacity and EnsureLineGlyphCapacity.
+    size_t DrawCommandCapacity;
+    size_t SelectionCapacity;
+    size_t CaretCapacity;
     layout_glyph *LineGlyphs;
     int LineGlyphCount;
     int LineGlyphCapacity;
-    int LastSoftLineBreakLineGlyphIndexPlusOne;
-    int LastSoftLineBreakCodepointIndex;
-    float AdvanceAtSoftLineBreak;
-    int LastShapeBreakLineGlyphIndexPlusOne;
-    int LastShapeBreakCodepointIndex;
-    float AdvanceAtShapeBreak;
+
+    glyph_metrics *GlyphMetrics;
+    int GlyphMetricsCount;
+
+    layout_glyph *ShapedGlyphs;
+    int ShapedGlyphCount;
+    shaped_run *ShapedRuns;
+    int ShapedRunCount;
+
+    // Text that changed since the last shape, in current text indices. The EOF is at TextLength.
+    int DirtyFirstCodepointIndex;
+    int DirtyOnePastLastCodepointIndex;
+    int DirtyCodepointDelta; // TextLength - TextLength at the last shape.
 
     draw_box TextBounds;
+    // How far glyph boxes stick out above and below their line, over all lines. This bounds the lines that
+    // can show up in the viewport. See Draw.
+    float MaxLineOverhangAbove;
+    float MaxLineOverhangBelow;
+
+    // Everything that FlushLine wrote for the current lines, and what it was laid out with. See Draw.
+    draw_command_list Layout;
+    int LayoutFontPixelHeight;
+    int LayoutFrameBufferWidth;
+    editor_flags LayoutFlags;
+    int LayoutSelectionStart;
+    int LayoutSelectionEnd;
 
     draw_command_list DrawList;
 
@@ -536,6 +1138,11 @@ typedef struct editor
 
     int FontIndicesByPreference[TEXT_STYLE_COUNT][MAX_FONT_COUNT];
     font Fonts[MAX_FONT_COUNT];
+    arena FontArena;
+
+    int8_t *FontCache[TEXT_STYLE_COUNT]; // [FONT_CACHE_CODEPOINT_COUNT]
+
+    uint8_t ExpectedScripts[KBTS_SCRIPT_COUNT];
 } editor;
 
 static float ClampFloat(float X, float Min, float Max)
@@ -554,533 +1161,2625 @@ static float ClampFloat(float X, float Min, float Max)
     return Result;
 }
 
-static font *PushFont(editor *Editor, const char *Path)
+// kbts turns font files into blobs: byte-swapped tables plus glyph/lookup matrices that take a while to build.
+// Blobs only contain offsets, so we can save them as-is and map them straight back in on later runs.
+// Like summaries, blobs are keyed on the file's path, size and write time, see LoadCachedFontSummary.
+// The key also covers both kbts versions, so stale blobs are simply never looked up.
+static void GetFontBlobCachePath(editor *Editor, char *Buffer, size_t BufferSize, const char *Path)
 {
-    font *Result = 0;
-    if(Editor->FontCount < MAX_FONT_COUNT)
+    Buffer[0] = 0;
+
+    uint64_t Stamp[3];
+    if(Editor->FontBlobCacheDirectory && GetFileStamp(Path, &Stamp[0], &Stamp[1]))
     {
-        Result = &Editor->Fonts[Editor->FontCount];
+        Stamp[2] = HashBytes((void *)Path, strlen(Path));
 
-        void *FontData;
-        int FontSize;
-        // @Memory: We could use the arena here.
-        Result->Kbts = kbts_FontFromFile(Path, 0, 0, 0, &FontData, &FontSize);
+        int Length = snprintf(Buffer, BufferSize, "%s%016llx-%u-%u.kbts", Editor->FontBlobCacheDirectory,
+                              (unsigned long long)HashBytes(Stamp, sizeof(Stamp)),
+                              (unsigned)KBTS_VERSION_CURRENT, (unsigned)KBTS_BLOB_VERSION_CURRENT);
 
-        if(kbts_FontIsValid(&Result->Kbts))
+        if((Length < 0) || ((size_t)Length >= BufferSize))
         {
-            stbtt_InitFont(&Result->Stbtt, (unsigned char *)FontData, stbtt_GetFontOffsetForIndex((unsigned char *)FontData, 0));
+            Buffer[0] = 0;
+        }
+    }
+}
+
+// kbts does not bounds check blobs, so a truncated or corrupt cache file would crash every later startup.
+// Cached blobs are prefixed with their size and hash, and we only hand kbts the ones that match both.
+// Hashing all of a blob would page in the whole file on every startup, so the hash only samples it:
+// the start, where kbts keeps its headers, and evenly spaced blocks after that. Files are written atomically,
+// so we are only guarding against truncation, which the size catches, and against gross damage.
+#define FONT_BLOB_CACHE_VERSION 2
+#define FONT_BLOB_HASH_HEAD_SIZE 4096
+#define FONT_BLOB_HASH_SAMPLE_COUNT 64
+#define FONT_BLOB_HASH_SAMPLE_SIZE 64
+
+typedef struct font_blob_cache_header
+{
+    uint32_t Version;
+    uint32_t Padding;
+    uint64_t BlobSize;
+    uint64_t BlobHash;
+} font_blob_cache_header;
+
+static uint64_t HashFontBlobSample(void *Blob, size_t BlobSize)
+{
+    uint64_t Result = HashBytes(&BlobSize, sizeof(BlobSize));
+
+    size_t HeadSize = MINIMUM(BlobSize, FONT_BLOB_HASH_HEAD_SIZE);
+    Result ^= HashBytes(Blob, HeadSize);
 
-            kbts_font_info Info;
-            kbts_GetFontInfo(&Result->Kbts, &Info);
-            Result->StyleFlags = Info.StyleFlags;
+    if(BlobSize > HeadSize + FONT_BLOB_HASH_SAMPLE_SIZE)
+    {
+        size_t Stride = (BlobSize - HeadSize - FONT_BLOB_HASH_SAMPLE_SIZE) / FONT_BLOB_HASH_SAMPLE_COUNT;
 
-            Editor->FontCount += 1;
+        for(size_t SampleIndex = 0; SampleIndex < FONT_BLOB_HASH_SAMPLE_COUNT; ++SampleIndex)
+        {
+            uint8_t *Sample = (uint8_t *)Blob + HeadSize + SampleIndex * Stride;
+            Result = (Result * 0x100000001b3ull) ^ HashBytes(Sample, FONT_BLOB_HASH_SAMPLE_SIZE);
         }
     }
 
     return Result;
 }
 
-static inline font *KbtsFontToFont(kbts_font *Kbts)
+static int LoadCachedFontBlob(kbts_font *Font, const char *CachePath)
 {
-    // All of our kbts fonts are inside of font structs, so this becomes a pointer offset.
-    font *Result = POINTER_OFFSET(font, Kbts, -(int)offsetof(font, Kbts));
-    return Result;
-}
+    int Result = 0;
 
-static int GetSelectionStart(editor* Editor) {
-    if (Editor->SelectionPosition.CodepointIndex > Editor->CursorPosition.CodepointIndex)
-        return Editor->CursorPosition.CodepointIndex;
-    else
-        return Editor->SelectionPosition.CodepointIndex;
-}
-static int GetSelectionEnd(editor* Editor) {
-    if (Editor->SelectionPosition.CodepointIndex > Editor->CursorPosition.CodepointIndex)
-        return Editor->SelectionPosition.CodepointIndex;
-    else
-        return Editor->CursorPosition.CodepointIndex;
-}
-static int IsCharacterSelected(editor* Editor, int CharacterIdx) {
-    return CharacterIdx >= GetSelectionStart(Editor) && CharacterIdx < GetSelectionEnd(Editor);
+    size_t FileSize;
+    void *File = MapEntireFile(CachePath, &FileSize);
+    if(File)
+    {
+        font_blob_cache_header *CacheHeader = (font_blob_cache_header *)File;
+        kbts_blob_header *Blob = (kbts_blob_header *)(CacheHeader + 1);
+        size_t BlobSize = FileSize - sizeof(font_blob_cache_header);
+        kbts_font CachedFont = ZERO;
+        kbts_load_font_state State = ZERO;
+        int ScratchSize, OutputSize;
+
+        if((FileSize >= sizeof(font_blob_cache_header) + sizeof(kbts_blob_header)) &&
+           (BlobSize <= INT_MAX) &&
+           (CacheHeader->Version == FONT_BLOB_CACHE_VERSION) &&
+           (CacheHeader->BlobSize == BlobSize) &&
+           (Blob->SizeInBytes == BlobSize) &&
+           (CacheHeader->BlobHash == HashFontBlobSample(Blob, BlobSize)) &&
+           (kbts_LoadFont(&CachedFont, &State, Blob, (int)BlobSize, 0, &ScratchSize, &OutputSize) == KBTS_LOAD_FONT_ERROR_NONE) &&
+           kbts_FontIsValid(&CachedFont))
+        {
+            *Font = CachedFont;
+            Result = 1;
+        }
+        else
+        {
+            // The caller rebuilds the blob and overwrites the bad file.
+            UnmapEntireFile(File, FileSize);
+        }
+    }
+
+    return Result;
 }
 
-static void EditorBeginLines(editor *Editor)
+static int SaveCachedFontBlob(kbts_font *Font, const char *CachePath)
 {
-    Editor->LineCount = 0;
-    Editor->TextBounds = InvalidDrawBox();
+    font_blob_cache_header CacheHeader = ZERO;
+    CacheHeader.Version = FONT_BLOB_CACHE_VERSION;
+    CacheHeader.BlobSize = Font->Blob->SizeInBytes;
+    CacheHeader.BlobHash = HashFontBlobSample(Font->Blob, Font->Blob->SizeInBytes);
+
+    int Result = WriteEntireFileAtomically(CachePath, &CacheHeader, sizeof(CacheHeader), Font->Blob, Font->Blob->SizeInBytes);
+    return Result;
 }
 
-#define INVALID_CODEPOINT_INDEX ~0u
+static void PrepareFontScripts(editor *Editor, font *Font);
 
-static edit_line *EditorBeginLine(editor *Editor, draw_command_list *DrawList)
+// Loading a font is split in steps, so that startup can run the slow ones for all fonts at once, see LoadFonts.
+// Memory for the blob comes from the font arena in between, which is the only step that has to be on the main thread.
+typedef struct font_load
 {
-    edit_line *Line = 0;
+    editor *Editor;
+    font *Font;
+    void *FontData;
+    size_t FontSize;
+    char CachePath[1024];
+
+    kbts_load_font_state State;
+    int NeedsBlob;
+    int ScratchSize;
+    int OutputSize;
+    void *ScratchMemory;
+    char *OutputMemory;
+    int Loaded;
+
+    font_summary *Summary; // Only for fonts that are loaded to build their summary.
+    char SummaryCachePath[1024];
+} font_load;
+
+// Maps the file, then gets the blob from the cache or finds out how much memory it takes to build it.
+static void BeginFontLoad(font_load *Load)
+{
+    font *Font = Load->Font;
 
-    if(Editor->LineCount < LINE_CAPACITY)
+    // The file is mapped, not read, so that kbts and stbtt share the page cache with other editor processes.
+    Load->FontData = MapEntireFile(Font->Path, &Load->FontSize);
+
+    if(Load->FontData && (Load->FontSize <= INT_MAX))
     {
-        Line = &Editor->Lines[Editor->LineCount];
-        Line->GlyphBox = InvalidDrawBox();
-        Line->FirstCommandIndex = (uint32_t)DrawList->Count;
-        Line->OnePastLastCommandIndex = (uint32_t)DrawList->Count;
-        Line->FirstSelectionIndex = (uint32_t)DrawList->SelectionsCount;
-        Line->OnePastLastSelectionIndex = (uint32_t)DrawList->SelectionsCount;
-        Line->MinCodepointIndex = INT_MAX;
-        Line->MaxCodepointIndex = INT_MIN;
-        Line->Direction = KBTS_DIRECTION_DONT_KNOW;
-        Line->ActualAlignment = Line->PreferredAlignment;
-    }
+        GetFontBlobCachePath(Load->Editor, Load->CachePath, sizeof(Load->CachePath), Font->Path);
 
-    Editor->LineGlyphCount = 0;
+        Load->Loaded = Load->CachePath[0] && LoadCachedFontBlob(&Font->Kbts, Load->CachePath);
 
-    return Line;
+        if(!Load->Loaded)
+        {
+            Load->NeedsBlob = kbts_LoadFont(&Font->Kbts, &Load->State, Load->FontData, (int)Load->FontSize, 0,
+                                            &Load->ScratchSize, &Load->OutputSize) == KBTS_LOAD_FONT_ERROR_NEED_TO_CREATE_BLOB;
+
+            if(!Load->NeedsBlob)
+            {
+                Load->ScratchSize = 0;
+                Load->OutputSize = 0;
+            }
+        }
+    }
 }
 
-static void EditorEndLine(editor *Editor, draw_command_list *DrawList)
+// Builds the blob if it was not cached, and sets up stbtt.
+static void FinishFontLoad(font_load *Load)
 {
-    if(Editor->LineCount < LINE_CAPACITY)
-    {
-        edit_line *Line = &Editor->Lines[Editor->LineCount];
-        Line->OnePastLastCommandIndex = (uint32_t)DrawList->Count;
-        Line->OnePastLastSelectionIndex = (uint32_t)DrawList->SelectionsCount;
+    font *Font = Load->Font;
 
-        Editor->TextBounds = DrawBoxUnion(Editor->TextBounds.MinX, Editor->TextBounds.MinY, Editor->TextBounds.MaxX, Editor->TextBounds.MaxY,
-                                          Line->GlyphBox.MinX, Line->GlyphBox.MinY, Line->GlyphBox.MaxX, Line->GlyphBox.MaxY);
-        Editor->LineCount += 1;
+    if(Load->NeedsBlob && Load->ScratchMemory && Load->OutputMemory &&
+       (kbts_PlaceBlob(&Font->Kbts, &Load->State, Load->ScratchMemory, Load->OutputMemory) == KBTS_LOAD_FONT_ERROR_NONE))
+    {
+        Load->Loaded = 1;
 
-        Editor->CursorY += (float)Editor->LineHeight;
+        if(Load->CachePath[0])
+        {
+            // The cache is best-effort, so a failed write only costs us the next startup.
+            SaveCachedFontBlob(&Font->Kbts, Load->CachePath);
+        }
     }
-    
-    Editor->RunningAdvance = 0;
-}
 
-static edit_line *EditorNextLine(editor *Editor, draw_command_list *DrawList)
-{
-    EditorEndLine(Editor, DrawList);
-    edit_line *Result = EditorBeginLine(Editor, DrawList);
+    if(Load->Loaded && kbts_FontIsValid(&Font->Kbts))
+    {
+        // The blob does not keep the outlines, so stbtt reads them from the mapping.
+        stbtt_InitFont(&Font->Stbtt, (unsigned char *)Load->FontData, stbtt_GetFontOffsetForIndex((unsigned char *)Load->FontData, 0));
 
-    return Result;
-}
+        Font->LoadState = FONT_LOAD_STATE_LOADED;
+    }
+    else
+    {
+        Font->LoadState = FONT_LOAD_STATE_FAILED;
 
-static edit_line *GetCurrentLine(editor *Editor)
-{
-    assert(Editor->LineCount < Editor->LineCapacity);
-    edit_line *Result = &Editor->Lines[Editor->LineCount];
-    return Result;
+        if(Load->FontData)
+        {
+            UnmapEntireFile(Load->FontData, Load->FontSize);
+        }
+    }
 }
 
-static int DrawBoxIsValid(draw_box *Box)
+// Loads Font the first time it is needed. Returns whether it can be used.
+static int LoadFont(editor *Editor, font *Font)
 {
-    // When flushing lines, we know the X bounds of selections, but not the Y bounds.
-    // We use this function at flush time, so we only take X bounds into account.
-    int Result = Box->MinX != FLT_MAX;
-    return Result;
-}
+    if(Font->LoadState == FONT_LOAD_STATE_NOT_LOADED)
+    {
+        font_load Load = ZERO;
+        Load.Editor = Editor;
+        Load.Font = Font;
+        BeginFontLoad(&Load);
 
-static void FlushLine(draw_command_list *DrawList, editor *Editor)
-{
-    float CursorX = 0;
-    float CursorY = Editor->CursorY;
-    float AscentPx = (float)Editor->Ascent;
+        // Fonts can be loaded in the middle of a frame, so the blob goes in the font arena, which never
+        // goes back. Only the scratch memory is temporary.
+        arena_lifetime OutputLifetime = ArenaBeginLifetime(&Editor->FontArena);
+        Load.OutputMemory = PushArray(&Editor->FontArena, char, Load.OutputSize, 1);
+        arena_lifetime ScratchLifetime = ArenaBeginLifetime(&Editor->FontArena);
+        Load.ScratchMemory = PushSize(&Editor->FontArena, (size_t)Load.ScratchSize, 1);
 
-    edit_line *Line = GetCurrentLine(Editor);
+        FinishFontLoad(&Load);
 
-    layout_glyph *LineGlyphs = Editor->LineGlyphs;
+        ArenaEndLifetime(&ScratchLifetime);
 
-    font *CurrentFont = 0;
-    kbts_direction CurrentDirection = KBTS_DIRECTION_DONT_KNOW;
-    draw_box Selection = InvalidDrawBox();
+        if(Font->LoadState == FONT_LOAD_STATE_LOADED)
+        {
+            // kbts asks for room for more glyph matrix pages than it usually needs, and leaves the rest untouched.
+            if(Load.NeedsBlob)
+            {
+                Editor->FontArena.At = (char *)Font->Kbts.Blob + Font->Kbts.Blob->SizeInBytes;
+            }
 
-    // @Hardcoded!
-    arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
-    int *DirectionBlockOffsets = PushArray(&Editor->Arena, int, Editor->LineGlyphCapacity + 1, 1);
-    int DirectionBlockCount = 0;
+            PrepareFontScripts(Editor, Font);
+        }
+        else
+        {
+            ArenaEndLifetime(&OutputLifetime);
+        }
+    }
 
-    // At this point, Editor->LineGlyphs is still in logical order.
-    // For drawing, we want:
-    // - Clearly separated direction blocks. An LTR paragraph will display them forward, while an
-    //   RTL one will display them backward. (The final line offset is added in a latter pass.)
-    // - Within a single block, LTR visual order.
-    for(int GlyphIndex = 0;
-        GlyphIndex < Editor->LineGlyphCount;
-        )
-    {
-        layout_glyph *Glyph = &LineGlyphs[GlyphIndex];
-        kbts_direction Direction = Glyph->Direction;
+    return Font->LoadState == FONT_LOAD_STATE_LOADED;
+}
 
-        DirectionBlockOffsets[DirectionBlockCount++] = GlyphIndex;
+// Walking the whole codespace takes a while, so without a cache to save it to we say that the font might
+// cover everything. It is loaded anyway in that case.
+static void BuildFontSummary(font *Font, font_summary *Summary, int FindCoverage)
+{
+    memset(Summary, FindCoverage ? 0 : 0xFF, sizeof(*Summary));
+    Summary->Version = FONT_SUMMARY_VERSION;
 
-        int DirectionGlyphCount = 1;
-        while((GlyphIndex + DirectionGlyphCount) < Editor->LineGlyphCount)
-        {
-            layout_glyph *BlockGlyph = &LineGlyphs[GlyphIndex + DirectionGlyphCount];
+    kbts_font_info Info;
+    kbts_GetFontInfo(&Font->Kbts, &Info);
+    Summary->StyleFlags = Info.StyleFlags;
 
-            // Subsequent glyphs with the same direction can still technically be visually broken up!
-            // Here's an example: "خرج456 now"
-            // Logical: <Arabic letters>456<space>now
-            // Visual: now<space>456<Arabic letters>
-            // The LTR sequence is broken up because the "456" is part of the previous word, which
-            // is an LTR word. In that case, we definitely do not want to insert the space in-between
-            // "456" and the Arabic letters, because that would break up the word into two! So the
-            // whitespace has to go on the left of the entire word, which naturally works if we use
-            // word breaks as boundaries here.
-            // 
+    stbtt_GetFontVMetrics(&Font->Stbtt, &Summary->Ascent, &Summary->Descent, &Summary->LineGap);
 
-            if(BlockGlyph->Direction == Direction)
+    for(int Codepoint = 0;
+        FindCoverage && (Codepoint < 0x110000);
+        ++Codepoint)
+    {
+        if(kbts_CodepointToGlyphId(&Font->Kbts, Codepoint))
+        {
+            if(Codepoint < 0x10000)
             {
-                DirectionGlyphCount += 1;
+                Summary->BmpCodepoints[Codepoint / 64] |= 1ull << (Codepoint % 64);
             }
             else
             {
-                break;
+                int Block = (Codepoint - 0x10000) / FONT_SUMMARY_BLOCK_SIZE;
+                Summary->SupplementaryBlocks[Block / 64] |= 1ull << (Block % 64);
             }
         }
+    }
+}
+
+// Summaries are keyed on the file's path, size and write time, so that we never have to read the file to find one.
+static font_summary *LoadCachedFontSummary(editor *Editor, const char *Path, char *CachePath, size_t CachePathSize)
+{
+    font_summary *Result = 0;
+    CachePath[0] = 0;
+
+    uint64_t Stamp[3];
+    if(Editor->FontBlobCacheDirectory && GetFileStamp(Path, &Stamp[0], &Stamp[1]))
+    {
+        Stamp[2] = HashBytes((void *)Path, strlen(Path));
+
+        int Length = snprintf(CachePath, CachePathSize, "%s%016llx-%u.summary", Editor->FontBlobCacheDirectory,
+                              (unsigned long long)HashBytes(Stamp, sizeof(Stamp)), (unsigned)FONT_SUMMARY_VERSION);
 
-        if(Direction == KBTS_DIRECTION_RTL)
+        if((Length < 0) || ((size_t)Length >= CachePathSize))
         {
-            for(int SwapIndex = 0;
-                SwapIndex < DirectionGlyphCount / 2;
-                ++SwapIndex)
-            {
-                layout_glyph *Left = &LineGlyphs[GlyphIndex + SwapIndex];
-                layout_glyph *Right = &LineGlyphs[GlyphIndex + DirectionGlyphCount - 1 - SwapIndex];
-                layout_glyph Swap = *Left;
-                *Left = *Right;
-                *Right = Swap;
-            }
+            CachePath[0] = 0;
         }
-
-        GlyphIndex += DirectionGlyphCount;
     }
-    DirectionBlockOffsets[DirectionBlockCount] = Editor->LineGlyphCount;
 
-    for(int UnflippedBlockIndex = 0;
-        UnflippedBlockIndex < DirectionBlockCount;
-        ++UnflippedBlockIndex)
+    if(CachePath[0])
     {
-        int BlockIndex = (Line->Direction == KBTS_DIRECTION_RTL) ? (DirectionBlockCount - 1 - UnflippedBlockIndex) : UnflippedBlockIndex;
-        int FirstGlyphIndex = DirectionBlockOffsets[BlockIndex];
-        int OnePastLastGlyphIndex = DirectionBlockOffsets[BlockIndex + 1];
+        size_t SummarySize;
+        font_summary *Summary = (font_summary *)MapEntireFile(CachePath, &SummarySize);
 
-        for(int GlyphIndex = FirstGlyphIndex;
-            GlyphIndex < OnePastLastGlyphIndex;
-            ++GlyphIndex)
+        if(Summary && (SummarySize == sizeof(font_summary)) && (Summary->Version == FONT_SUMMARY_VERSION))
         {
-            layout_glyph *Glyph = &LineGlyphs[GlyphIndex];
-            float Scale = Glyph->Scale;
+            Result = Summary;
+        }
+        else if(Summary)
+        {
+            UnmapEntireFile(Summary, SummarySize);
+        }
+    }
 
-            if(Glyph->Direction != CurrentDirection)
-            {
-                // There can be maximum one selection rectangle per direction break.
-                // We have to switch to a new selection between direction breaks because of the
-                // visual discontinuity between LTR and RTL text.
+    return Result;
+}
 
-                if(DrawBoxIsValid(&Selection))
-                {
-                    // If there's a selection that's valid, keep it.
-                    // #TODO: This is the natural place to give it height, which should be passed in.
-                    DrawList->Selections[DrawList->SelectionsCount++] = Selection;
-                }
+static void BeginFontLoadJob(void *Data, int Index)
+{
+    BeginFontLoad((font_load *)Data + Index);
+}
 
-                Selection = InvalidDrawBox();
-                CurrentDirection = Glyph->Direction;
-            }
+static void FinishFontLoadJob(void *Data, int Index)
+{
+    font_load *Load = (font_load *)Data + Index;
+    FinishFontLoad(Load);
 
-            if(Glyph->Font != CurrentFont)
-            {
-                CurrentFont = Glyph->Font;
-            }
+    if(Load->Font->LoadState == FONT_LOAD_STATE_LOADED)
+    {
+        BuildFontSummary(Load->Font, Load->Summary, Load->SummaryCachePath[0] != 0);
 
-            Line->MinCodepointIndex = MINIMUM(Line->MinCodepointIndex, Glyph->CodepointIndex);
-            Line->MaxCodepointIndex = MAXIMUM(Line->MaxCodepointIndex, Glyph->CodepointIndex);
+        if(Load->SummaryCachePath[0])
+        {
+            WriteEntireFileAtomically(Load->SummaryCachePath, 0, 0, Load->Summary, sizeof(*Load->Summary));
+        }
+    }
+}
 
-            float AdvanceXPx = (float)Glyph->AdvanceX * Scale;
-            float AdvanceYPx = (float)Glyph->AdvanceY * Scale;
-            int DoNotDisplay = 0;
-            if(!(Editor->Flags & EDITOR_FLAG_DISPLAY_NEWLINES))
-            {
-                DoNotDisplay = (Glyph->IsNewline != 0);
-            }
+// Registers fonts without loading them, as long as we have their summaries cached. The others are loaded
+// right away to build their summaries, which are then cached for the next run.
+// Those loads run in parallel, since the first run has to parse every font and building the blobs is slow.
+// Fonts that fail to load are dropped, and the rest keep the order of Paths.
+static void LoadFonts(editor *Editor, const char **Paths, int PathCount)
+{
+    font_load Loads[MAX_FONT_COUNT];
+    int LoadCount = 0;
 
-            if(DoNotDisplay)
-            {
-                AdvanceXPx = 0;
-            }
+    int FirstFontIndex = Editor->FontCount;
+    int FontCount = 0;
 
-            if(Glyph->Font)
-            {
-                int MinX, MinY, MaxX, MaxY;
-                stbtt_GetGlyphBitmapBoxSubpixel(&Glyph->Font->Stbtt, Glyph->Id, Scale, Scale, 0, 0, &MinX, &MinY, &MaxX, &MaxY);
+    for(int PathIndex = 0;
+        (PathIndex < PathCount) && (FirstFontIndex + FontCount < MAX_FONT_COUNT);
+        ++PathIndex)
+    {
+        font *Font = &Editor->Fonts[FirstFontIndex + FontCount++];
+        font EmptyFont = ZERO;
+        *Font = EmptyFont;
+        Font->Path = Paths[PathIndex];
 
-                if(DoNotDisplay)
-                {
-                    // We set the width to 0 here, which makes it so the glyph will never be marked as DRAW_COMMAND_FLAG_VISIBLE in
-                    // the layout pass.
-                    // Keeping the draw commands around as end-of-line sentinels is useful.
-                    MaxX = MinX;
-                }
+        font_load *Load = &Loads[LoadCount];
+        font_load EmptyLoad = ZERO;
+        *Load = EmptyLoad;
 
-                float GlyphX = CursorX + (float)Glyph->OffsetX * Scale;
-                float GlyphY = AscentPx + CursorY - (float)Glyph->OffsetY * Scale;
-                float GlyphWidthPx = (float)(MaxX - MinX);
-                float GlyphHeightPx = (float)(MaxY - MinY);
+        Font->Summary = LoadCachedFontSummary(Editor, Font->Path, Load->SummaryCachePath, sizeof(Load->SummaryCachePath));
 
-                draw_command DummyCommand;
-                draw_command *Command = &DummyCommand;
+        if(!Font->Summary)
+        {
+            Load->Editor = Editor;
+            Load->Font = Font;
+            LoadCount += 1;
+        }
+    }
 
-                if(DrawList->Count < DrawList->Capacity)
-                {
-                    Command = &DrawList->Commands[DrawList->Count++];
-                    Command->Font = Glyph->Font;
-                    Command->GlyphIndex = Glyph->Id;
-                    Command->CodepointIndex = Glyph->CodepointIndex;
-                    Command->X = GlyphX;
-                    Command->Y = GlyphY;
-                    Command->ScaledWidth = GlyphWidthPx;
-                    Command->ScaledHeight = GlyphHeightPx;
-                    Command->Scale = Scale;
-                    Command->Flags = 0;
-                }
+    ParallelFor(LoadCount, BeginFontLoadJob, Loads);
 
-                Line->GlyphBox = DrawBoxUnion(Line->GlyphBox.MinX, Line->GlyphBox.MinY, Line->GlyphBox.MaxX, Line->GlyphBox.MaxY,
-                                              GlyphX, GlyphY, GlyphX + GlyphWidthPx, GlyphY + GlyphHeightPx);
-
-                // Expand the bounding box of the selection on this line by the glyph.
-                // Have to do this before and after advance, for both min and max, because LTR and RTL advance in different directions,
-                // but the MinX/MaxX are visually always left/right.
-                if (IsCharacterSelected(Editor, Glyph->CodepointIndex)) {
-                    Selection.MinX = MINIMUM(CursorX, Selection.MinX);
-                    Selection.MaxX = MAXIMUM(CursorX, Selection.MaxX);
-                    Selection.MinX = MINIMUM(CursorX + AdvanceXPx, Selection.MinX);
-                    Selection.MaxX = MAXIMUM(CursorX + AdvanceXPx, Selection.MaxX);
-                    Selection.MinY = MINIMUM(CursorY, Selection.MinY);
-                    Selection.MaxY = -INFINITY; // Filled in the layout pass.
-
-                    Command->Flags |= DRAW_COMMAND_FLAG_SELECTED;
-                }
-            }
+    // The arenas are not thread-safe, so everything the loads need is pushed up front.
+    // Blobs of fonts that fail here stay in the font arena, since other blobs might have been pushed after them.
+    for(int LoadIndex = 0;
+        LoadIndex < LoadCount;
+        ++LoadIndex)
+    {
+        font_load *Load = &Loads[LoadIndex];
+        Load->OutputMemory = PushArray(&Editor->FontArena, char, Load->OutputSize, 1);
+        Load->Summary = PushType(&Editor->Arena, font_summary, 1);
+    }
 
-            // @Cleanup @Duplication: There are some annoying off-by-one differences in behavior we have to deal with here
-            // depending on which direction the run is going.
-            if(Glyph->Direction == KBTS_DIRECTION_LTR)
-            {
-                if ((Glyph->CodepointIndex <= Editor->CursorPosition.CodepointIndex) &&
-                    (!DrawList->ClosestCodepointIndexToCursorPlusOne ||
-                    ((Glyph->CodepointIndex + 1) > DrawList->ClosestCodepointIndexToCursorPlusOne))) {
-                    DrawList->ClosestCodepointIndexToCursorPlusOne = Glyph->CodepointIndex + 1;
+    arena_lifetime ScratchLifetime = ArenaBeginLifetime(&Editor->FontArena);
 
-                    DrawList->Cursor.X = CursorX;
-                    DrawList->Cursor.Y = CursorY;
+    for(int LoadIndex = 0;
+        LoadIndex < LoadCount;
+        ++LoadIndex)
+    {
+        font_load *Load = &Loads[LoadIndex];
+        Load->ScratchMemory = PushSize(&Editor->FontArena, (size_t)Load->ScratchSize, 1);
+    }
 
-                    if(!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_X))
-                    {
-                        Editor->CursorPosition.DesiredX = CursorX;
-                        Editor->CursorPosition.LineIndex = Editor->LineCount;
-                    }
-                }
-            }
-            else
-            {
-                if ((Glyph->CodepointIndex <= Editor->CursorPosition.CodepointIndex) &&
-                    (!DrawList->ClosestCodepointIndexToCursorPlusOne ||
-                    ((Glyph->CodepointIndex + 1) >= DrawList->ClosestCodepointIndexToCursorPlusOne))) {
-                    DrawList->ClosestCodepointIndexToCursorPlusOne = Glyph->CodepointIndex + 1;
+    ParallelFor(LoadCount, FinishFontLoadJob, Loads);
 
-                    DrawList->Cursor.X = CursorX + AdvanceXPx;
-                    DrawList->Cursor.Y = CursorY - AdvanceYPx;
+    ArenaEndLifetime(&ScratchLifetime);
 
-                    if(!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_X))
-                    {
-                        Editor->CursorPosition.DesiredX = CursorX + AdvanceXPx;
-                        Editor->CursorPosition.LineIndex = Editor->LineCount;
-                    }
-                }
-            }
+    for(int LoadIndex = 0;
+        LoadIndex < LoadCount;
+        ++LoadIndex)
+    {
+        font_load *Load = &Loads[LoadIndex];
 
-            CursorX += AdvanceXPx;
-            CursorY -= AdvanceYPx;
+        if(Load->Font->LoadState == FONT_LOAD_STATE_LOADED)
+        {
+            Load->Font->Summary = Load->Summary;
         }
     }
 
-    // @Duplication
-    if(DrawBoxIsValid(&Selection))
+    for(int FontIndex = FirstFontIndex;
+        FontIndex < FirstFontIndex + FontCount;
+        ++FontIndex)
     {
-        // If there's a selection that's valid, keep it.
-        // #TODO: This is the natural place to give it height, which should be passed in.
-        DrawList->Selections[DrawList->SelectionsCount++] = Selection;
-    }
+        font *Font = &Editor->Fonts[FontIndex];
 
-    ArenaEndLifetime(&Lifetime);
+        if(Font->Summary)
+        {
+            Font->StyleFlags = Font->Summary->StyleFlags;
+
+            // Shape configs are indexed by font, so the font has to be in its final slot before we prepare its scripts.
+            Editor->Fonts[Editor->FontCount] = *Font;
+            Font = &Editor->Fonts[Editor->FontCount++];
+
+            if(Font->LoadState == FONT_LOAD_STATE_LOADED)
+            {
+                PrepareFontScripts(Editor, Font);
+            }
+        }
+    }
 }
 
-static void DisplayLine(editor *Editor, draw_command_list *DrawList)
+static int FontMightCoverCodepoint(font *Font, int Codepoint)
 {
-    if(Editor->LineGlyphCount)
+    font_summary *Summary = Font->Summary;
+    int Result = 0;
+
+    if((Codepoint >= 0) && (Codepoint < 0x10000))
     {
-        FlushLine(DrawList, Editor);
-        EditorNextLine(Editor, DrawList);
+        Result = (Summary->BmpCodepoints[Codepoint / 64] >> (Codepoint % 64)) & 1;
+    }
+    else if((Codepoint >= 0x10000) && (Codepoint < 0x110000))
+    {
+        int Block = (Codepoint - 0x10000) / FONT_SUMMARY_BLOCK_SIZE;
+        Result = (Summary->SupplementaryBlocks[Block / 64] >> (Block % 64)) & 1;
     }
+
+    return Result;
 }
 
-static void EditorEndLines(editor *Editor, draw_command_list *DrawList)
+static inline font *KbtsFontToFont(kbts_font *Kbts)
 {
-    if(Editor->LineGlyphCount)
+    // All of our kbts fonts are inside of font structs, so this becomes a pointer offset.
+    font *Result = POINTER_OFFSET(font, Kbts, -(int)offsetof(font, Kbts));
+    return Result;
+}
+
+// The EOF is shaped as a newline.
+static int GetTextCodepoint(editor *Editor, int CodepointIndex)
+{
+    int Result = (CodepointIndex < Editor->TextLength) ? Editor->Text[CodepointIndex].Codepoint : '\n';
+    return Result;
+}
+
+static int FontCoversCodepoints(font *Font, editor *Editor, int FirstCodepointIndex, int OnePastLastCodepointIndex)
+{
+    kbts_font_coverage_test CoverageTest;
+    kbts_FontCoverageTestBegin(&CoverageTest, &Font->Kbts);
+
+    for(int CodepointIndex = FirstCodepointIndex;
+        CodepointIndex < OnePastLastCodepointIndex;
+        ++CodepointIndex)
     {
-        FlushLine(DrawList, Editor);
-        EditorEndLine(Editor, DrawList);
+        kbts_FontCoverageTestCodepoint(&CoverageTest, GetTextCodepoint(Editor, CodepointIndex));
     }
-}
 
-#define CURSOR_THICKNESS 4
+    int Result = kbts_FontCoverageTestEnd(&CoverageTest);
+    return Result;
+}
 
-static float AlignmentOffsetXForLine(edit_line *Line, float TextWidth)
+// Returns the most preferred font for Style that supports the entire grapheme Editor->Text[FirstCodepointIndex, OnePastLastCodepointIndex),
+// or 0 if no font does. This is the same test that the shape context would do on its font stack.
+static font *FindGraphemeFont(editor *Editor, text_style Style, int FirstCodepointIndex, int OnePastLastCodepointIndex)
 {
-    float Result = 0;
+    font *Result = 0;
+    int8_t *CacheEntry = 0;
 
-    if((Line->ActualAlignment == TEXT_ALIGNMENT_CENTER) ||
-       (Line->ActualAlignment == TEXT_ALIGNMENT_RIGHT))
+    if((OnePastLastCodepointIndex - FirstCodepointIndex) == 1)
     {
-        float LineWidth = Line->GlyphBox.MaxX - Line->GlyphBox.MinX;
-        Result = TextWidth - LineWidth;
+        int Codepoint = GetTextCodepoint(Editor, FirstCodepointIndex);
 
-        if(Line->ActualAlignment == TEXT_ALIGNMENT_CENTER)
+        if((Codepoint >= 0) && (Codepoint < FONT_CACHE_CODEPOINT_COUNT))
         {
-            Result *= 0.5f;
+            CacheEntry = &Editor->FontCache[Style][Codepoint];
+        }
+    }
+
+    if(CacheEntry && (*CacheEntry != FONT_CACHE_ENTRY_UNKNOWN))
+    {
+        if(*CacheEntry != FONT_CACHE_ENTRY_NO_FONT)
+        {
+            Result = &Editor->Fonts[*CacheEntry - 1];
         }
     }
+    else
+    {
+        int8_t NewEntry = FONT_CACHE_ENTRY_NO_FONT;
+
+        for(int PreferenceIndex = 0;
+            PreferenceIndex < Editor->FontCount;
+            ++PreferenceIndex)
+        {
+            int FontIndex = Editor->FontIndicesByPreference[Style][PreferenceIndex];
+            font *Font = &Editor->Fonts[FontIndex];
+
+            // kbts' coverage test needs a glyph for every codepoint of the grapheme, so the summary can
+            // rule out most fonts without loading them.
+            if(FontMightCoverCodepoint(Font, GetTextCodepoint(Editor, FirstCodepointIndex)) &&
+               LoadFont(Editor, Font) &&
+               FontCoversCodepoints(Font, Editor, FirstCodepointIndex, OnePastLastCodepointIndex))
+            {
+                Result = Font;
+                NewEntry = (int8_t)(FontIndex + 1);
+                break;
+            }
+        }
+
+        if(CacheEntry)
+        {
+            *CacheEntry = NewEntry;
+        }
+    }
+
+    return Result;
+}
+
+static void AssignGraphemeFont(editor *Editor, kbts_shape_codepoint *GraphemeStart, int FirstCodepointIndex, int OnePastLastCodepointIndex, int TextOffset)
+{
+    int StyleCodepointIndex = MINIMUM(TextOffset + FirstCodepointIndex, Editor->TextLength - 1);
+    text_style Style = (StyleCodepointIndex >= 0) ? Editor->Text[StyleCodepointIndex].Style : TEXT_STYLE_REGULAR;
+
+    font *Font = FindGraphemeFont(Editor, Style, TextOffset + FirstCodepointIndex, TextOffset + OnePastLastCodepointIndex);
+
+    // Unsupported graphemes normally stay in the current run, but paragraphs need a font to start with.
+    for(int PreferenceIndex = 0;
+        !Font && (!FirstCodepointIndex || (GraphemeStart->BreakFlags & KBTS_BREAK_FLAG_LINE_HARD)) &&
+        (PreferenceIndex < Editor->FontCount);
+        ++PreferenceIndex)
+    {
+        font *Candidate = &Editor->Fonts[Editor->FontIndicesByPreference[Style][PreferenceIndex]];
+
+        if(LoadFont(Editor, Candidate))
+        {
+            Font = Candidate;
+        }
+    }
+
+    GraphemeStart->Font = Font ? &Font->Kbts : 0;
+}
+
+// The shape context's font stack is kept empty, so that it does not run any coverage tests itself.
+// Instead, once segmentation is done, we walk the graphemes and fill in their fonts from our cache.
+// TextOffset is the index in Editor->Text of the first codepoint in the context.
+static void AssignFonts(editor *Editor, int TextOffset)
+{
+    kbts_shape_context *Context = Editor->KbtsContext;
+    kbts_shape_codepoint_iterator It = kbts_ShapeCurrentCodepointsIterator(Context);
+
+    kbts_shape_codepoint *GraphemeStart = 0;
+    int GraphemeStartIndex = 0;
+
+    kbts_shape_codepoint ShapeCodepoint;
+    int CodepointIndex;
+    while(kbts_ShapeCodepointIteratorNext(&It, &ShapeCodepoint, &CodepointIndex))
+    {
+        if(!GraphemeStart || (ShapeCodepoint.BreakFlags & KBTS_BREAK_FLAG_GRAPHEME))
+        {
+            if(GraphemeStart)
+            {
+                AssignGraphemeFont(Editor, GraphemeStart, GraphemeStartIndex, CodepointIndex, TextOffset);
+            }
+
+            // It.Codepoint points into the context, so we can write the font back.
+            GraphemeStart = It.Codepoint;
+            GraphemeStartIndex = CodepointIndex;
+        }
+    }
+
+    if(GraphemeStart)
+    {
+        AssignGraphemeFont(Editor, GraphemeStart, GraphemeStartIndex, CodepointIndex + 1, TextOffset);
+    }
+}
+
+// Lets threads that race to create shape configs allocate from the same arena. Memory is never given back,
+// so a thread that loses the race to publish its config just leaves it behind.
+static void *PushSizeConcurrent(arena *Arena, size_t Size)
+{
+    void *Result = 0;
+    Size = (Size + 15) & ~(size_t)15;
+
+    char *At = (char *)AtomicLoadPointer((void *volatile *)&Arena->At);
+    while(At && ((size_t)(Arena->End - At) >= Size))
+    {
+        char *Previous = (char *)AtomicCompareExchangePointer((void *volatile *)&Arena->At, At + Size, At);
+
+        if(Previous == At)
+        {
+            Result = At;
+            break;
+        }
+
+        At = Previous;
+    }
+
+    return Result;
+}
+
+static kbts_shape_config *FindShapeConfig(shape_config_entry *Entry, kbts_language Language)
+{
+    kbts_shape_config *Result = 0;
+
+    for(; Entry && !Result; Entry = Entry->Next)
+    {
+        if(Entry->Language == Language)
+        {
+            Result = Entry->Config;
+        }
+    }
+
+    return Result;
+}
+
+// Finds or creates the shape config for Font, Script and Language. Safe to call from any thread: each font and
+// script has a list of configs, one per language, and new ones are pushed on the front with a compare-exchange.
+// Configs are placed in Editor->ShapeConfigArena, so shaping a new script or language never goes to the CRT heap.
+// They live as long as the fonts do.
+static kbts_shape_config *GetShapeConfig(editor *Editor, font *Font, kbts_script Script, kbts_language Language)
+{
+    kbts_shape_config *Result = 0;
+    int FontIndex = (int)(Font - Editor->Fonts);
+
+    if((FontIndex >= 0) && (FontIndex < Editor->FontCount) && (Script < KBTS_SCRIPT_COUNT) &&
+       (Font->LoadState == FONT_LOAD_STATE_LOADED))
+    {
+        void *volatile *Slot = (void *volatile *)&Editor->ShapeConfigs[FontIndex * KBTS_SCRIPT_COUNT + Script];
+        shape_config_entry *Head = (shape_config_entry *)AtomicLoadPointer(Slot);
+        Result = FindShapeConfig(Head, Language);
+
+        if(!Result)
+        {
+            shape_config_entry *Entry = (shape_config_entry *)PushSizeConcurrent(&Editor->ShapeConfigArena, sizeof(shape_config_entry));
+            size_t ConfigSize = (size_t)kbts_SizeOfShapeConfig(&Font->Kbts, Script, Language);
+            void *ConfigMemory = Entry ? PushSizeConcurrent(&Editor->ShapeConfigArena, ConfigSize) : 0;
+
+            if(ConfigMemory)
+            {
+                Entry->Language = Language;
+                Entry->Config = kbts_PlaceShapeConfig(&Font->Kbts, Script, Language, ConfigMemory);
+
+                for(;;)
+                {
+                    Entry->Next = Head;
+                    shape_config_entry *Previous = (shape_config_entry *)AtomicCompareExchangePointer(Slot, Entry, Head);
+
+                    if(Previous == Head)
+                    {
+                        Result = Entry->Config;
+                        break;
+                    }
+
+                    // Someone else pushed a config first. If it is for our language, theirs wins.
+                    Head = Previous;
+                    Result = FindShapeConfig(Head, Language);
+                    if(Result)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return Result;
+}
+
+// Hands our configs to shape contexts, so that they do not each create their own.
+static kbts_shape_config *ProvideShapeConfig(void *Data, kbts_font *Font, kbts_script Script, kbts_language Language)
+{
+    kbts_shape_config *Result = GetShapeConfig((editor *)Data, KbtsFontToFont(Font), Script, Language);
+    return Result;
+}
+
+#ifdef REFPAD_SELF_TEST
+// Regression checks for sharing configs across threads: every thread has to get the same config for the same key,
+// and shaping with it from every thread at once has to give the same glyphs.
+// Turkish is never warmed up, so its config is created while the threads race for it.
+#define SHARED_CONFIG_CHECK_JOB_COUNT (MAX_WORKER_THREAD_COUNT + 1)
+#define SHARED_CONFIG_CHECK_GLYPH_CAPACITY 32
+
+typedef struct shared_config_check
+{
+    editor *Editor;
+    kbts_language Languages[2];
+    kbts_shape_config *Configs[SHARED_CONFIG_CHECK_JOB_COUNT][2];
+    kbts_glyph Glyphs[SHARED_CONFIG_CHECK_JOB_COUNT][2][SHARED_CONFIG_CHECK_GLYPH_CAPACITY];
+    int GlyphCounts[SHARED_CONFIG_CHECK_JOB_COUNT][2];
+} shared_config_check;
+
+static void SharedConfigCheckJob(void *Data, int Index)
+{
+    shared_config_check *Check = (shared_config_check *)Data;
+    font *Font = &Check->Editor->Fonts[0];
+    const char *Text = "office affinity fi";
+
+    for(int LanguageIndex = 0; LanguageIndex < 2; ++LanguageIndex)
+    {
+        kbts_shape_config *Config = GetShapeConfig(Check->Editor, Font, KBTS_SCRIPT_LATIN, Check->Languages[LanguageIndex]);
+        Check->Configs[Index][LanguageIndex] = Config;
+
+        // Scratchpads and glyph storage are per-thread, so they come from the CRT heap here.
+        kbts_shape_scratchpad *Scratchpad = Config ? kbts_CreateShapeScratchpad(Config, 0, 0) : 0;
+        kbts_glyph_storage Storage;
+        kbts_InitializeGlyphStorage(&Storage, 0, 0);
+
+        if(Scratchpad)
+        {
+            for(int CharacterIndex = 0; Text[CharacterIndex]; ++CharacterIndex)
+            {
+                kbts_PushGlyph(&Storage, &Font->Kbts, Text[CharacterIndex], 0, CharacterIndex);
+            }
+
+            kbts_glyph_iterator Output;
+            if(kbts_ShapeDirect(Scratchpad, &Storage, KBTS_DIRECTION_LTR, &Output) == KBTS_SHAPE_ERROR_NONE)
+            {
+                kbts_glyph *Glyph;
+                while(kbts_GlyphIteratorNext(&Output, &Glyph) &&
+                      (Check->GlyphCounts[Index][LanguageIndex] < SHARED_CONFIG_CHECK_GLYPH_CAPACITY))
+                {
+                    Check->Glyphs[Index][LanguageIndex][Check->GlyphCounts[Index][LanguageIndex]++] = *Glyph;
+                }
+            }
+
+            kbts_DestroyShapeScratchpad(Scratchpad);
+        }
+
+        kbts_FreeAllGlyphs(&Storage);
+    }
+}
+
+static void CheckSharedShapeConfigs(editor *Editor)
+{
+    if(Editor->FontCount && (Editor->Fonts[0].LoadState == FONT_LOAD_STATE_LOADED))
+    {
+        static shared_config_check Check;
+        shared_config_check EmptyCheck = ZERO;
+        Check = EmptyCheck;
+        Check.Editor = Editor;
+        Check.Languages[0] = KBTS_LANGUAGE_DONT_KNOW;
+        Check.Languages[1] = KBTS_LANGUAGE_TURKISH;
+
+        ParallelFor(SHARED_CONFIG_CHECK_JOB_COUNT, SharedConfigCheckJob, &Check);
+
+        // Languages have their own configs.
+        assert(Check.Configs[0][0] && Check.Configs[0][1] && (Check.Configs[0][0] != Check.Configs[0][1]));
+
+        for(int JobIndex = 1; JobIndex < SHARED_CONFIG_CHECK_JOB_COUNT; ++JobIndex)
+        {
+            for(int LanguageIndex = 0; LanguageIndex < 2; ++LanguageIndex)
+            {
+                assert(Check.Configs[JobIndex][LanguageIndex] == Check.Configs[0][LanguageIndex]);
+                assert(Check.GlyphCounts[JobIndex][LanguageIndex] == Check.GlyphCounts[0][LanguageIndex]);
+
+                for(int GlyphIndex = 0; GlyphIndex < Check.GlyphCounts[0][LanguageIndex]; ++GlyphIndex)
+                {
+                    kbts_glyph *Glyph = &Check.Glyphs[JobIndex][LanguageIndex][GlyphIndex];
+                    kbts_glyph *Expected = &Check.Glyphs[0][LanguageIndex][GlyphIndex];
+                    assert((Glyph->Id == Expected->Id) && (Glyph->AdvanceX == Expected->AdvanceX) &&
+                           (Glyph->OffsetX == Expected->OffsetX) && (Glyph->OffsetY == Expected->OffsetY) &&
+                           (Glyph->UserIdOrCodepointIndex == Expected->UserIdOrCodepointIndex));
+                }
+            }
+        }
+    }
+}
+#endif
+
+// Creating a shape config is slow for complex scripts, and shaping would otherwise do it
+// in the middle of the first frame that contains that script.
+// Any of our fonts can end up in a run of any script, e.g. spaces between Arabic words are
+// shaped as Arabic with the regular font, so we create configs for every loaded font.
+static void PrepareScript(editor *Editor, kbts_script Script)
+{
+    for(int FontIndex = 0;
+        FontIndex < Editor->FontCount;
+        ++FontIndex)
+    {
+        GetShapeConfig(Editor, &Editor->Fonts[FontIndex], Script, KBTS_LANGUAGE_DONT_KNOW);
+    }
+}
+
+// Index is laid out like Editor->ShapeConfigs.
+static void PrepareShapeConfigJob(void *Data, int Index)
+{
+    editor *Editor = (editor *)Data;
+    kbts_script Script = (kbts_script)(Index % KBTS_SCRIPT_COUNT);
+
+    if(Editor->ExpectedScripts[Script])
+    {
+        GetShapeConfig(Editor, &Editor->Fonts[Index / KBTS_SCRIPT_COUNT], Script, KBTS_LANGUAGE_DONT_KNOW);
+    }
+}
+
+// Can be called before the first Draw, in which case the script is prepared during initialization.
+static void ExpectScript(editor *Editor, kbts_script Script)
+{
+    if((Script < KBTS_SCRIPT_COUNT) && !Editor->ExpectedScripts[Script])
+    {
+        Editor->ExpectedScripts[Script] = 1;
+
+        if(Editor->ShapeConfigs)
+        {
+            PrepareScript(Editor, Script);
+        }
+    }
+}
+
+// A font that was just loaded brings in the scripts it supports, and needs configs for the ones we already expect.
+static void PrepareFontScripts(editor *Editor, font *Font)
+{
+    for(int Script = 0;
+        Script < KBTS_SCRIPT_COUNT;
+        ++Script)
+    {
+        if(kbts_FontSupportsScript(&Font->Kbts, (kbts_script)Script))
+        {
+            ExpectScript(Editor, (kbts_script)Script);
+        }
+
+        if(Editor->ShapeConfigs && Editor->ExpectedScripts[Script])
+        {
+            GetShapeConfig(Editor, Font, (kbts_script)Script, KBTS_LANGUAGE_DONT_KNOW);
+        }
+    }
+}
+
+static int GetSelectionStart(editor* Editor) {
+    if (Editor->SelectionPosition.CodepointIndex > Editor->CursorPosition.CodepointIndex)
+        return Editor->CursorPosition.CodepointIndex;
+    else
+        return Editor->SelectionPosition.CodepointIndex;
+}
+static int GetSelectionEnd(editor* Editor) {
+    if (Editor->SelectionPosition.CodepointIndex > Editor->CursorPosition.CodepointIndex)
+        return Editor->SelectionPosition.CodepointIndex;
+    else
+        return Editor->CursorPosition.CodepointIndex;
+}
+static int IsCharacterSelected(editor* Editor, int CharacterIdx) {
+    return CharacterIdx >= GetSelectionStart(Editor) && CharacterIdx < GetSelectionEnd(Editor);
+}
+
+static void EditorBeginLines(editor *Editor)
+{
+    Editor->LineCount = 0;
+    Editor->TextBounds = InvalidDrawBox();
+    Editor->MaxLineOverhangAbove = 0;
+    Editor->MaxLineOverhangBelow = 0;
+}
+
+#define INVALID_CODEPOINT_INDEX ~0u
+
+static edit_line *EditorBeginLine(editor *Editor, draw_command_list *DrawList)
+{
+    edit_line *Line = 0;
+
+    if(Editor->LineCount < LINE_CAPACITY)
+    {
+        Line = &Editor->Lines[Editor->LineCount];
+        Line->GlyphBox = InvalidDrawBox();
+        Line->MinY = Editor->CursorY;
+        Line->MaxY = Editor->CursorY;
+        Line->FirstCommandIndex = (uint32_t)DrawList->Count;
+        Line->OnePastLastCommandIndex = (uint32_t)DrawList->Count;
+        Line->FirstSelectionIndex = (uint32_t)DrawList->SelectionsCount;
+        Line->OnePastLastSelectionIndex = (uint32_t)DrawList->SelectionsCount;
+        Line->MinCodepointIndex = INT_MAX;
+        Line->MaxCodepointIndex = INT_MIN;
+        Line->Direction = KBTS_DIRECTION_DONT_KNOW;
+        Line->ActualAlignment = Line->PreferredAlignment;
+    }
+
+    Editor->LineGlyphCount = 0;
+
+    return Line;
+}
+
+static void EditorEndLine(editor *Editor, draw_command_list *DrawList)
+{
+    if(Editor->LineCount < LINE_CAPACITY)
+    {
+        edit_line *Line = &Editor->Lines[Editor->LineCount];
+        Line->OnePastLastCommandIndex = (uint32_t)DrawList->Count;
+        Line->OnePastLastSelectionIndex = (uint32_t)DrawList->SelectionsCount;
+
+        Editor->TextBounds = DrawBoxUnion(Editor->TextBounds.MinX, Editor->TextBounds.MinY, Editor->TextBounds.MaxX, Editor->TextBounds.MaxY,
+                                          Line->GlyphBox.MinX, Line->GlyphBox.MinY, Line->GlyphBox.MaxX, Line->GlyphBox.MaxY);
+        Editor->LineCount += 1;
+
+        Editor->CursorY += (float)Editor->LineHeight;
+        Line->MaxY = Editor->CursorY;
+
+        Editor->MaxLineOverhangAbove = MAXIMUM(Editor->MaxLineOverhangAbove, Line->MinY - Line->GlyphBox.MinY);
+        Editor->MaxLineOverhangBelow = MAXIMUM(Editor->MaxLineOverhangBelow, Line->GlyphBox.MaxY - Line->MaxY);
+    }
+}
+
+static edit_line *EditorNextLine(editor *Editor, draw_command_list *DrawList)
+{
+    EditorEndLine(Editor, DrawList);
+    edit_line *Result = EditorBeginLine(Editor, DrawList);
+
+    return Result;
+}
+
+static edit_line *GetCurrentLine(editor *Editor)
+{
+    assert(Editor->LineCount < Editor->LineCapacity);
+    edit_line *Result = &Editor->Lines[Editor->LineCount];
+    return Result;
+}
+
+static int DrawBoxIsValid(draw_box *Box)
+{
+    // When flushing lines, we know the X bounds of selections, but not the Y bounds.
+    // We use this function at flush time, so we only take X bounds into account.
+    int Result = Box->MinX != FLT_MAX;
+    return Result;
+}
+
+// RTL runs are reversed to logical order when they are shaped, because line breaking is simpler to do in
+// logical order. Lines are reversed back to visual order when they are flushed.
+static void ReverseGlyphs(layout_glyph *Glyphs, int GlyphCount)
+{
+    for(int SwapIndex = 0;
+        SwapIndex < GlyphCount / 2;
+        ++SwapIndex)
+    {
+        layout_glyph Swap = Glyphs[SwapIndex];
+        Glyphs[SwapIndex] = Glyphs[GlyphCount - 1 - SwapIndex];
+        Glyphs[GlyphCount - 1 - SwapIndex] = Swap;
+    }
+}
+
+// Layout buffers live in the layout lifetime. When one runs out, a bigger copy is pushed on top and
+// the old one goes away with the rest of the layout.
+// These must not be called from inside of a nested lifetime, which would free the copy along with it.
+// When the arena is full, they return 0 and leave the buffer as it was, see ReserveLineLayout.
+static void *CopyToBiggerArray(editor *Editor, void *Array, size_t ElementSize, size_t Count, size_t NewCapacity)
+{
+    void *Result = PushSize(&Editor->Arena, ElementSize * NewCapacity, 1);
+    if(Result)
+    {
+        memcpy(Result, Array, ElementSize * Count);
+    }
+    return Result;
+}
+
+static int EnsureDrawCommandCapacity(editor *Editor, draw_command_list *DrawList, size_t MinCapacity)
+{
+    int Result = 1;
+
+    if(DrawList->Capacity < MinCapacity)
+    {
+        size_t Count = DrawList->Count;
+        size_t NewCapacity = MAXIMUM(DrawList->Capacity * 2, MinCapacity);
+
+        // Either all of the arrays move, or none of them do.
+        arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
+        draw_command *Commands = (draw_command *)CopyToBiggerArray(Editor, DrawList->Commands, sizeof(draw_command), Count, NewCapacity);
+        float *CommandX = (float *)CopyToBiggerArray(Editor, DrawList->CommandX, sizeof(float), Count, NewCapacity);
+        float *CommandY = (float *)CopyToBiggerArray(Editor, DrawList->CommandY, sizeof(float), Count, NewCapacity);
+        float *CommandWidth = (float *)CopyToBiggerArray(Editor, DrawList->CommandWidth, sizeof(float), Count, NewCapacity);
+        float *CommandHeight = (float *)CopyToBiggerArray(Editor, DrawList->CommandHeight, sizeof(float), Count, NewCapacity);
+        float *HitEdgesX = (float *)CopyToBiggerArray(Editor, DrawList->HitEdgesX, sizeof(float), Count, NewCapacity);
+        Result = Commands && CommandX && CommandY && CommandWidth && CommandHeight && HitEdgesX;
+
+        if(Result)
+        {
+            DrawList->Commands = Commands;
+            DrawList->CommandX = CommandX;
+            DrawList->CommandY = CommandY;
+            DrawList->CommandWidth = CommandWidth;
+            DrawList->CommandHeight = CommandHeight;
+            DrawList->HitEdgesX = HitEdgesX;
+            DrawList->Capacity = NewCapacity;
+            Editor->DrawCommandCapacity = NewCapacity;
+        }
+        else
+        {
+            ArenaEndLifetime(&Lifetime);
+        }
+    }
+
+    return Result;
+}
+
+static int EnsureSelectionCapacity(editor *Editor, draw_command_list *DrawList, size_t MinCapacity)
+{
+    int Result = 1;
+
+    if(DrawList->SelectionsCapacity < MinCapacity)
+    {
+        size_t NewCapacity = MAXIMUM(DrawList->SelectionsCapacity * 2, MinCapacity);
+        draw_box *NewSelections = (draw_box *)CopyToBiggerArray(Editor, DrawList->Selections, sizeof(draw_box), DrawList->SelectionsCount, NewCapacity);
+        Result = NewSelections != 0;
+
+        if(Result)
+        {
+            DrawList->Selections = NewSelections;
+            DrawList->SelectionsCapacity = NewCapacity;
+            Editor->SelectionCapacity = NewCapacity;
+        }
+    }
+
+    return Result;
+}
+
+static int EnsureCaretCapacity(editor *Editor, draw_command_list *DrawList, size_t MinCapacity)
+{
+    int Result = 1;
+
+    if(DrawList->CaretsCapacity < MinCapacity)
+    {
+        size_t NewCapacity = MAXIMUM(DrawList->CaretsCapacity * 2, MinCapacity);
+        float *NewCaretsX = (float *)CopyToBiggerArray(Editor, DrawList->CaretsX, sizeof(float), DrawList->CaretsCount, NewCapacity);
+        Result = NewCaretsX != 0;
+
+        if(Result)
+        {
+            DrawList->CaretsX = NewCaretsX;
+            DrawList->CaretsCapacity = NewCapacity;
+            Editor->CaretCapacity = NewCapacity;
+        }
+    }
+
+    return Result;
+}
+
+static int EnsureLineGlyphCapacity(editor *Editor, int MinCapacity)
+{
+    int Result = 1;
+
+    if(Editor->LineGlyphCapacity < MinCapacity)
+    {
+        int NewCapacity = MAXIMUM(Editor->LineGlyphCapacity * 2, MinCapacity);
+        layout_glyph *NewLineGlyphs = (layout_glyph *)CopyToBiggerArray(Editor, Editor->LineGlyphs, sizeof(layout_glyph), (size_t)Editor->LineGlyphCount, (size_t)NewCapacity);
+        Result = NewLineGlyphs != 0;
+
+        if(Result)
+        {
+            Editor->LineGlyphs = NewLineGlyphs;
+            Editor->LineGlyphCapacity = NewCapacity;
+        }
+    }
+
+    return Result;
+}
+
+// Makes room for the line made of the shaped glyphs [FirstGlyphIndex, OnePastLastGlyphIndex) in every layout buffer
+// that FlushLine writes to. Returns how many of the glyphs fit, which is fewer than asked when the arena is full.
+// The caller then lays out that much of the line and stops, so a huge document gets cut off instead of crashing.
+static int ReserveLineLayout(editor *Editor, draw_command_list *DrawList, int FirstGlyphIndex, int OnePastLastGlyphIndex)
+{
+    int GlyphCount = OnePastLastGlyphIndex - FirstGlyphIndex;
+    int MinCodepointIndex = INT_MAX;
+    int MaxCodepointIndex = INT_MIN;
+
+    for(int GlyphIndex = FirstGlyphIndex;
+        GlyphIndex < OnePastLastGlyphIndex;
+        ++GlyphIndex)
+    {
+        int CodepointIndex = Editor->ShapedGlyphs[GlyphIndex].CodepointIndex;
+        MinCodepointIndex = MINIMUM(MinCodepointIndex, CodepointIndex);
+        MaxCodepointIndex = MAXIMUM(MaxCodepointIndex, CodepointIndex);
+    }
+
+    // Every glyph makes at most one draw command. Selections are closed at direction breaks, so there is
+    // at most one per glyph, plus the one that is still open at the end of the line.
+    int Fits = (GlyphCount <= 0) ||
+               (EnsureLineGlyphCapacity(Editor, Editor->LineGlyphCount + GlyphCount) &&
+                EnsureDrawCommandCapacity(Editor, DrawList, DrawList->Count + (size_t)GlyphCount) &&
+                EnsureSelectionCapacity(Editor, DrawList, DrawList->SelectionsCount + (size_t)GlyphCount + 1) &&
+                EnsureCaretCapacity(Editor, DrawList, DrawList->CaretsCount + (size_t)(MaxCodepointIndex - MinCodepointIndex + 1)));
+    int Result = GlyphCount;
+
+    if(!Fits)
+    {
+        // Take glyphs for as long as whatever we already have has room for them.
+        int Room = Editor->LineGlyphCapacity - Editor->LineGlyphCount;
+        Room = MINIMUM(Room, (int)MINIMUM(DrawList->Capacity - DrawList->Count, (size_t)INT_MAX));
+        Room = MINIMUM(Room, (int)MINIMUM(DrawList->SelectionsCapacity - DrawList->SelectionsCount, (size_t)INT_MAX) - 1);
+        size_t CaretRoom = DrawList->CaretsCapacity - DrawList->CaretsCount;
+
+        MinCodepointIndex = INT_MAX;
+        MaxCodepointIndex = INT_MIN;
+
+        for(Result = 0; Result < Room; ++Result)
+        {
+            int CodepointIndex = Editor->ShapedGlyphs[FirstGlyphIndex + Result].CodepointIndex;
+            int NewMin = MINIMUM(MinCodepointIndex, CodepointIndex);
+            int NewMax = MAXIMUM(MaxCodepointIndex, CodepointIndex);
+
+            if((size_t)(NewMax - NewMin + 1) > CaretRoom)
+            {
+                break;
+            }
+
+            MinCodepointIndex = NewMin;
+            MaxCodepointIndex = NewMax;
+        }
+    }
+
+    return Result;
+}
+
+static glyph_metrics GetGlyphMetrics(editor *Editor, font *Font, int GlyphId, float Scale)
+{
+    uint16_t FontIndexPlusOne = (uint16_t)(Font - Editor->Fonts + 1);
+    uint32_t ScaleBits;
+    memcpy(&ScaleBits, &Scale, sizeof(ScaleBits));
+
+    uint64_t Key = ((uint64_t)FontIndexPlusOne << 48) | ((uint64_t)(uint16_t)GlyphId << 32) | ScaleBits;
+    uint32_t Mask = GLYPH_METRICS_CAPACITY - 1;
+    uint32_t FirstSlotIndex = (uint32_t)((Key * 0x9e3779b97f4a7c15ull) >> 32) & Mask;
+    uint32_t SlotIndex = FirstSlotIndex;
+    glyph_metrics *Slot = &Editor->GlyphMetrics[SlotIndex];
+
+    while(Slot->FontIndexPlusOne &&
+          ((Slot->FontIndexPlusOne != FontIndexPlusOne) || (Slot->GlyphId != (uint16_t)GlyphId) || (Slot->Scale != Scale)))
+    {
+        SlotIndex = (SlotIndex + 1) & Mask;
+        Slot = &Editor->GlyphMetrics[SlotIndex];
+    }
+
+    if(!Slot->FontIndexPlusOne)
+    {
+        // The table never holds more than the glyphs of a few fonts at a few sizes, so instead of growing it,
+        // we start over when it gets too full to probe quickly. This also drops sizes we are not using anymore.
+        if(Editor->GlyphMetricsCount >= (GLYPH_METRICS_CAPACITY / 4) * 3)
+        {
+            memset(Editor->GlyphMetrics, 0, sizeof(glyph_metrics) * GLYPH_METRICS_CAPACITY);
+            Editor->GlyphMetricsCount = 0;
+            Slot = &Editor->GlyphMetrics[FirstSlotIndex];
+        }
+
+        int MinX, MinY, MaxX, MaxY;
+        stbtt_GetGlyphBitmapBoxSubpixel(&Font->Stbtt, GlyphId, Scale, Scale, 0, 0, &MinX, &MinY, &MaxX, &MaxY);
+
+        Slot->Scale = Scale;
+        Slot->FontIndexPlusOne = FontIndexPlusOne;
+        Slot->GlyphId = (uint16_t)GlyphId;
+        Slot->MinX = (int16_t)MinX;
+        Slot->MinY = (int16_t)MinY;
+        Slot->MaxX = (int16_t)MaxX;
+        Slot->MaxY = (int16_t)MaxY;
+        Editor->GlyphMetricsCount += 1;
+    }
+
+    return *Slot;
+}
+
+static void FlushLine(draw_command_list *DrawList, editor *Editor)
+{
+    // ReserveLineLayout made room for everything that this writes.
+    float CursorX = 0;
+    float CursorY = Editor->CursorY;
+    float AscentPx = (float)Editor->Ascent;
+
+    edit_line *Line = GetCurrentLine(Editor);
+
+    layout_glyph *LineGlyphs = Editor->LineGlyphs;
+
+    font *CurrentFont = 0;
+    kbts_direction CurrentDirection = KBTS_DIRECTION_DONT_KNOW;
+    draw_box Selection = InvalidDrawBox();
+    int PrevCommandCodepointIndex = ~0;
+    float HitEdgeX = -FLT_MAX;
+
+    // At this point, Editor->LineGlyphs is still in logical order.
+    // Put it in visual order with rule L2 of UAX #9: from the highest level down to the lowest odd level,
+    // reverse every sequence of glyphs that are at that level or higher. The levels were computed once
+    // per paragraph, when it was shaped.
+    int MaxLevel = 0;
+    int MinOddLevel = INT_MAX;
+
+    for(int GlyphIndex = 0;
+        GlyphIndex < Editor->LineGlyphCount;
+        ++GlyphIndex)
+    {
+        int Level = LineGlyphs[GlyphIndex].BidiLevel;
+        MaxLevel = MAXIMUM(MaxLevel, Level);
+
+        if(Level & 1)
+        {
+            MinOddLevel = MINIMUM(MinOddLevel, Level);
+        }
+
+        Line->MinCodepointIndex = MINIMUM(Line->MinCodepointIndex, LineGlyphs[GlyphIndex].CodepointIndex);
+        Line->MaxCodepointIndex = MAXIMUM(Line->MaxCodepointIndex, LineGlyphs[GlyphIndex].CodepointIndex);
+    }
+
+    // Codepoints that end up with no caret are filled in after the glyph loop.
+    size_t LineCaretCount = (size_t)(Line->MaxCodepointIndex - Line->MinCodepointIndex + 1);
+    assert(DrawList->CaretsCount + LineCaretCount <= DrawList->CaretsCapacity);
+    Line->FirstCaretIndex = (int)DrawList->CaretsCount;
+    float *LineCaretsX = DrawList->CaretsX + DrawList->CaretsCount;
+    DrawList->CaretsCount += LineCaretCount;
+
+    for(size_t CaretIndex = 0; CaretIndex < LineCaretCount; ++CaretIndex)
+    {
+        LineCaretsX[CaretIndex] = FLT_MAX;
+    }
+
+    for(int Level = MaxLevel;
+        Level >= MinOddLevel;
+        --Level)
+    {
+        for(int GlyphIndex = 0;
+            GlyphIndex < Editor->LineGlyphCount;
+            )
+        {
+            int SequenceGlyphCount = 0;
+            while(((GlyphIndex + SequenceGlyphCount) < Editor->LineGlyphCount) &&
+                  (LineGlyphs[GlyphIndex + SequenceGlyphCount].BidiLevel >= Level))
+            {
+                SequenceGlyphCount += 1;
+            }
+
+            ReverseGlyphs(LineGlyphs + GlyphIndex, SequenceGlyphCount);
+            GlyphIndex += SequenceGlyphCount + 1;
+        }
+    }
+
+    for(int GlyphIndex = 0;
+        GlyphIndex < Editor->LineGlyphCount;
+        ++GlyphIndex)
+    {
+        layout_glyph *Glyph = &LineGlyphs[GlyphIndex];
+        float Scale = Glyph->Scale;
+
+        if(Glyph->Direction != CurrentDirection)
+        {
+            // There can be maximum one selection rectangle per direction break.
+            // We have to switch to a new selection between direction breaks because of the
+            // visual discontinuity between LTR and RTL text.
+
+            if(DrawBoxIsValid(&Selection))
+            {
+                // If there's a selection that's valid, keep it.
+                // #TODO: This is the natural place to give it height, which should be passed in.
+                DrawList->Selections[DrawList->SelectionsCount++] = Selection;
+            }
+
+            Selection = InvalidDrawBox();
+            CurrentDirection = Glyph->Direction;
+        }
+
+        if(Glyph->Font != CurrentFont)
+        {
+            CurrentFont = Glyph->Font;
+        }
+
+        float AdvanceXPx = (float)Glyph->AdvanceX * Scale;
+        float AdvanceYPx = (float)Glyph->AdvanceY * Scale;
+        int DoNotDisplay = 0;
+        if(!(Editor->Flags & EDITOR_FLAG_DISPLAY_NEWLINES))
+        {
+            DoNotDisplay = (Glyph->IsNewline != 0);
+        }
+
+        if(DoNotDisplay)
+        {
+            AdvanceXPx = 0;
+        }
+
+        if(Glyph->Font)
+        {
+            glyph_metrics Metrics = GetGlyphMetrics(Editor, Glyph->Font, Glyph->Id, Scale);
+            int MinX = Metrics.MinX;
+            int MinY = Metrics.MinY;
+            int MaxX = Metrics.MaxX;
+            int MaxY = Metrics.MaxY;
+
+            if(DoNotDisplay)
+            {
+                // We set the width to 0 here, which makes it so the glyph will never be culled in as visible in
+                // the layout pass.
+                // Keeping the draw commands around as end-of-line sentinels is useful.
+                MaxX = MinX;
+            }
+
+            float GlyphX = CursorX + (float)Glyph->OffsetX * Scale;
+            float GlyphY = AscentPx + CursorY - (float)Glyph->OffsetY * Scale;
+            float GlyphWidthPx = (float)(MaxX - MinX);
+            float GlyphHeightPx = (float)(MaxY - MinY);
+
+            size_t CommandIndex = DrawList->Count++;
+            draw_command *Command = &DrawList->Commands[CommandIndex];
+            Command->Font = Glyph->Font;
+            Command->GlyphIndex = Glyph->Id;
+            Command->CodepointIndex = Glyph->CodepointIndex;
+            Command->Scale = Scale;
+            Command->Flags = 0;
+            DrawList->CommandX[CommandIndex] = GlyphX;
+            DrawList->CommandY[CommandIndex] = GlyphY - Line->MinY;
+            DrawList->CommandWidth[CommandIndex] = GlyphWidthPx;
+            DrawList->CommandHeight[CommandIndex] = GlyphHeightPx;
+
+            if(Glyph->CodepointIndex != PrevCommandCodepointIndex)
+            {
+                HitEdgeX = MAXIMUM(HitEdgeX, GlyphX + GlyphWidthPx * 0.5f);
+            }
+            DrawList->HitEdgesX[DrawList->Count - 1] = HitEdgeX;
+            PrevCommandCodepointIndex = Glyph->CodepointIndex;
+
+            Line->GlyphBox = DrawBoxUnion(Line->GlyphBox.MinX, Line->GlyphBox.MinY, Line->GlyphBox.MaxX, Line->GlyphBox.MaxY,
+                                          GlyphX, GlyphY, GlyphX + GlyphWidthPx, GlyphY + GlyphHeightPx);
+
+            // Expand the bounding box of the selection on this line by the glyph.
+            // Have to do this before and after advance, for both min and max, because LTR and RTL advance in different directions,
+            // but the MinX/MaxX are visually always left/right.
+            if (IsCharacterSelected(Editor, Glyph->CodepointIndex)) {
+                Selection.MinX = MINIMUM(CursorX, Selection.MinX);
+                Selection.MaxX = MAXIMUM(CursorX, Selection.MaxX);
+                Selection.MinX = MINIMUM(CursorX + AdvanceXPx, Selection.MinX);
+                Selection.MaxX = MAXIMUM(CursorX + AdvanceXPx, Selection.MaxX);
+                Selection.MinY = MINIMUM(CursorY, Selection.MinY);
+                Selection.MaxY = -INFINITY; // Filled in the layout pass.
+
+                Command->Flags |= DRAW_COMMAND_FLAG_SELECTED;
+            }
+        }
+
+        // The caret goes on the leading edge of the codepoint. When a codepoint makes several glyphs, that is the
+        // first one we see in LTR, and the last one we see in RTL, since we go in visual order.
+        float *CaretX = &LineCaretsX[Glyph->CodepointIndex - Line->MinCodepointIndex];
+        if(Glyph->Direction == KBTS_DIRECTION_LTR)
+        {
+            if(*CaretX == FLT_MAX)
+            {
+                *CaretX = CursorX;
+            }
+        }
+        else
+        {
+            *CaretX = CursorX + AdvanceXPx;
+        }
+
+        CursorX += AdvanceXPx;
+        CursorY -= AdvanceYPx;
+    }
+
+    // @Duplication
+    if(DrawBoxIsValid(&Selection))
+    {
+        // If there's a selection that's valid, keep it.
+        // #TODO: This is the natural place to give it height, which should be passed in.
+        DrawList->Selections[DrawList->SelectionsCount++] = Selection;
+    }
+
+    // The first codepoint of the line always has a glyph, so this never reads before the line.
+    for(size_t CaretIndex = 1; CaretIndex < LineCaretCount; ++CaretIndex)
+    {
+        if(LineCaretsX[CaretIndex] == FLT_MAX)
+        {
+            LineCaretsX[CaretIndex] = LineCaretsX[CaretIndex - 1];
+        }
+    }
+}
+
+static void DisplayLine(editor *Editor, draw_command_list *DrawList)
+{
+    if(Editor->LineGlyphCount)
+    {
+        FlushLine(DrawList, Editor);
+        EditorNextLine(Editor, DrawList);
+    }
+}
+
+static void EditorEndLines(editor *Editor, draw_command_list *DrawList)
+{
+    if(Editor->LineGlyphCount)
+    {
+        FlushLine(DrawList, Editor);
+        EditorEndLine(Editor, DrawList);
+    }
+}
+
+#define CURSOR_THICKNESS 4
+
+static float AlignmentOffsetXForLine(edit_line *Line, float TextWidth)
+{
+    float Result = 0;
+
+    if((Line->ActualAlignment == TEXT_ALIGNMENT_CENTER) ||
+       (Line->ActualAlignment == TEXT_ALIGNMENT_RIGHT))
+    {
+        float LineWidth = Line->GlyphBox.MaxX - Line->GlyphBox.MinX;
+        Result = TextWidth - LineWidth;
+
+        if(Line->ActualAlignment == TEXT_ALIGNMENT_CENTER)
+        {
+            Result *= 0.5f;
+        }
+    }
+
+    return Result;
+}
+
+// Added to the X coordinates computed by FlushLine to get on-screen coordinates.
+static float LineVisualOffsetX(editor *Editor, edit_line *Line)
+{
+    float TextWidth = Editor->TextBounds.MaxX - Editor->TextBounds.MinX;
+    float Result = AlignmentOffsetXForLine(Line, TextWidth) - Editor->CurrentScrollX;
+
+    return Result;
+}
+
+// Returns the first line that ends below Y, or LineCount if Y is past the last line.
+static int LineIndexAtY(editor *Editor, float Y)
+{
+    int Min = 0;
+    int Max = Editor->LineCount;
+    while(Min < Max)
+    {
+        int Mid = Min + (Max - Min) / 2;
+        if(Editor->Lines[Mid].MaxY > Y)
+        {
+            Max = Mid;
+        }
+        else
+        {
+            Min = Mid + 1;
+        }
+    }
+
+    return Min;
+}
+
+// Returns the line that the cursor goes on when it is before CodepointIndex, and its X in line coordinates.
+// This only looks at the carets that FlushLine recorded, so it does not depend on where the glyphs are.
+static int LocateCodepoint(editor *Editor, draw_command_list *DrawList, int CodepointIndex, float *X)
+{
+    // Lines cover increasing codepoint ranges, so we look for the last line that starts at or before CodepointIndex.
+    int Min = 0;
+    int Max = Editor->LineCount;
+    while(Min < Max)
+    {
+        int Mid = Min + (Max - Min) / 2;
+        if(Editor->Lines[Mid].MinCodepointIndex > CodepointIndex)
+        {
+            Max = Mid;
+        }
+        else
+        {
+            Min = Mid + 1;
+        }
+    }
+
+    int Result = MAXIMUM(Min - 1, 0);
+    edit_line *Line = &Editor->Lines[Result];
+
+    // Past the last glyph of the line, e.g. on a codepoint that shaping deleted, we stay after the last one we have.
+    int Offset = CodepointIndex - Line->MinCodepointIndex;
+    Offset = MAXIMUM(Offset, 0);
+    Offset = MINIMUM(Offset, Line->MaxCodepointIndex - Line->MinCodepointIndex);
+    *X = DrawList->CaretsX[Line->FirstCaretIndex + Offset];
+
+    return Result;
+}
+
+// Returns where the line that starts at FirstGlyphIndex ends, in shaped glyph indices.
+// Lines wrap at the last soft line break that fits, or at the last shape break if the line has no soft break.
+// This only reads the advances and break flags cached at shape time, so resizing never reshapes or copies glyphs.
+static int FindLineEnd(editor *Editor, int FirstGlyphIndex, int OnePastLastGlyphIndex)
+{
+    layout_glyph *Glyphs = Editor->ShapedGlyphs;
+    float PixelHeight = (float)Editor->FontPixelHeight;
+    float Width = (float)Editor->FrameBufferWidth;
+    float LineStartAdvance = Glyphs[FirstGlyphIndex].ParagraphAdvance;
+    int SoftBreakGlyphIndex = -1;
+    int SoftBreakCodepointIndex = INT_MIN;
+    int ShapeBreakGlyphIndex = -1;
+    int ShapeBreakCodepointIndex = INT_MIN;
+    font *CurrentFont = 0;
+    float Scale = 0;
+    int Result = OnePastLastGlyphIndex;
+
+    for(int GlyphIndex = FirstGlyphIndex;
+        GlyphIndex < OnePastLastGlyphIndex;
+        ++GlyphIndex)
+    {
+        layout_glyph *Glyph = &Glyphs[GlyphIndex];
+
+        if(Glyph->Font != CurrentFont)
+        {
+            CurrentFont = Glyph->Font;
+            Scale = stbtt_ScaleForPixelHeight(&CurrentFont->Stbtt, PixelHeight);
+        }
+
+        float LineTotalAdvance = (Glyph->ParagraphAdvance - LineStartAdvance) * PixelHeight + (float)Glyph->AdvanceX * Scale;
+
+        if((GlyphIndex > FirstGlyphIndex) && (LineTotalAdvance > Width))
+        {
+            int BreakGlyphIndex = ShapeBreakGlyphIndex;
+
+            if((SoftBreakGlyphIndex >= 0) &&
+               (((Glyphs[SoftBreakGlyphIndex].ParagraphAdvance - LineStartAdvance) * PixelHeight) > 0.001f)) // @Float
+            {
+                BreakGlyphIndex = SoftBreakGlyphIndex;
+            }
+
+            // When the only break is at the start of the line, the line overflows until the next one.
+            if(BreakGlyphIndex > FirstGlyphIndex)
+            {
+                Result = BreakGlyphIndex;
+                break;
+            }
+        }
+
+        if(!Glyph->NoShapeBreak)
+        {
+            if((Glyph->CodepointIndex != SoftBreakCodepointIndex) &&
+               (Glyph->BreakFlags & KBTS_BREAK_FLAG_LINE_SOFT))
+            {
+                SoftBreakGlyphIndex = GlyphIndex;
+                SoftBreakCodepointIndex = Glyph->CodepointIndex;
+            }
+
+            if(Glyph->CodepointIndex != ShapeBreakCodepointIndex)
+            {
+                ShapeBreakGlyphIndex = GlyphIndex;
+                ShapeBreakCodepointIndex = Glyph->CodepointIndex;
+            }
+        }
+    }
+
+    return Result;
+}
+
+typedef struct shaped_span
+{
+    layout_glyph *Glyphs;
+    int GlyphCount;
+    int GlyphCapacity;
+
+    shaped_run *Runs;
+    int RunCount;
+    int RunCapacity;
+} shaped_span;
+
+static void PushShapedGlyph(shaped_span *Span, font *Font, kbts_direction Direction, kbts_glyph *Glyph, int CodepointIndex, int Codepoint, kbts_break_flags BreakFlags)
+{
+    if(Span->GlyphCount < Span->GlyphCapacity)
+    {
+        layout_glyph *LayoutGlyph = &Span->Glyphs[Span->GlyphCount++];
+        memset(LayoutGlyph, 0, sizeof(*LayoutGlyph));
+        LayoutGlyph->Font = Font;
+        LayoutGlyph->Id = Glyph->Id;
+        LayoutGlyph->CodepointIndex = CodepointIndex;
+        LayoutGlyph->Direction = Direction;
+        LayoutGlyph->AdvanceX = Glyph->AdvanceX;
+        LayoutGlyph->AdvanceY = Glyph->AdvanceY;
+        LayoutGlyph->OffsetX = Glyph->OffsetX;
+        LayoutGlyph->OffsetY = Glyph->OffsetY;
+        LayoutGlyph->BreakFlags = BreakFlags;
+        LayoutGlyph->NoShapeBreak = (Glyph->Flags & KBTS_GLYPH_FLAG_NO_BREAK) != 0;
+        LayoutGlyph->IsNewline = (Codepoint == '\n');
+    }
+}
+
+// Segments and shapes the paragraph Editor->Text[FirstCodepointIndex, OnePastLastCodepointIndex) into Span.
+// OnePastLastCodepointIndex is TextLength + 1 for the last paragraph, which shapes the EOF as well.
+// Glyphs are stored in logical order, with text codepoint indices. Paragraph advances are not filled in.
+static void ShapeParagraph(editor *Editor, shaped_span *Span, int FirstCodepointIndex, int OnePastLastCodepointIndex)
+{
+    kbts_shape_context *Context = Editor->KbtsContext;
+    int OnePastLastTextIndex = MINIMUM(OnePastLastCodepointIndex, Editor->TextLength);
+
+    // Codepoints go to kbts a style at a time, so that it can break them in bulk.
+    arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
+    int CodepointCount = OnePastLastCodepointIndex - FirstCodepointIndex;
+    int *Codepoints = PushArray(&Editor->Arena, int, CodepointCount, 1);
+
+    kbts_ShapeBegin(Context, KBTS_DIRECTION_DONT_KNOW, KBTS_LANGUAGE_DONT_KNOW);
+
+    text_style CurrentStyle = TEXT_STYLE_COUNT;
+    int StyleStart = 0;
+    for (int I = FirstCodepointIndex; I < OnePastLastTextIndex; ++I) {
+        character* Character = &Editor->Text[I];
+        text_style Style = Character->Style;
+
+        if (Style != CurrentStyle)
+        {
+            if(Codepoints)
+            {
+                kbts_ShapeUtf32(Context, Codepoints + StyleStart, I - FirstCodepointIndex - StyleStart);
+                StyleStart = I - FirstCodepointIndex;
+            }
+
+            // Fonts are picked per style, so style changes always start a new run.
+            kbts_ShapeManualBreak(Context);
+
+            assert(Character->Style < TEXT_STYLE_COUNT);
+
+            CurrentStyle = Style;
+        }
+
+        if(Codepoints)
+        {
+            Codepoints[I - FirstCodepointIndex] = Editor->Text[I].Codepoint;
+        }
+        else
+        {
+            kbts_ShapeCodepoint(Context, Editor->Text[I].Codepoint);
+        }
+    }
+    if(OnePastLastCodepointIndex > Editor->TextLength)
+    {
+        // Append the EOF.
+        if(Codepoints)
+        {
+            Codepoints[CodepointCount - 1] = '\n';
+        }
+        else
+        {
+            kbts_ShapeCodepoint(Context, '\n');
+        }
+    }
+    if(Codepoints)
+    {
+        kbts_ShapeUtf32(Context, Codepoints + StyleStart, CodepointCount - StyleStart);
+    }
+    kbts_ShapeEnd(Context);
+
+    ArenaEndLifetime(&Lifetime);
+
+    AssignFonts(Editor, FirstCodepointIndex);
+
+    Span->GlyphCount = 0;
+    Span->RunCount = 0;
+
+    // Empty runs (e.g. after the last newline) are dropped, so that every run has a codepoint to be looked up by.
+    int StartsParagraph = 0;
+
+    kbts_run Run;
+    while(kbts_ShapeRun(Context, &Run))
+    {
+        StartsParagraph |= (Run.Flags & KBTS_BREAK_FLAG_LINE_HARD) != 0;
+
+        if(Span->RunCount >= Span->RunCapacity)
+        {
+            continue;
+        }
+
+        font *Font = KbtsFontToFont(Run.Font);
+
+        shaped_run *ShapedRun = &Span->Runs[Span->RunCount++];
+        ShapedRun->FirstGlyphIndex = Span->GlyphCount;
+        ShapedRun->FirstCodepointIndex = INT_MAX;
+        ShapedRun->Font = Font;
+        ShapedRun->Script = Run.Script;
+        ShapedRun->Direction = Run.Direction;
+        ShapedRun->ParagraphDirection = Run.ParagraphDirection;
+        ShapedRun->StartsParagraph = StartsParagraph;
+
+        kbts_glyph *RunGlyph;
+        while(kbts_GlyphIteratorNext(&Run.Glyphs, &RunGlyph))
+        {
+            int CodepointIndex = RunGlyph->UserIdOrCodepointIndex;
+            kbts_shape_codepoint ShapeCodepoint = ZERO;
+            kbts_ShapeGetShapeCodepoint(Context, CodepointIndex, &ShapeCodepoint);
+            ShapeCodepoint.BreakFlags &= CHARACTER_BREAK_FLAGS;
+
+            if(!CodepointIndex && FirstCodepointIndex)
+            {
+                // kbts sees the paragraph as the whole text, so it does not know about the line break in front of it.
+                ShapeCodepoint.BreakFlags |= KBTS_BREAK_FLAG_LINE;
+            }
+
+            CodepointIndex += FirstCodepointIndex;
+
+            // The EOF newline is not in the text, and there may be no room for it when the buffer is full.
+            if(CodepointIndex < Editor->TextLength)
+            {
+                Editor->Text[CodepointIndex].BreakFlags = ShapeCodepoint.BreakFlags;
+            }
+
+            ShapedRun->FirstCodepointIndex = MINIMUM(ShapedRun->FirstCodepointIndex, CodepointIndex);
+
+            PushShapedGlyph(Span, Font, Run.Direction, RunGlyph, CodepointIndex, ShapeCodepoint.Codepoint, ShapeCodepoint.BreakFlags);
+        }
+
+        ShapedRun->OnePastLastGlyphIndex = Span->GlyphCount;
+
+        if(ShapedRun->FirstGlyphIndex == ShapedRun->OnePastLastGlyphIndex)
+        {
+            Span->RunCount -= 1;
+            continue;
+        }
+
+        StartsParagraph = 0;
+
+        if(Run.Direction == KBTS_DIRECTION_RTL)
+        {
+            ReverseGlyphs(Span->Glyphs + ShapedRun->FirstGlyphIndex, ShapedRun->OnePastLastGlyphIndex - ShapedRun->FirstGlyphIndex);
+        }
+    }
+
+    if(Span->RunCount && FirstCodepointIndex)
+    {
+        Span->Runs[0].StartsParagraph = 1;
+    }
+}
+
+// Scratchpads are kept around, so that direct shaping does not have to set one up every time.
+static kbts_shape_scratchpad **GetDirectScratchpad(editor *Editor, font *Font, kbts_script Script)
+{
+    kbts_shape_scratchpad **Result = 0;
+    // The editor always shapes with KBTS_LANGUAGE_DONT_KNOW, see ShapeParagraph.
+    kbts_shape_config *Config = GetShapeConfig(Editor, Font, Script, KBTS_LANGUAGE_DONT_KNOW);
+
+    if(Config)
+    {
+        kbts_shape_scratchpad **Scratchpad = &Editor->DirectScratchpads[(Font - Editor->Fonts) * KBTS_SCRIPT_COUNT + Script];
+
+        if(!*Scratchpad)
+        {
+            *Scratchpad = kbts_CreateShapeScratchpad(Config, PoolKbtsAllocator, &Editor->ShaperAllocator);
+        }
+
+        if(*Scratchpad)
+        {
+            Result = Scratchpad;
+        }
+    }
+
+    return Result;
+}
+
+// Shapes Editor->Text[FirstCodepointIndex, OnePastLastCodepointIndex) as part of Run, reusing its font, script and
+// direction instead of segmenting the text again. Only break analysis is redone, to check that the text still
+// belongs in the run and to update its break flags.
+// Returns 0 if the text would have been itemized differently. The first codepoint keeps its break flags, since it
+// is shaped without what comes before it.
+static int ShapeWithinRun(editor *Editor, shaped_run *Run, shaped_span *Span, int FirstCodepointIndex, int OnePastLastCodepointIndex)
+{
+    int CodepointCount = OnePastLastCodepointIndex - FirstCodepointIndex;
+    text_style Style = Editor->Text[FirstCodepointIndex].Style;
+
+    // The paragraph direction comes from the first strong character, which only a whole paragraph shape can find.
+    int Result = (CodepointCount > 0) && FirstCodepointIndex && (Editor->Text[FirstCodepointIndex - 1].Codepoint != '\n');
+
+    for(int CodepointIndex = FirstCodepointIndex;
+        Result && (CodepointIndex < MINIMUM(OnePastLastCodepointIndex, Editor->TextLength));
+        ++CodepointIndex)
+    {
+        Result = (Editor->Text[CodepointIndex].Style == Style);
+    }
+
+    kbts_break_flags *BreakFlags = PushArray(&Editor->Arena, kbts_break_flags, CodepointCount + 1, 0);
+    int *Codepoints = PushArray(&Editor->Arena, int, CodepointCount, 1);
+    Result = Result && BreakFlags && Codepoints;
+
+    if(Result)
+    {
+        for(int Offset = 0;
+            Offset < CodepointCount;
+            ++Offset)
+        {
+            Codepoints[Offset] = GetTextCodepoint(Editor, FirstCodepointIndex + Offset);
+        }
+
+        kbts_break_state BreakState;
+        kbts_BreakBegin(&BreakState, Run->ParagraphDirection, KBTS_JAPANESE_LINE_BREAK_STYLE_NORMAL, 0);
+
+        for(int Offset = 0;
+            Offset <= CodepointCount;)
+        {
+            kbts_break Breaks[32];
+            int BreakCount = 0;
+
+            if(Offset < CodepointCount)
+            {
+                Offset += kbts_BreakAddCodepoints(&BreakState, Editor->BreakCache, Codepoints + Offset, CodepointCount - Offset,
+                                                  Breaks, (int)(sizeof(Breaks) / sizeof(Breaks[0])), &BreakCount);
+            }
+            else
+            {
+                kbts_BreakEnd(&BreakState);
+                while(kbts_Break(&BreakState, &Breaks[BreakCount]))
+                {
+                    BreakCount += 1;
+                }
+
+                Offset += 1;
+            }
+
+            for(int BreakIndex = 0;
+                BreakIndex < BreakCount;
+                ++BreakIndex)
+            {
+                kbts_break Break = Breaks[BreakIndex];
+                if(Break.Position < CodepointCount)
+                {
+                    BreakFlags[Break.Position] |= Break.Flags;
+
+                    // Neutral directions resolve to the paragraph's, like they do in kbts_ShapeRun.
+                    kbts_direction Direction = Break.Direction ? Break.Direction : Run->ParagraphDirection;
+
+                    if(((Break.Flags & KBTS_BREAK_FLAG_SCRIPT) && (Break.Script != Run->Script)) ||
+                       ((Break.Flags & KBTS_BREAK_FLAG_DIRECTION) && (Direction != Run->Direction)) ||
+                       (Break.Flags & KBTS_BREAK_FLAG_LINE_HARD))
+                    {
+                        Result = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // Graphemes that no font supports stay in the run they are in.
+    for(int GraphemeStart = 0;
+        Result && (GraphemeStart < CodepointCount);)
+    {
+        int GraphemeEnd = GraphemeStart + 1;
+        while((GraphemeEnd < CodepointCount) && !(BreakFlags[GraphemeEnd] & KBTS_BREAK_FLAG_GRAPHEME))
+        {
+            GraphemeEnd += 1;
+        }
+
+        font *Font = FindGraphemeFont(Editor, Style, FirstCodepointIndex + GraphemeStart, FirstCodepointIndex + GraphemeEnd);
+        Result = !Font || (Font == Run->Font);
+
+        GraphemeStart = GraphemeEnd;
+    }
+
+    kbts_shape_scratchpad **Scratchpad = Result ? GetDirectScratchpad(Editor, Run->Font, Run->Script) : 0;
+
+    if(Scratchpad)
+    {
+        kbts_glyph_storage *Storage = &Editor->DirectGlyphStorage;
+        kbts_ClearActiveGlyphs(Storage);
+
+        for(int Offset = 0;
+            Offset < CodepointCount;
+            ++Offset)
+        {
+            kbts_PushGlyph(Storage, &Run->Font->Kbts, GetTextCodepoint(Editor, FirstCodepointIndex + Offset), 0, Offset);
+        }
+
+        kbts_glyph_iterator Output;
+        if(kbts_ShapeDirect(*Scratchpad, Storage, Run->Direction, &Output) == KBTS_SHAPE_ERROR_NONE)
+        {
+            BreakFlags[0] = Editor->Text[FirstCodepointIndex].BreakFlags;
+
+            for(int Offset = 0;
+                Offset < CodepointCount;
+                ++Offset)
+            {
+                BreakFlags[Offset] &= CHARACTER_BREAK_FLAGS;
+
+                if(FirstCodepointIndex + Offset < Editor->TextLength)
+                {
+                    Editor->Text[FirstCodepointIndex + Offset].BreakFlags = BreakFlags[Offset];
+                }
+            }
+
+            Span->GlyphCount = 0;
+            Span->RunCount = 0;
+
+            kbts_glyph *Glyph;
+            while(kbts_GlyphIteratorNext(&Output, &Glyph))
+            {
+                int Offset = Glyph->UserIdOrCodepointIndex;
+                PushShapedGlyph(Span, Run->Font, Run->Direction, Glyph, FirstCodepointIndex + Offset,
+                                GetTextCodepoint(Editor, FirstCodepointIndex + Offset), BreakFlags[Offset]);
+            }
+
+            if(Run->Direction == KBTS_DIRECTION_RTL)
+            {
+                ReverseGlyphs(Span->Glyphs, Span->GlyphCount);
+            }
+        }
+        else
+        {
+            // Start over with a fresh scratchpad next time.
+            kbts_DestroyShapeScratchpad(*Scratchpad);
+            *Scratchpad = 0;
+            Result = 0;
+        }
+    }
+    else
+    {
+        Result = 0;
+    }
+
+    return Result;
+}
+
+#define BIDI(Class) KBTS_UNICODE_BIDIRECTIONAL_CLASS_##Class
+
+// Weak types, rules W1 to W7 of UAX #9, resolved in place over one paragraph. There are no explicit embeddings,
+// so sos is the paragraph direction. Afterwards, every number is EN or AN with its separators and terminators
+// folded into it, and the separators and terminators that are not part of a number are neutral (rule W6).
+static void ResolveWeakBidiClasses(kbts_unicode_bidirectional_class *Classes, int Count, int ParagraphLevel)
+{
+    kbts_unicode_bidirectional_class Sos = ParagraphLevel ? BIDI(R) : BIDI(L);
+
+    // W1, W2 and W3 only look back, so they are done in one pass.
+    kbts_unicode_bidirectional_class Previous = Sos;
+    kbts_unicode_bidirectional_class LastStrong = Sos;
+    for(int Index = 0; Index < Count; ++Index)
+    {
+        kbts_unicode_bidirectional_class Class = Classes[Index];
+
+        if(Class == BIDI(NSM))
+        {
+            Class = Previous;
+        }
+
+        if((Class == BIDI(L)) || (Class == BIDI(R)) || (Class == BIDI(AL)))
+        {
+            LastStrong = Class;
+        }
+        else if((Class == BIDI(EN)) && (LastStrong == BIDI(AL)))
+        {
+            Class = BIDI(AN);
+        }
+
+        Previous = Class;
+        Classes[Index] = (Class == BIDI(AL)) ? BIDI(R) : Class;
+    }
+
+    // W4: a single separator between two numbers of the same type joins them.
+    for(int Index = 1; Index < (Count - 1); ++Index)
+    {
+        kbts_unicode_bidirectional_class Class = Classes[Index];
+        kbts_unicode_bidirectional_class Before = Classes[Index - 1];
+        kbts_unicode_bidirectional_class After = Classes[Index + 1];
+
+        if(((Class == BIDI(ES)) || (Class == BIDI(CS))) && (Before == BIDI(EN)) && (After == BIDI(EN)))
+        {
+            Classes[Index] = BIDI(EN);
+        }
+        else if((Class == BIDI(CS)) && (Before == BIDI(AN)) && (After == BIDI(AN)))
+        {
+            Classes[Index] = BIDI(AN);
+        }
+    }
+
+    // W5: terminators next to a European number belong to it, e.g. the % in 50%.
+    for(int Index = 0; Index < Count;)
+    {
+        if(Classes[Index] == BIDI(ET))
+        {
+            int OnePastLastIndex = Index + 1;
+            while((OnePastLastIndex < Count) && (Classes[OnePastLastIndex] == BIDI(ET)))
+            {
+                OnePastLastIndex += 1;
+            }
+
+            if(((Index > 0) && (Classes[Index - 1] == BIDI(EN))) ||
+               ((OnePastLastIndex < Count) && (Classes[OnePastLastIndex] == BIDI(EN))))
+            {
+                for(int TerminatorIndex = Index; TerminatorIndex < OnePastLastIndex; ++TerminatorIndex)
+                {
+                    Classes[TerminatorIndex] = BIDI(EN);
+                }
+            }
+
+            Index = OnePastLastIndex;
+        }
+        else
+        {
+            Index += 1;
+        }
+    }
+
+    // W6 and W7. kbts has no ON class, so the leftover separators and terminators become NI.
+    LastStrong = Sos;
+    for(int Index = 0; Index < Count; ++Index)
+    {
+        kbts_unicode_bidirectional_class Class = Classes[Index];
+
+        if((Class == BIDI(ES)) || (Class == BIDI(ET)) || (Class == BIDI(CS)))
+        {
+            Classes[Index] = BIDI(NI);
+        }
+        else if((Class == BIDI(L)) || (Class == BIDI(R)))
+        {
+            LastStrong = Class;
+        }
+        else if((Class == BIDI(EN)) && (LastStrong == BIDI(L)))
+        {
+            Classes[Index] = BIDI(L);
+        }
+    }
+}
+
+#ifdef REFPAD_SELF_TEST
+// Regression checks for ResolveWeakBidiClasses: numbers inside of RTL text have to keep their separators and
+// terminators, or reordering splits them apart.
+static void CheckWeakBidiClasses(void)
+{
+    struct
+    {
+        const char *Utf8;
+        int FirstNumberIndex;
+        int NumberLength;
+        kbts_unicode_bidirectional_class NumberClass;
+    } Checks[] =
+    {
+        {u8"abc \u0633\u0644\u0627\u0645 12.5 def", 9, 4, BIDI(AN)},
+        {u8"abc \u0633\u0644\u0627\u0645 1,000 def", 9, 5, BIDI(AN)},
+        {u8"abc \u05e9\u05dc\u05d5\u05dd 50% def", 9, 3, BIDI(EN)},
+    };
+
+    for(int CheckIndex = 0; CheckIndex < (int)(sizeof(Checks) / sizeof(Checks[0])); ++CheckIndex)
+    {
+        kbts_unicode_bidirectional_class Classes[64];
+        int Count = 0;
+        const char *At = Checks[CheckIndex].Utf8;
+        kbts_un Length = strlen(At);
+
+        while(Length)
+        {
+            kbts_decode Decode = kbts_DecodeUtf8(At, Length);
+            assert(Decode.Valid && (Count < (int)(sizeof(Classes) / sizeof(Classes[0]))));
+            Classes[Count++] = kbts_CodepointBidirectionalClass(Decode.Codepoint);
+            At += Decode.SourceCharactersConsumed;
+            Length -= Decode.SourceCharactersConsumed;
+        }
+
+        ResolveWeakBidiClasses(Classes, Count, 0);
+
+        int FirstNumberIndex = Checks[CheckIndex].FirstNumberIndex;
+        int OnePastLastNumberIndex = FirstNumberIndex + Checks[CheckIndex].NumberLength;
+        for(int Index = 0; Index < Count; ++Index)
+        {
+            int InNumber = (Index >= FirstNumberIndex) && (Index < OnePastLastNumberIndex);
+            assert(InNumber == (Classes[Index] == Checks[CheckIndex].NumberClass));
+        }
+    }
+}
+#endif
+
+// Sets the bidi level of every glyph in one paragraph. This is rules W1 to W7 and I1/I2 of UAX #9; the neutrals
+// are already resolved by kbts, which gives each of them the direction of the text around it.
+static kbts_unicode_bidirectional_class GlyphBidirectionalClass(editor *Editor, layout_glyph *LayoutGlyph)
+{
+    int Codepoint = (LayoutGlyph->CodepointIndex < Editor->TextLength) ? Editor->Text[LayoutGlyph->CodepointIndex].Codepoint : '\n';
+    kbts_unicode_bidirectional_class Result = kbts_CodepointBidirectionalClass(Codepoint);
+    return Result;
+}
+
+static void ResolveParagraphBidiLevels(editor *Editor, int FirstGlyphIndex, int OnePastLastGlyphIndex, int ParagraphLevel)
+{
+    arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
+
+    int GlyphCount = OnePastLastGlyphIndex - FirstGlyphIndex;
+    kbts_unicode_bidirectional_class *Classes = PushArray(&Editor->Arena, kbts_unicode_bidirectional_class, GlyphCount, 1);
+
+    // When the arena is full, we use the unresolved classes, which only misplaces separators around numbers.
+    if(Classes)
+    {
+        for(int Index = 0; Index < GlyphCount; ++Index)
+        {
+            Classes[Index] = GlyphBidirectionalClass(Editor, &Editor->ShapedGlyphs[FirstGlyphIndex + Index]);
+        }
+
+        ResolveWeakBidiClasses(Classes, GlyphCount, ParagraphLevel);
+    }
+
+    for(int Index = 0; Index < GlyphCount; ++Index)
+    {
+        layout_glyph *LayoutGlyph = &Editor->ShapedGlyphs[FirstGlyphIndex + Index];
+        kbts_unicode_bidirectional_class Class = Classes ? Classes[Index] : GlyphBidirectionalClass(Editor, LayoutGlyph);
+        int Level = ParagraphLevel;
+
+        if(LayoutGlyph->IsNewline)
+        {
+            // Rule L1: paragraph separators are at the paragraph level.
+        }
+        else if((Class == BIDI(AN)) || (Class == BIDI(EN)))
+        {
+            // Numbers go one level above RTL text, which keeps them in place inside of it.
+            Level = (ParagraphLevel + 2) & ~1;
+        }
+        else if(Class == BIDI(L))
+        {
+            Level = (ParagraphLevel + 1) & ~1;
+        }
+        else if(Class == BIDI(R))
+        {
+            Level = ParagraphLevel | 1;
+        }
+        else if(LayoutGlyph->Direction == KBTS_DIRECTION_RTL)
+        {
+            Level = ParagraphLevel | 1;
+        }
+        else if(LayoutGlyph->Direction == KBTS_DIRECTION_LTR)
+        {
+            Level = (ParagraphLevel + 1) & ~1;
+        }
+
+        LayoutGlyph->BidiLevel = Level;
+    }
+
+    ArenaEndLifetime(&Lifetime);
+}
+
+#undef BIDI
+
+// Fills in the paragraph advances and bidi levels of every paragraph that has a run in [FirstRunIndex, OnePastLastRunIndex).
+static void ComputeParagraphAdvances(editor *Editor, int FirstRunIndex, int OnePastLastRunIndex)
+{
+    FirstRunIndex = MINIMUM(FirstRunIndex, Editor->ShapedRunCount - 1);
+
+    while((FirstRunIndex > 0) && !Editor->ShapedRuns[FirstRunIndex].StartsParagraph)
+    {
+        FirstRunIndex -= 1;
+    }
+
+    while((OnePastLastRunIndex < Editor->ShapedRunCount) && !Editor->ShapedRuns[OnePastLastRunIndex].StartsParagraph)
+    {
+        OnePastLastRunIndex += 1;
+    }
+
+    float ParagraphAdvance = 0;
+    int ParagraphLevel = 0;
+    int ParagraphFirstGlyphIndex = 0;
+
+    for(int RunIndex = FirstRunIndex;
+        RunIndex < OnePastLastRunIndex;
+        ++RunIndex)
+    {
+        shaped_run *Run = &Editor->ShapedRuns[RunIndex];
+
+        if(Run->StartsParagraph || (RunIndex == FirstRunIndex))
+        {
+            ParagraphAdvance = 0;
+            ParagraphLevel = (Run->ParagraphDirection == KBTS_DIRECTION_RTL) ? 1 : 0;
+            ParagraphFirstGlyphIndex = Run->FirstGlyphIndex;
+        }
+
+        // Paragraph advances are scaled to a font size of 1 pixel, which puts glyphs from different fonts in the same unit.
+        float UnitScale = stbtt_ScaleForPixelHeight(&Run->Font->Stbtt, 1.0f);
+        float MaxParagraphAdvance = ParagraphAdvance;
+
+        for(int GlyphIndex = Run->FirstGlyphIndex;
+            GlyphIndex < Run->OnePastLastGlyphIndex;
+            ++GlyphIndex)
+        {
+            layout_glyph *LayoutGlyph = &Editor->ShapedGlyphs[GlyphIndex];
+            LayoutGlyph->ParagraphAdvance = ParagraphAdvance;
+            ParagraphAdvance += (float)LayoutGlyph->AdvanceX * UnitScale;
+            MaxParagraphAdvance = MAXIMUM(MaxParagraphAdvance, ParagraphAdvance);
+        }
+
+        Run->MaxParagraphAdvance = MaxParagraphAdvance;
+
+        if((RunIndex + 1 == OnePastLastRunIndex) || Editor->ShapedRuns[RunIndex + 1].StartsParagraph)
+        {
+            ResolveParagraphBidiLevels(Editor, ParagraphFirstGlyphIndex, Run->OnePastLastGlyphIndex, ParagraphLevel);
+        }
+    }
+}
+
+static int FindParagraphStart(editor *Editor, int CodepointIndex)
+{
+    while((CodepointIndex > 0) && (Editor->Text[CodepointIndex - 1].Codepoint != '\n'))
+    {
+        CodepointIndex -= 1;
+    }
+
+    return CodepointIndex;
+}
+
+// The last paragraph also owns the EOF, so it ends at TextLength + 1.
+static int FindParagraphEnd(editor *Editor, int CodepointIndex)
+{
+    while((CodepointIndex < Editor->TextLength) && (Editor->Text[CodepointIndex].Codepoint != '\n'))
+    {
+        CodepointIndex += 1;
+    }
+
+    return (CodepointIndex < Editor->TextLength) ? (CodepointIndex + 1) : (Editor->TextLength + 1);
+}
+
+// Shapes the paragraphs in Editor->Text[FirstCodepointIndex, OnePastLastCodepointIndex) into Span, one at a time.
+// kbts carries script and bracket state across hard line breaks, and we want reshaping a single paragraph to give
+// the same result as shaping all of them.
+static void ShapeParagraphs(editor *Editor, shaped_span *Span, int FirstCodepointIndex, int OnePastLastCodepointIndex)
+{
+    shaped_span Paragraph = ZERO;
+    Span->GlyphCount = 0;
+    Span->RunCount = 0;
+
+    for(int ParagraphStart = FirstCodepointIndex;
+        ParagraphStart < OnePastLastCodepointIndex;)
+    {
+        int ParagraphEnd = FindParagraphEnd(Editor, ParagraphStart);
+
+        Paragraph.Glyphs = Span->Glyphs + Span->GlyphCount;
+        Paragraph.GlyphCapacity = Span->GlyphCapacity - Span->GlyphCount;
+        Paragraph.Runs = Span->Runs + Span->RunCount;
+        Paragraph.RunCapacity = Span->RunCapacity - Span->RunCount;
+
+        ShapeParagraph(Editor, &Paragraph, ParagraphStart, ParagraphEnd);
+
+        for(int RunIndex = 0; RunIndex < Paragraph.RunCount; ++RunIndex)
+        {
+            Paragraph.Runs[RunIndex].FirstGlyphIndex += Span->GlyphCount;
+            Paragraph.Runs[RunIndex].OnePastLastGlyphIndex += Span->GlyphCount;
+        }
+
+        Span->GlyphCount += Paragraph.GlyphCount;
+        Span->RunCount += Paragraph.RunCount;
+
+        ParagraphStart = ParagraphEnd;
+    }
+}
+
+// Shapes the whole text into Editor->ShapedGlyphs. The results are in font units, so font size changes only affect layout.
+static void ShapeText(editor *Editor)
+{
+    shaped_span Span = ZERO;
+    Span.Glyphs = Editor->ShapedGlyphs;
+    Span.GlyphCapacity = SHAPED_GLYPH_CAPACITY;
+    Span.Runs = Editor->ShapedRuns;
+    Span.RunCapacity = SHAPED_RUN_CAPACITY;
+
+    ShapeParagraphs(Editor, &Span, 0, Editor->TextLength + 1);
+
+    Editor->ShapedGlyphCount = Span.GlyphCount;
+    Editor->ShapedRunCount = Span.RunCount;
+
+    ComputeParagraphAdvances(Editor, 0, Editor->ShapedRunCount);
+}
+
+// Records that Text[FirstCodepointIndex, OnePastLastBefore) was replaced with Text[FirstCodepointIndex, OnePastLastAfter).
+static void InvalidateText(editor *Editor, int FirstCodepointIndex, int OnePastLastBefore, int OnePastLastAfter)
+{
+    int Delta = OnePastLastAfter - OnePastLastBefore;
+
+    if(Editor->Flags & EDITOR_FLAG_TEXT_CHANGED)
+    {
+        // Move the existing dirty range into post-edit indices, then merge.
+        int DirtyOnePastLast = Editor->DirtyOnePastLastCodepointIndex;
+
+        if(DirtyOnePastLast >= OnePastLastBefore)
+        {
+            DirtyOnePastLast += Delta;
+        }
+        else if(DirtyOnePastLast > FirstCodepointIndex)
+        {
+            DirtyOnePastLast = OnePastLastAfter;
+        }
+
+        Editor->DirtyFirstCodepointIndex = MINIMUM(Editor->DirtyFirstCodepointIndex, FirstCodepointIndex);
+        Editor->DirtyOnePastLastCodepointIndex = MAXIMUM(DirtyOnePastLast, OnePastLastAfter);
+        Editor->DirtyCodepointDelta += Delta;
+    }
+    else
+    {
+        Editor->DirtyFirstCodepointIndex = FirstCodepointIndex;
+        Editor->DirtyOnePastLastCodepointIndex = OnePastLastAfter;
+        Editor->DirtyCodepointDelta = Delta;
+        Editor->Flags |= EDITOR_FLAG_TEXT_CHANGED;
+    }
+}
+
+// Replaces the shaped glyphs [FirstGlyphIndex, OnePastLastGlyphIndex) with NewGlyphs, and the shaped runs
+// [FirstRunIndex, OnePastLastRunIndex) with NewRuns, whose glyph indices are relative to NewGlyphs.
+// Everything after the splice is moved by CodepointDelta.
+static int SpliceShapedText(editor *Editor, int FirstGlyphIndex, int OnePastLastGlyphIndex, layout_glyph *NewGlyphs, int NewGlyphCount,
+                            int FirstRunIndex, int OnePastLastRunIndex, shaped_run *NewRuns, int NewRunCount, int CodepointDelta)
+{
+    int GlyphDelta = NewGlyphCount - (OnePastLastGlyphIndex - FirstGlyphIndex);
+    int RunDelta = NewRunCount - (OnePastLastRunIndex - FirstRunIndex);
+    int Result = 0;
+
+    if(((Editor->ShapedGlyphCount + GlyphDelta) <= SHAPED_GLYPH_CAPACITY) &&
+       ((Editor->ShapedRunCount + RunDelta) <= SHAPED_RUN_CAPACITY))
+    {
+        // @Speed: This moves and renumbers everything after the edit. It is still a lot cheaper than shaping it.
+        layout_glyph *Glyphs = Editor->ShapedGlyphs;
+        memmove(Glyphs + OnePastLastGlyphIndex + GlyphDelta, Glyphs + OnePastLastGlyphIndex,
+                sizeof(layout_glyph) * (Editor->ShapedGlyphCount - OnePastLastGlyphIndex));
+        memcpy(Glyphs + FirstGlyphIndex, NewGlyphs, sizeof(layout_glyph) * NewGlyphCount);
+        Editor->ShapedGlyphCount += GlyphDelta;
+
+        for(int GlyphIndex = FirstGlyphIndex + NewGlyphCount;
+            GlyphIndex < Editor->ShapedGlyphCount;
+            ++GlyphIndex)
+        {
+            Glyphs[GlyphIndex].CodepointIndex += CodepointDelta;
+        }
+
+        shaped_run *Runs = Editor->ShapedRuns;
+        memmove(Runs + OnePastLastRunIndex + RunDelta, Runs + OnePastLastRunIndex,
+                sizeof(shaped_run) * (Editor->ShapedRunCount - OnePastLastRunIndex));
+        Editor->ShapedRunCount += RunDelta;
+
+        for(int RunIndex = 0;
+            RunIndex < NewRunCount;
+            ++RunIndex)
+        {
+            shaped_run *Run = &Runs[FirstRunIndex + RunIndex];
+            *Run = NewRuns[RunIndex];
+            Run->FirstGlyphIndex += FirstGlyphIndex;
+            Run->OnePastLastGlyphIndex += FirstGlyphIndex;
+        }
+
+        for(int RunIndex = FirstRunIndex + NewRunCount;
+            RunIndex < Editor->ShapedRunCount;
+            ++RunIndex)
+        {
+            shaped_run *Run = &Runs[RunIndex];
+            Run->FirstGlyphIndex += GlyphDelta;
+            Run->OnePastLastGlyphIndex += GlyphDelta;
+            Run->FirstCodepointIndex += CodepointDelta;
+        }
+
+        ComputeParagraphAdvances(Editor, FirstRunIndex, FirstRunIndex + MAXIMUM(NewRunCount, 1));
+
+        Result = 1;
+    }
+
+    return Result;
+}
+
+// Returns the index of the last run that starts at or before CodepointIndex.
+static int FindShapedRun(editor *Editor, int CodepointIndex)
+{
+    int Min = 0;
+    int Max = Editor->ShapedRunCount;
+
+    while((Max - Min) > 1)
+    {
+        int Mid = Min + (Max - Min) / 2;
+
+        if(Editor->ShapedRuns[Mid].FirstCodepointIndex <= CodepointIndex)
+        {
+            Min = Mid;
+        }
+        else
+        {
+            Max = Mid;
+        }
+    }
+
+    return Min;
+}
+
+// Shaping can be restarted in between glyphs that do not interact with each other.
+// kbts marks glyphs that are attached to a previous glyph with NO_BREAK. On top of that, we only
+// cut at word boundaries, since joining and kerning rarely cross them, and at line break opportunities,
+// since line breaking can look arbitrarily far back otherwise (e.g. quotation marks followed by spaces).
+static int IsShapeBoundary(layout_glyph *Prev, layout_glyph *Glyph)
+{
+    kbts_break_flags BoundaryFlags = KBTS_BREAK_FLAG_WORD | KBTS_BREAK_FLAG_LINE_SOFT;
+    int Result = !Prev->NoShapeBreak && !Glyph->NoShapeBreak &&
+                 (Prev->CodepointIndex != Glyph->CodepointIndex) &&
+                 ((Glyph->BreakFlags & BoundaryFlags) == BoundaryFlags);
+    return Result;
+}
 
+static int ShapedGlyphsMatch(layout_glyph *A, layout_glyph *B, int CodepointDelta)
+{
+    int Result = (A->Font == B->Font) &&
+                 (A->Id == B->Id) &&
+                 ((A->CodepointIndex + CodepointDelta) == B->CodepointIndex) &&
+                 (A->Direction == B->Direction) &&
+                 (A->AdvanceX == B->AdvanceX) &&
+                 (A->AdvanceY == B->AdvanceY) &&
+                 (A->OffsetX == B->OffsetX) &&
+                 (A->OffsetY == B->OffsetY) &&
+                 (A->BreakFlags == B->BreakFlags) &&
+                 (A->NoShapeBreak == B->NoShapeBreak) &&
+                 (A->IsNewline == B->IsNewline);
     return Result;
 }
 
-static void AppendLayoutGlyph(editor *Editor, draw_command_list *DrawList, kbts_run *Run, layout_glyph *LayoutGlyph)
+// Try to reshape a couple of words around the dirty range, without leaving the run that contains it.
+// Shaping is done with one extra word on each side. If those come out exactly as they did in context,
+// the edit did not reach them, and we splice in what is in between.
+static int ReshapeWithinRun(editor *Editor)
 {
-    edit_line *Line = GetCurrentLine(Editor);
-    if(!Line->Direction)
-    {
-        Line->Direction = Run->ParagraphDirection;
-        Line->ActualAlignment = (Run->ParagraphDirection == KBTS_DIRECTION_RTL) ? TEXT_ALIGNMENT_RIGHT : TEXT_ALIGNMENT_LEFT;
-    }
-
-    float OriginalAdvance = Editor->RunningAdvance;
-    float LineTotalAdvance = OriginalAdvance + (float)LayoutGlyph->AdvanceX * LayoutGlyph->Scale;
-    layout_glyph *LineGlyphs = Editor->LineGlyphs;
-    int LineGlyphCount = Editor->LineGlyphCount;
+    int DirtyFirst = Editor->DirtyFirstCodepointIndex;
+    int DirtyOnePastLast = Editor->DirtyOnePastLastCodepointIndex;
+    int Delta = Editor->DirtyCodepointDelta;
+    int OldTextLength = Editor->TextLength - Delta;
+    int Result = 0;
 
-    if((Editor->Flags & EDITOR_FLAG_WRAP_LINES) &&
-       (LineTotalAdvance > (float)Editor->FrameBufferWidth))
+    int RunIndex = FindShapedRun(Editor, DirtyFirst);
+    shaped_run *Run = &Editor->ShapedRuns[RunIndex];
+    int RunFirstCodepointIndex = Run->FirstCodepointIndex;
+    int RunOnePastLastCodepointIndex = ((RunIndex + 1) < Editor->ShapedRunCount) ? Editor->ShapedRuns[RunIndex + 1].FirstCodepointIndex : (OldTextLength + 1);
+    layout_glyph *Glyphs = Editor->ShapedGlyphs;
+    int RunFirstGlyphIndex = Run->FirstGlyphIndex;
+    int RunOnePastLastGlyphIndex = Run->OnePastLastGlyphIndex;
+
+    // There has to be at least one codepoint on each side of the edit that was shaped before.
+    if((RunFirstCodepointIndex < DirtyFirst) &&
+       ((DirtyOnePastLast - Delta) < RunOnePastLastCodepointIndex) &&
+       (RunFirstGlyphIndex < RunOnePastLastGlyphIndex))
     {
-        int BreakIndex = 0;
-        float AdvanceAtBreak = 0;
-
-        if(Editor->LastSoftLineBreakLineGlyphIndexPlusOne &&
-           (Editor->AdvanceAtSoftLineBreak > 0.001f)) // @Float
+        int EditGlyphIndex = RunFirstGlyphIndex;
+        while((EditGlyphIndex < RunOnePastLastGlyphIndex) && (Glyphs[EditGlyphIndex].CodepointIndex < DirtyFirst))
         {
-            BreakIndex = Editor->LastSoftLineBreakLineGlyphIndexPlusOne - 1;
-            AdvanceAtBreak = Editor->AdvanceAtSoftLineBreak;
+            EditGlyphIndex += 1;
         }
-        else
-        {
-            // No line breaks are available. Use a shape break instead.
-            assert(Editor->LastShapeBreakLineGlyphIndexPlusOne);
 
-            BreakIndex = Editor->LastShapeBreakLineGlyphIndexPlusOne - 1;
-            AdvanceAtBreak = Editor->AdvanceAtShapeBreak;
+        int AfterEditGlyphIndex = EditGlyphIndex;
+        while((AfterEditGlyphIndex < RunOnePastLastGlyphIndex) && (Glyphs[AfterEditGlyphIndex].CodepointIndex < (DirtyOnePastLast - Delta)))
+        {
+            AfterEditGlyphIndex += 1;
         }
 
-        Editor->LineGlyphCount = BreakIndex;
-        DisplayLine(Editor, DrawList);
-
-        edit_line *NewLine = GetCurrentLine(Editor);
-        NewLine->Direction = Line->Direction;
-        NewLine->ActualAlignment = Line->ActualAlignment;
-
-        memmove(LineGlyphs, LineGlyphs + BreakIndex, sizeof(layout_glyph) * (LineGlyphCount - BreakIndex));
+        // Boundaries[0] and [3] are where we start and stop shaping. [1] and [2] are where we start and stop splicing.
+        // When we hit the edges of the run, there is no need to check anything there.
+        int Boundaries[4];
+        Boundaries[0] = Boundaries[1] = RunFirstGlyphIndex;
+        Boundaries[2] = Boundaries[3] = RunOnePastLastGlyphIndex;
 
+        int LeftFound = 0;
+        for(int GlyphIndex = EditGlyphIndex - 1;
+            (GlyphIndex > RunFirstGlyphIndex) && (LeftFound < 2);
+            --GlyphIndex)
         {
-            int NewSoftLineBreakIndexPlusOne = Editor->LastSoftLineBreakLineGlyphIndexPlusOne - BreakIndex;
-            int NewSoftLineBreakCodepointIndex = INT_MIN;
-            
-            if(NewSoftLineBreakIndexPlusOne > 0)
+            if(IsShapeBoundary(&Glyphs[GlyphIndex - 1], &Glyphs[GlyphIndex]))
             {
-                NewSoftLineBreakCodepointIndex = Editor->LineGlyphs[NewSoftLineBreakIndexPlusOne - 1].CodepointIndex;
+                Boundaries[1 - LeftFound++] = GlyphIndex;
             }
-            else
+        }
+
+        int RightFound = 0;
+        for(int GlyphIndex = AfterEditGlyphIndex + 1;
+            (GlyphIndex < RunOnePastLastGlyphIndex) && (RightFound < 2);
+            ++GlyphIndex)
+        {
+            if(IsShapeBoundary(&Glyphs[GlyphIndex - 1], &Glyphs[GlyphIndex]))
             {
-                NewSoftLineBreakIndexPlusOne = 0;
+                Boundaries[2 + RightFound++] = GlyphIndex;
             }
+        }
+
+        // Without a whole word on a side to check against, we can only stop at a paragraph boundary, since shaping
+        // and segmentation never look past those.
+        int LeftIsSafe = (LeftFound == 2) || Run->StartsParagraph || !RunIndex;
+        int RightIsSafe = (RightFound == 2) || Glyphs[RunOnePastLastGlyphIndex - 1].IsNewline;
+
+        int FirstCodepointIndex = (Boundaries[0] == RunFirstGlyphIndex) ? RunFirstCodepointIndex : Glyphs[Boundaries[0]].CodepointIndex;
+        int OnePastLastOldCodepointIndex = (Boundaries[3] == RunOnePastLastGlyphIndex) ? RunOnePastLastCodepointIndex : Glyphs[Boundaries[3]].CodepointIndex;
+        int SpliceFirstCodepointIndex = (Boundaries[1] == RunFirstGlyphIndex) ? RunFirstCodepointIndex : Glyphs[Boundaries[1]].CodepointIndex;
+        int SpliceOnePastLastOldCodepointIndex = (Boundaries[2] == RunOnePastLastGlyphIndex) ? RunOnePastLastCodepointIndex : Glyphs[Boundaries[2]].CodepointIndex;
+
+        // Glyphs can be reordered inside of a cluster, so make sure that each range of glyphs maps to its range of codepoints.
+        int Contiguous = LeftIsSafe && RightIsSafe &&
+                         (FirstCodepointIndex < DirtyFirst) && ((DirtyOnePastLast - Delta) < OnePastLastOldCodepointIndex);
+        for(int GlyphIndex = RunFirstGlyphIndex;
+            Contiguous && (GlyphIndex < RunOnePastLastGlyphIndex);
+            ++GlyphIndex)
+        {
+            int CodepointIndex = Glyphs[GlyphIndex].CodepointIndex;
 
-            Editor->LastSoftLineBreakLineGlyphIndexPlusOne = NewSoftLineBreakIndexPlusOne;
-            Editor->LastSoftLineBreakCodepointIndex = NewSoftLineBreakCodepointIndex;
-            Editor->AdvanceAtSoftLineBreak -= AdvanceAtBreak;
+            Contiguous = ((GlyphIndex >= Boundaries[0]) == (CodepointIndex >= FirstCodepointIndex)) &&
+                         ((GlyphIndex >= Boundaries[1]) == (CodepointIndex >= SpliceFirstCodepointIndex)) &&
+                         ((GlyphIndex >= Boundaries[2]) == (CodepointIndex >= SpliceOnePastLastOldCodepointIndex)) &&
+                         ((GlyphIndex >= Boundaries[3]) == (CodepointIndex >= OnePastLastOldCodepointIndex));
         }
 
+        if(Contiguous)
         {
-            int NewShapeBreakIndexPlusOne = Editor->LastShapeBreakLineGlyphIndexPlusOne - BreakIndex;
-            int NewShapeBreakCodepointIndex = INT_MIN;
-            
-            if(NewShapeBreakIndexPlusOne > 0)
+            arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
+
+            int OnePastLastCodepointIndex = OnePastLastOldCodepointIndex + Delta;
+            int SpanCodepointCount = OnePastLastCodepointIndex - FirstCodepointIndex;
+
+            shaped_span Span = ZERO;
+            Span.GlyphCapacity = 2 * SpanCodepointCount + 16; // @Hardcoded: Same ratio as SHAPED_GLYPH_CAPACITY.
+            Span.Glyphs = PushArray(&Editor->Arena, layout_glyph, Span.GlyphCapacity, 1);
+
+            int LeftCount = Boundaries[1] - Boundaries[0];
+            int RightCount = Boundaries[3] - Boundaries[2];
+            int Match = Span.Glyphs &&
+                        ShapeWithinRun(Editor, Run, &Span, FirstCodepointIndex, OnePastLastCodepointIndex) &&
+                        (Span.GlyphCount < Span.GlyphCapacity) &&
+                        (Span.GlyphCount >= (LeftCount + RightCount));
+
+            for(int GlyphIndex = 0;
+                Match && (GlyphIndex < LeftCount);
+                ++GlyphIndex)
             {
-                NewShapeBreakCodepointIndex = Editor->LineGlyphs[NewShapeBreakIndexPlusOne - 1].CodepointIndex;
+                Match = ShapedGlyphsMatch(&Glyphs[Boundaries[0] + GlyphIndex], &Span.Glyphs[GlyphIndex], 0);
             }
-            else
+
+            for(int GlyphIndex = 0;
+                Match && (GlyphIndex < RightCount);
+                ++GlyphIndex)
             {
-                NewShapeBreakIndexPlusOne = 0;
+                Match = ShapedGlyphsMatch(&Glyphs[Boundaries[2] + GlyphIndex], &Span.Glyphs[Span.GlyphCount - RightCount + GlyphIndex], Delta);
             }
 
-            Editor->LastShapeBreakLineGlyphIndexPlusOne = NewShapeBreakIndexPlusOne;
-            Editor->LastShapeBreakCodepointIndex = NewShapeBreakCodepointIndex;
-            Editor->AdvanceAtShapeBreak -= AdvanceAtBreak;
-        }
+            if(Match)
+            {
+                layout_glyph *NewGlyphs = Span.Glyphs + LeftCount;
+                int NewGlyphCount = Span.GlyphCount - LeftCount - RightCount;
+
+                shaped_run NewRun = *Run;
+                NewRun.FirstGlyphIndex -= Boundaries[1];
+                NewRun.OnePastLastGlyphIndex += NewGlyphCount - (Boundaries[2] - Boundaries[1]) - Boundaries[1];
+
+                Result = SpliceShapedText(Editor, Boundaries[1], Boundaries[2], NewGlyphs, NewGlyphCount,
+                                          RunIndex, RunIndex + 1, &NewRun, 1, Delta);
+            }
 
-        LineGlyphCount -= BreakIndex;
-        LineTotalAdvance -= AdvanceAtBreak;
-        OriginalAdvance -= AdvanceAtBreak;
+            ArenaEndLifetime(&Lifetime);
+        }
     }
 
-    if(LineGlyphCount < Editor->LineGlyphCapacity)
+    return Result;
+}
+
+// Reshape every paragraph that the dirty range touches. Paragraphs are shaped independently of each other,
+// so this always gives the same result as shaping the whole text.
+static int ReshapeParagraphs(editor *Editor)
+{
+    int DirtyFirst = Editor->DirtyFirstCodepointIndex;
+    int DirtyOnePastLast = Editor->DirtyOnePastLastCodepointIndex;
+    int Delta = Editor->DirtyCodepointDelta;
+    int Result = 0;
+
+    // The paragraph after the dirty range is included when the range ends right at its start, because the edit
+    // might have removed the newline between them.
+    int FirstCodepointIndex = FindParagraphStart(Editor, MINIMUM(DirtyFirst, Editor->TextLength));
+    int OnePastLastCodepointIndex = FindParagraphEnd(Editor, MAXIMUM(DirtyOnePastLast, FirstCodepointIndex));
+
+    int OnePastLastOldCodepointIndex = OnePastLastCodepointIndex - Delta;
+    int FirstRunIndex = FindShapedRun(Editor, FirstCodepointIndex);
+    int OnePastLastRunIndex = (OnePastLastCodepointIndex > Editor->TextLength) ? Editor->ShapedRunCount : FindShapedRun(Editor, OnePastLastOldCodepointIndex);
+
+    if((Editor->ShapedRuns[FirstRunIndex].FirstCodepointIndex == FirstCodepointIndex) &&
+       ((OnePastLastRunIndex == Editor->ShapedRunCount) || (Editor->ShapedRuns[OnePastLastRunIndex].FirstCodepointIndex == OnePastLastOldCodepointIndex)) &&
+       (FirstRunIndex < OnePastLastRunIndex))
     {
-        if(!LayoutGlyph->NoShapeBreak)
+        arena_lifetime Lifetime = ArenaBeginLifetime(&Editor->Arena);
+
+        int SpanCodepointCount = OnePastLastCodepointIndex - FirstCodepointIndex;
+
+        shaped_span Span = ZERO;
+        Span.GlyphCapacity = 2 * SpanCodepointCount + 16; // @Hardcoded: Same ratio as SHAPED_GLYPH_CAPACITY.
+        Span.Glyphs = PushArray(&Editor->Arena, layout_glyph, Span.GlyphCapacity, 1);
+        Span.RunCapacity = SpanCodepointCount + 1;
+        Span.Runs = PushArray(&Editor->Arena, shaped_run, Span.RunCapacity, 1);
+
+        // When the arena cannot hold the span, UpdateShapedText falls back to ShapeText, which does not need it.
+        if(Span.Glyphs && Span.Runs)
         {
-            if((!Editor->LastSoftLineBreakLineGlyphIndexPlusOne ||
-                (LayoutGlyph->CodepointIndex != Editor->LastSoftLineBreakCodepointIndex)) &&
-               (LayoutGlyph->BreakFlags & KBTS_BREAK_FLAG_LINE_SOFT))
-            {
-                Editor->LastSoftLineBreakLineGlyphIndexPlusOne = LineGlyphCount + 1;
-                Editor->LastSoftLineBreakCodepointIndex = LayoutGlyph->CodepointIndex;
-                Editor->AdvanceAtSoftLineBreak = OriginalAdvance;
-            }
+            ShapeParagraphs(Editor, &Span, FirstCodepointIndex, OnePastLastCodepointIndex);
 
-            if((!Editor->LastShapeBreakLineGlyphIndexPlusOne ||
-                (LayoutGlyph->CodepointIndex != Editor->LastShapeBreakCodepointIndex)))
-            {
-                Editor->LastShapeBreakLineGlyphIndexPlusOne = LineGlyphCount + 1;
-                Editor->LastShapeBreakCodepointIndex = LayoutGlyph->CodepointIndex;
-                Editor->AdvanceAtShapeBreak = OriginalAdvance;
-            }
+            Result = SpliceShapedText(Editor, Editor->ShapedRuns[FirstRunIndex].FirstGlyphIndex,
+                                      (OnePastLastRunIndex < Editor->ShapedRunCount) ? Editor->ShapedRuns[OnePastLastRunIndex].FirstGlyphIndex : Editor->ShapedGlyphCount,
+                                      Span.Glyphs, Span.GlyphCount, FirstRunIndex, OnePastLastRunIndex, Span.Runs, Span.RunCount, Delta);
         }
 
-        LineGlyphs[LineGlyphCount++] = *LayoutGlyph;
-
-        Editor->RunningAdvance = LineTotalAdvance;
+        ArenaEndLifetime(&Lifetime);
     }
 
-    Editor->LineGlyphCount = LineGlyphCount;
+    return Result;
 }
 
-static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBufferWidth, int FrameBufferHeight)
+// Brings Editor->ShapedGlyphs up to date with the text, reshaping as little of it as we can get away with.
+static void UpdateShapedText(editor *Editor)
 {
-    if(!Editor->KbtsContext)
+    if(Editor->Flags & EDITOR_FLAG_TEXT_CHANGED)
     {
-        size_t UndoMemorySize = 8 * 1024ull * 1024ull;
-        Editor->UndoAllocator = RingAllocatorInit(PushSize(&Editor->Arena, UndoMemorySize, 1), UndoMemorySize);
-        Editor->UndoSentinel.Prev = Editor->UndoSentinel.Next = &Editor->UndoSentinel;
+        int Done = 0;
+
+        // The whole text being dirty (e.g. after an undo) is the same as not having anything shaped.
+        if(Editor->ShapedRunCount &&
+           ((Editor->DirtyOnePastLastCodepointIndex - Editor->DirtyFirstCodepointIndex) <= Editor->TextLength))
+        {
+            Done = ReshapeWithinRun(Editor) || ReshapeParagraphs(Editor);
+        }
+
+        if(!Done)
+        {
+            ShapeText(Editor);
+        }
+
+        Editor->Flags &= ~EDITOR_FLAG_TEXT_CHANGED;
+    }
+}
+
+// Can be called before the first Draw, so that the platform layer picks when to pay for it. Otherwise, Draw does it.
+static void InitFonts(editor *Editor)
+{
+    if(!Editor->FontArena.Base)
+    {
+        Editor->FontArena = SubArena(&Editor->Arena, FONT_MEMORY_SIZE);
 
-        PushFont(Editor, "NotoSans-Regular.ttf");           // Latin Greek Cyrillic
-        PushFont(Editor, "NotoSansHebrew-Regular.ttf");     // Latin                               Hebrew (+ maybe something else?)
-        PushFont(Editor, "NotoSansMyanmar-Regular.ttf");    // Latin                       Myanmar
-        PushFont(Editor, "NotoSansArabic-Regular.ttf");     // Latin       Cyrillic Arabic
-        PushFont(Editor, "NotoSans-Italic.ttf");            // Latin Greek Cyrillic
-        PushFont(Editor, "NotoSans-Bold.ttf");              // Latin Greek Cyrillic
-        PushFont(Editor, "NotoSans-BoldItalic.ttf");        // Latin Greek Cyrillic
+        const char *FontPaths[] =
+        {
+            "NotoSans-Regular.ttf",         // Latin Greek Cyrillic
+            "NotoSansHebrew-Regular.ttf",   // Latin                               Hebrew (+ maybe something else?)
+            "NotoSansMyanmar-Regular.ttf",  // Latin                       Myanmar
+            "NotoSansArabic-Regular.ttf",   // Latin       Cyrillic Arabic
+            "NotoSans-Italic.ttf",          // Latin Greek Cyrillic
+            "NotoSans-Bold.ttf",            // Latin Greek Cyrillic
+            "NotoSans-BoldItalic.ttf",      // Latin Greek Cyrillic
+        };
+        LoadFonts(Editor, FontPaths, (int)(sizeof(FontPaths) / sizeof(FontPaths[0])));
 
         int8_t FontPreference[TEXT_STYLE_COUNT][MAX_FONT_COUNT];
 
@@ -1088,15 +3787,14 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
             FontIndex < Editor->FontCount;
             ++FontIndex)
         {
-            kbts_font_info Info;
-            kbts_GetFontInfo(&Editor->Fonts[FontIndex].Kbts, &Info);
+            kbts_font_style_flags StyleFlags = Editor->Fonts[FontIndex].StyleFlags;
 
             int RegularPreference = 0;
             int ItalicPreference = 0;
             int BoldPreference = 0;
             int BoldItalicPreference = 0;
 
-            if(Info.StyleFlags & KBTS_FONT_STYLE_FLAG_ITALIC)
+            if(StyleFlags & KBTS_FONT_STYLE_FLAG_ITALIC)
             {
                 RegularPreference -= 1;
                 ItalicPreference += 1;
@@ -1104,7 +3802,7 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
                 BoldItalicPreference += 1;
             }
 
-            if(Info.StyleFlags & KBTS_FONT_STYLE_FLAG_BOLD)
+            if(StyleFlags & KBTS_FONT_STYLE_FLAG_BOLD)
             {
                 RegularPreference -= 1;
                 ItalicPreference -= 1;
@@ -1153,18 +3851,223 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
                 }
             }
         }
+    }
+}
+
+// Moves the commands in [FirstCommandIndex, OnePastLastCommandIndex) to screen coordinates, and appends the ones
+// that overlap the viewport to VisibleCommandIndices, VisibleX and VisibleY. This is BoxOverlap against the viewport, for glyphs that have a width.
+// @Incomplete: We need to handle cases where the newline is on the left/in the middle of the line, to hide newlines.
+static void OffsetAndCullCommands(draw_command_list *DrawList, int FirstCommandIndex, int OnePastLastCommandIndex,
+                                  float OffsetX, float OffsetY, float ViewportWidth, float ViewportHeight)
+{
+    float *CommandX = DrawList->CommandX;
+    float *CommandY = DrawList->CommandY;
+    float *CommandWidth = DrawList->CommandWidth;
+    float *CommandHeight = DrawList->CommandHeight;
+    int *VisibleCommandIndices = DrawList->VisibleCommandIndices;
+    float *VisibleX = DrawList->VisibleX;
+    float *VisibleY = DrawList->VisibleY;
+    size_t VisibleCount = DrawList->VisibleCount;
+    int CommandIndex = FirstCommandIndex;
+
+#if HAS_SSE2
+    __m128 OffsetX4 = _mm_set1_ps(OffsetX);
+    __m128 OffsetY4 = _mm_set1_ps(OffsetY);
+    __m128 ViewportWidth4 = _mm_set1_ps(ViewportWidth);
+    __m128 ViewportHeight4 = _mm_set1_ps(ViewportHeight);
+    __m128 Zero4 = _mm_setzero_ps();
+
+    for(;
+        (CommandIndex + 4) <= OnePastLastCommandIndex;
+        CommandIndex += 4)
+    {
+        __m128 X = _mm_add_ps(_mm_loadu_ps(CommandX + CommandIndex), OffsetX4);
+        __m128 Y = _mm_add_ps(_mm_loadu_ps(CommandY + CommandIndex), OffsetY4);
+        __m128 Width = _mm_loadu_ps(CommandWidth + CommandIndex);
+        __m128 Height = _mm_loadu_ps(CommandHeight + CommandIndex);
+
+        float LaneX[4], LaneY[4];
+        _mm_storeu_ps(LaneX, X);
+        _mm_storeu_ps(LaneY, Y);
+
+        __m128 Visible = _mm_cmpgt_ps(Width, Zero4);
+        Visible = _mm_and_ps(Visible, _mm_cmpge_ps(_mm_add_ps(X, Width), Zero4));
+        Visible = _mm_and_ps(Visible, _mm_cmplt_ps(X, ViewportWidth4));
+        Visible = _mm_and_ps(Visible, _mm_cmpge_ps(_mm_add_ps(Y, Height), Zero4));
+        Visible = _mm_and_ps(Visible, _mm_cmplt_ps(Y, ViewportHeight4));
+        int VisibleMask = _mm_movemask_ps(Visible);
+
+        // Always write, only advance for visible commands. The visible lists have room for one extra entry for this.
+        for(int Lane = 0; Lane < 4; ++Lane)
+        {
+            VisibleCommandIndices[VisibleCount] = CommandIndex + Lane;
+            VisibleX[VisibleCount] = LaneX[Lane];
+            VisibleY[VisibleCount] = LaneY[Lane];
+            VisibleCount += (VisibleMask >> Lane) & 1;
+        }
+    }
+#endif
 
-        Editor->KbtsContext = kbts_CreateShapeContext(0, 0); // @Memory
+    for(;
+        CommandIndex < OnePastLastCommandIndex;
+        ++CommandIndex)
+    {
+        float X = CommandX[CommandIndex] + OffsetX;
+        float Y = CommandY[CommandIndex] + OffsetY;
+        float Width = CommandWidth[CommandIndex];
+        float Height = CommandHeight[CommandIndex];
 
-        for(int FontIndex = 0;
-            FontIndex < Editor->FontCount;
-            ++FontIndex)
+        if((Width > 0.0f) &&
+           BoxOverlap(X, Y, X + Width, Y + Height, 0, 0, ViewportWidth, ViewportHeight))
         {
-            font *Font = &Editor->Fonts[FontIndex];
+            VisibleCommandIndices[VisibleCount] = CommandIndex;
+            VisibleX[VisibleCount] = X;
+            VisibleY[VisibleCount] = Y;
+            VisibleCount += 1;
+        }
+    }
+
+    DrawList->VisibleCount = VisibleCount;
+}
+
+// Shapes what changed, then breaks the shaped text into lines and lays them out into Editor->Layout.
+static void LayoutText(editor *Editor, int FontPixelHeight, int FrameBufferWidth)
+{
+    draw_command_list Layout = ZERO;
+    // None of these are cleared: every element below Count is written before it is read.
+    Layout.Capacity = Editor->DrawCommandCapacity;
+    Layout.Commands = PushArray(&Editor->Arena, draw_command, Layout.Capacity, 1);
+    Layout.CommandX = PushArray(&Editor->Arena, float, Layout.Capacity, 1);
+    Layout.CommandY = PushArray(&Editor->Arena, float, Layout.Capacity, 1);
+    Layout.CommandWidth = PushArray(&Editor->Arena, float, Layout.Capacity, 1);
+    Layout.CommandHeight = PushArray(&Editor->Arena, float, Layout.Capacity, 1);
+    Layout.HitEdgesX = PushArray(&Editor->Arena, float, Layout.Capacity, 1);
+    Layout.SelectionsCapacity = Editor->SelectionCapacity;
+    Layout.Selections = PushArray(&Editor->Arena, draw_box, Layout.SelectionsCapacity, 1);
+    Layout.CaretsCapacity = Editor->CaretCapacity;
+    Layout.CaretsX = PushArray(&Editor->Arena, float, Layout.CaretsCapacity, 1);
+    Editor->LineGlyphs = PushArray(&Editor->Arena, layout_glyph, Editor->LineGlyphCapacity, 1);
+
+    UpdateShapedText(Editor);
+
+    Editor->LineCount = 0;
+    Editor->LineGlyphCount = 0;
+    Editor->CursorY = 0;
+
+    EditorBeginLines(Editor);
+    EditorBeginLine(Editor, &Layout);
+
+    font *CurrentFont = 0;
+    float Scale = 0;
+    int OutOfMemory = 0;
+
+    for(int FirstRunIndex = 0, OnePastLastRunIndex = 0;
+        (FirstRunIndex < Editor->ShapedRunCount) && !OutOfMemory;
+        FirstRunIndex = OnePastLastRunIndex)
+    {
+        shaped_run *FirstRun = &Editor->ShapedRuns[FirstRunIndex];
+        float MaxParagraphAdvance = FirstRun->MaxParagraphAdvance;
+
+        for(OnePastLastRunIndex = FirstRunIndex + 1;
+            (OnePastLastRunIndex < Editor->ShapedRunCount) && !Editor->ShapedRuns[OnePastLastRunIndex].StartsParagraph;
+            ++OnePastLastRunIndex)
+        {
+            MaxParagraphAdvance = MAXIMUM(MaxParagraphAdvance, Editor->ShapedRuns[OnePastLastRunIndex].MaxParagraphAdvance);
+        }
+
+        int FirstGlyphIndex = FirstRun->FirstGlyphIndex;
+        int OnePastLastGlyphIndex = Editor->ShapedRuns[OnePastLastRunIndex - 1].OnePastLastGlyphIndex;
+
+        // FindLineEnd scales every glyph on its own, so leave a pixel of room for rounding.
+        int MightWrap = (Editor->Flags & EDITOR_FLAG_WRAP_LINES) &&
+                        ((MaxParagraphAdvance * (float)FontPixelHeight + 1.0f) > (float)FrameBufferWidth);
+
+        for(int LineFirstGlyphIndex = FirstGlyphIndex, LineOnePastLastGlyphIndex = 0;
+            (LineFirstGlyphIndex < OnePastLastGlyphIndex) && !OutOfMemory;
+            LineFirstGlyphIndex = LineOnePastLastGlyphIndex)
+        {
+            LineOnePastLastGlyphIndex = MightWrap ? FindLineEnd(Editor, LineFirstGlyphIndex, OnePastLastGlyphIndex) : OnePastLastGlyphIndex;
+
+            DisplayLine(Editor, &Layout);
+
+            edit_line *Line = GetCurrentLine(Editor);
+            Line->Direction = FirstRun->ParagraphDirection;
+            Line->ActualAlignment = (Line->Direction == KBTS_DIRECTION_RTL) ? TEXT_ALIGNMENT_RIGHT : TEXT_ALIGNMENT_LEFT;
+
+            int LineGlyphCount = LineOnePastLastGlyphIndex - LineFirstGlyphIndex;
+            int FittingGlyphCount = ReserveLineLayout(Editor, &Layout, LineFirstGlyphIndex, LineOnePastLastGlyphIndex);
+            // Lay out what still fits and drop the rest of the text.
+            OutOfMemory = FittingGlyphCount < LineGlyphCount;
+
+            for(int GlyphIndex = LineFirstGlyphIndex;
+                GlyphIndex < LineFirstGlyphIndex + FittingGlyphCount;
+                ++GlyphIndex)
+            {
+                layout_glyph *LayoutGlyph = &Editor->LineGlyphs[Editor->LineGlyphCount++];
+                *LayoutGlyph = Editor->ShapedGlyphs[GlyphIndex];
+
+                if(LayoutGlyph->Font != CurrentFont)
+                {
+                    CurrentFont = LayoutGlyph->Font;
+                    Scale = stbtt_ScaleForPixelHeight(&CurrentFont->Stbtt, (float)FontPixelHeight);
+                }
+
+                LayoutGlyph->Scale = Scale;
+            }
+        }
+    }
+
+    EditorEndLines(Editor, &Layout);
+
+    Editor->Layout = Layout;
+}
+
+static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBufferWidth, int FrameBufferHeight)
+{
+    // A frame is everything from one Draw to the next, so that input handling counts towards the frame it leads to.
+    PoolBeginFrame(&Editor->ShaperAllocator);
+
+    if(!Editor->KbtsContext)
+    {
+        size_t UndoMemorySize = 8 * 1024ull * 1024ull;
+        Editor->UndoAllocator = RingAllocatorInit(PushSize(&Editor->Arena, UndoMemorySize, 1), UndoMemorySize);
+        Editor->UndoSentinel.Prev = Editor->UndoSentinel.Next = &Editor->UndoSentinel;
 
-            kbts_ShapePushFont(Editor->KbtsContext, &Font->Kbts);
+        InitFonts(Editor);
+
+        Editor->ShapeConfigs = PushArray(&Editor->Arena, shape_config_entry *, MAX_FONT_COUNT * KBTS_SCRIPT_COUNT, 0);
+        Editor->ShapeConfigArena = SubArena(&Editor->Arena, SHAPE_CONFIG_MEMORY_SIZE);
+
+        // The shaper gets its own region, since it allocates and frees on its own schedule.
+        size_t ShaperMemorySize = SHAPER_MEMORY_SIZE;
+        Editor->ShaperAllocator = PoolAllocatorInit(PushSize(&Editor->Arena, ShaperMemorySize, 1), ShaperMemorySize);
+        Editor->KbtsContext = kbts_PlaceShapeContext(PoolKbtsAllocator, &Editor->ShaperAllocator,
+                                                     PushSize(&Editor->Arena, (size_t)kbts_SizeOfShapeContext(), 0));
+        kbts_ShapeSetConfigProvider(Editor->KbtsContext, ProvideShapeConfig, Editor);
+        Editor->BreakCache = kbts_PlaceBreakCache(PushSize(&Editor->Arena, (size_t)kbts_SizeOfBreakCache(), 1));
+        kbts_ShapeSetBreakCache(Editor->KbtsContext, Editor->BreakCache);
+        Editor->DirectScratchpads = PushArray(&Editor->Arena, kbts_shape_scratchpad *, MAX_FONT_COUNT * KBTS_SCRIPT_COUNT, 0);
+        kbts_InitializeGlyphStorage(&Editor->DirectGlyphStorage, PoolKbtsAllocator, &Editor->ShaperAllocator);
+
+        for(int TextStyle = 0;
+            TextStyle < TEXT_STYLE_COUNT;
+            ++TextStyle)
+        {
+            Editor->FontCache[TextStyle] = PushArray(&Editor->Arena, int8_t, FONT_CACHE_CODEPOINT_COUNT, 0);
         }
 
+        // Common text (spaces, digits, punctuation) that has no strong script around it is shaped with no script.
+        Editor->ExpectedScripts[KBTS_SCRIPT_DONT_KNOW] = 1;
+
+        // Fonts that are already loaded have added the scripts they support. The others do it when they load.
+        // Configs do not depend on each other, so they are created in parallel.
+        ParallelFor(Editor->FontCount * KBTS_SCRIPT_COUNT, PrepareShapeConfigJob, Editor);
+
+#ifdef REFPAD_SELF_TEST
+        CheckWeakBidiClasses();
+        CheckSharedShapeConfigs(Editor);
+#endif
+
         // #TODO: Figure out a growth strategy.
         Editor->TextCapacity = TEXT_CAPACITY;
         Editor->TextLength = 0;
@@ -1175,24 +4078,54 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
         Editor->LineCount = 0;
         Editor->Lines = PushArray(&Editor->Arena, edit_line, Editor->LineCapacity, 0);
 
-        // @Hardcoded
+        // Starting sizes of the layout buffers, which grow as needed.
+        Editor->DrawCommandCapacity = 4096;
+        Editor->SelectionCapacity = 256;
+        Editor->CaretCapacity = 4096;
         Editor->LineGlyphCapacity = 1024;
-        Editor->LineGlyphCount = 0;
-        Editor->LineGlyphs = PushArray(&Editor->Arena, layout_glyph, Editor->LineGlyphCapacity, 0);
+
+        Editor->GlyphMetrics = PushArray(&Editor->Arena, glyph_metrics, GLYPH_METRICS_CAPACITY, 0);
+        Editor->GlyphMetricsCount = 0;
+
+        Editor->ShapedGlyphs = PushArray(&Editor->Arena, layout_glyph, SHAPED_GLYPH_CAPACITY, 1);
+        Editor->ShapedRuns = PushArray(&Editor->Arena, shaped_run, SHAPED_RUN_CAPACITY, 1);
+        InvalidateText(Editor, 0, 0, 1);
+    }
+
+    // The layout only depends on the shaped text, the font size, the wrap width, a couple of flags and the selection.
+    // When none of them changed, e.g. when we only scroll, the last one is reused, and all that is left to do
+    // is to offset and cull the lines that are in view.
+    int SelectionStart = GetSelectionStart(Editor);
+    int SelectionEnd = GetSelectionEnd(Editor);
+    if(SelectionStart == SelectionEnd)
+    {
+        // Nothing is selected, wherever the cursor is.
+        SelectionStart = SelectionEnd = 0;
     }
 
+    editor_flags LayoutFlags = EDITOR_FLAG_WRAP_LINES | EDITOR_FLAG_DISPLAY_NEWLINES;
+    int LayoutIsStale = !Editor->Layout.Commands ||
+                        (Editor->Flags & EDITOR_FLAG_TEXT_CHANGED) ||
+                        (Editor->LayoutFontPixelHeight != FontPixelHeight) ||
+                        ((Editor->Flags & EDITOR_FLAG_WRAP_LINES) && (Editor->LayoutFrameBufferWidth != FrameBufferWidth)) ||
+                        ((Editor->LayoutFlags ^ Editor->Flags) & LayoutFlags) ||
+                        (Editor->LayoutSelectionStart != SelectionStart) ||
+                        (Editor->LayoutSelectionEnd != SelectionEnd);
+
     if(Editor->FontPixelHeight != FontPixelHeight)
     {
         // Update global font metrics.
         int Ascent = 0;
         int Descent = INT_MAX; // Descents are negative :)
         int LineGap = 0;
+        // This goes through the summaries, so that line height does not change when fallback fonts get loaded.
         for(int FontIndex = 0; FontIndex < (int)Editor->FontCount; ++FontIndex) {
-            stbtt_fontinfo *StbttFont = &Editor->Fonts[FontIndex].Stbtt;
-            float Scale = stbtt_ScaleForPixelHeight(StbttFont, (float)FontPixelHeight);
+            font_summary *Summary = Editor->Fonts[FontIndex].Summary;
+            float Scale = (float)FontPixelHeight / (float)(Summary->Ascent - Summary->Descent); // Same as stbtt_ScaleForPixelHeight.
 
-            int FontAscent, FontDescent, FontLineGap;
-            stbtt_GetFontVMetrics(StbttFont, &FontAscent, &FontDescent, &FontLineGap);
+            int FontAscent = Summary->Ascent;
+            int FontDescent = Summary->Descent;
+            int FontLineGap = Summary->LineGap;
 
             FontAscent = (int)roundf((float)FontAscent * Scale);
             FontDescent = (int)roundf((float)FontDescent * Scale);
@@ -1212,131 +4145,41 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
     }
 
     ArenaEndLifetime(&Editor->FrameLifetime);
-    Editor->FrameLifetime = ArenaBeginLifetime(&Editor->Arena);
-
-    Editor->FrameBufferWidth = FrameBufferWidth;
-
-    draw_command_list Result = ZERO;
-    Result.Capacity = 4096; // @Hardcoded
-    Result.Commands = PushArray(&Editor->Arena, draw_command, Result.Capacity, 0);
-    Result.SelectionsCapacity = LINE_CAPACITY * 8; // @Hardcoded. Ultimately will be at most the number of runs in the current text.
-    Result.Selections = PushArray(&Editor->Arena, draw_box, Result.SelectionsCapacity, 0);
-
-    kbts_shape_context *Context = Editor->KbtsContext;
-
-    kbts_ShapeBegin(Context, KBTS_DIRECTION_DONT_KNOW, KBTS_LANGUAGE_DONT_KNOW);
-
-    text_style CurrentStyle = TEXT_STYLE_COUNT;
-    for (int I = 0; I < Editor->TextLength; ++I) {
-        character* Character = &Editor->Text[I];
-        text_style Style = Character->Style;
-
-        if (Style != CurrentStyle)
-        {
-            kbts_ShapeManualBreak(Context);
-
-            assert(Character->Style < TEXT_STYLE_COUNT);
-
-            // Reorder fonts to fit our preference order for this style.
-            while (kbts_ShapePopFont(Context));
-
-            for (int FontIndexIndex = 0; FontIndexIndex < Editor->FontCount; ++FontIndexIndex) {
-                int FontIndex = Editor->FontIndicesByPreference[Style][Editor->FontCount - 1 - FontIndexIndex];
-                kbts_ShapePushFont(Context, &Editor->Fonts[FontIndex].Kbts);
-            }
 
-            CurrentStyle = Style;
-        }
-
-        kbts_ShapeCodepoint(Context, Editor->Text[I].Codepoint);
+    if(LayoutIsStale)
+    {
+        ArenaEndLifetime(&Editor->LayoutLifetime);
+        Editor->LayoutLifetime = ArenaBeginLifetime(&Editor->Arena);
+        LayoutText(Editor, FontPixelHeight, FrameBufferWidth);
+
+        Editor->LayoutFontPixelHeight = FontPixelHeight;
+        Editor->LayoutFrameBufferWidth = FrameBufferWidth;
+        Editor->LayoutFlags = Editor->Flags;
+        Editor->LayoutSelectionStart = SelectionStart;
+        Editor->LayoutSelectionEnd = SelectionEnd;
     }
-    // Append the EOF.
-    kbts_ShapeCodepoint(Context, '\n');
-    kbts_ShapeEnd(Context);
-
-    Editor->LineCount = 0;
-    Editor->LineGlyphCount = 0;
-    Editor->CursorY = 0;
-    Editor->RunningAdvance = 0;
-    Editor->LastSoftLineBreakLineGlyphIndexPlusOne = 0;
-    Editor->LastShapeBreakLineGlyphIndexPlusOne = 0;
 
-    int RunIndex = 0;
+    Editor->FrameLifetime = ArenaBeginLifetime(&Editor->Arena);
 
-    EditorBeginLines(Editor);
-    EditorBeginLine(Editor, &Result);
+    Editor->FrameBufferWidth = FrameBufferWidth;
 
-    // @Hardcoded
-    int RtlReorderGlyphCapacity = 1024;
-    layout_glyph *RtlReorderGlyphs = PushArray(&Editor->Arena, layout_glyph, RtlReorderGlyphCapacity, 1);
+    // The layout stays as it is. What Draw returns shares its arrays, and gets its own visible lists.
+    draw_command_list Result = Editor->Layout;
 
-    kbts_run Run;
-    while(kbts_ShapeRun(Context, &Run))
     {
-        if(Run.Flags & KBTS_BREAK_FLAG_LINE_HARD)
-        {
-            DisplayLine(Editor, &Result);
-        }
-
-        font *Font = KbtsFontToFont(Run.Font);
-        float Scale = stbtt_ScaleForPixelHeight(&Font->Stbtt, (float)FontPixelHeight);
-
-        int RtlReorderGlyphCount = 0;
-
-        kbts_glyph *RunGlyph;
-        while(kbts_GlyphIteratorNext(&Run.Glyphs, &RunGlyph))
-        {
-            int CodepointIndex = RunGlyph->UserIdOrCodepointIndex;
-            kbts_shape_codepoint ShapeCodepoint = ZERO;
-            kbts_ShapeGetShapeCodepoint(Context, CodepointIndex, &ShapeCodepoint);
+        float CursorX;
+        int CursorLineIndex = LocateCodepoint(Editor, &Result, Editor->CursorPosition.CodepointIndex, &CursorX);
 
-            character *SourceCharacter = &Editor->Text[CodepointIndex];
-            SourceCharacter->BreakFlags = ShapeCodepoint.BreakFlags;
-
-            layout_glyph LayoutGlyph = ZERO;
-            LayoutGlyph.Font = KbtsFontToFont(Run.Font);
-            LayoutGlyph.Id = RunGlyph->Id;
-            LayoutGlyph.CodepointIndex = RunGlyph->UserIdOrCodepointIndex;
-            LayoutGlyph.Direction = Run.Direction;
-            LayoutGlyph.AdvanceX = RunGlyph->AdvanceX;
-            LayoutGlyph.AdvanceY = RunGlyph->AdvanceY;
-            LayoutGlyph.OffsetX = RunGlyph->OffsetX;
-            LayoutGlyph.OffsetY = RunGlyph->OffsetY;
-            LayoutGlyph.Scale = Scale;
-            LayoutGlyph.BreakFlags = ShapeCodepoint.BreakFlags;
-            LayoutGlyph.NoShapeBreak = (RunGlyph->Flags & KBTS_GLYPH_FLAG_NO_BREAK) != 0;
-            LayoutGlyph.IsNewline = (ShapeCodepoint.Codepoint == '\n');
-
-            if(Run.Direction == KBTS_DIRECTION_RTL)
-            {
-                if(RtlReorderGlyphCount < RtlReorderGlyphCapacity)
-                {
-                    RtlReorderGlyphs[RtlReorderGlyphCount++] = LayoutGlyph;
-                }
-            }
-            else
-            {
-                AppendLayoutGlyph(Editor, &Result, &Run, &LayoutGlyph);
-            }
-        }
+        Result.Cursor.X = CursorX;
+        Result.Cursor.Y = Editor->Lines[CursorLineIndex].MinY;
 
-        if(Run.Direction == KBTS_DIRECTION_RTL)
+        if(!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_X))
         {
-            // Reorder RTL runs to logical order, because line breaking is simpler to do in logical order.
-            for(int GlyphIndex = 0;
-                GlyphIndex < RtlReorderGlyphCount;
-                ++GlyphIndex)
-            {
-                AppendLayoutGlyph(Editor, &Result, &Run, &RtlReorderGlyphs[RtlReorderGlyphCount - 1 - GlyphIndex]);
-            }
-
+            Editor->CursorPosition.DesiredX = CursorX;
+            Editor->CursorPosition.LineIndex = CursorLineIndex;
         }
-
-        RunIndex += 1;
     }
 
-    EditorEndLines(Editor, &Result);
-
     float TextWidth = Editor->TextBounds.MaxX - Editor->TextBounds.MinX;
     float ScrollAreaHeight;
     float ViewportWidth = (float)FrameBufferWidth;
@@ -1412,86 +4255,86 @@ static draw_command_list Draw(editor *Editor, int FontPixelHeight, int FrameBuff
         Result.ScrollMaxY = ClampFloat(ViewportMaxY / ScrollAreaHeight, 0, 1);
     }
 
-    int DrawSelectionsWritten = 0;
+    {
+        edit_line *CursorLine = &Editor->Lines[Editor->CursorPosition.LineIndex];
+        float LogicalOffsetX = AlignmentOffsetXForLine(CursorLine, TextWidth);
+
+        Result.Cursor.X += LogicalOffsetX - ViewportMinX;
+        Result.Cursor.Y -= ViewportMinY;
+
+        if(!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_X))
+        {
+            Editor->CursorPosition.DesiredX += LogicalOffsetX;
+        }
+    }
 
     // At this point, we know the dimensions of each line.
     // This is enough to do per-line layout, taking alignment into account.
-    for(int LineIndex = 0;
-        LineIndex < Editor->LineCount;
+    // Lines are sorted by Y, so we only go over the ones whose glyphs can reach into the viewport, and only
+    // make room for their commands and selections. The layout itself is left in line coordinates.
+    int FirstVisibleLineIndex = LineIndexAtY(Editor, ViewportMinY - Editor->MaxLineOverhangBelow);
+    int OnePastLastVisibleLineIndex = LineIndexAtY(Editor, ViewportMaxY + Editor->MaxLineOverhangAbove) + 1;
+    OnePastLastVisibleLineIndex = MINIMUM(OnePastLastVisibleLineIndex, Editor->LineCount);
+
+    size_t MaxVisibleCount = 0;
+    size_t MaxVisibleSelectionCount = 0;
+    if(FirstVisibleLineIndex < OnePastLastVisibleLineIndex)
+    {
+        edit_line *FirstLine = &Editor->Lines[FirstVisibleLineIndex];
+        edit_line *LastLine = &Editor->Lines[OnePastLastVisibleLineIndex - 1];
+        MaxVisibleCount = (size_t)(LastLine->OnePastLastCommandIndex - FirstLine->FirstCommandIndex);
+        MaxVisibleSelectionCount = (size_t)(LastLine->OnePastLastSelectionIndex - FirstLine->FirstSelectionIndex);
+    }
+
+    // One extra entry, see OffsetAndCullCommands.
+    Result.VisibleCommandIndices = PushArray(&Editor->Arena, int, MaxVisibleCount + 1, 1);
+    Result.VisibleX = PushArray(&Editor->Arena, float, MaxVisibleCount + 1, 1);
+    Result.VisibleY = PushArray(&Editor->Arena, float, MaxVisibleCount + 1, 1);
+    Result.VisibleCount = 0;
+    Result.Selections = PushArray(&Editor->Arena, draw_box, MaxVisibleSelectionCount, 1);
+    Result.SelectionsCount = 0;
+    Result.SelectionsCapacity = MaxVisibleSelectionCount;
+
+    if(!Result.VisibleCommandIndices || !Result.VisibleX || !Result.VisibleY || !Result.Selections)
+    {
+        // The layout took what was left of the arena, see ReserveLineLayout. Draw nothing rather than crash.
+        OnePastLastVisibleLineIndex = FirstVisibleLineIndex;
+    }
+
+    for(int LineIndex = FirstVisibleLineIndex;
+        LineIndex < OnePastLastVisibleLineIndex;
         ++LineIndex)
     {
         edit_line *Line = &Editor->Lines[LineIndex];
-        float LogicalOffsetX = AlignmentOffsetXForLine(Line, TextWidth);
-        float VisualOffsetX = -ViewportMinX + LogicalOffsetX;
+        float VisualOffsetX = AlignmentOffsetXForLine(Line, TextWidth) - ViewportMinX;
         float VisualOffsetY = -ViewportMinY;
         int FirstCommandIndex = Line->FirstCommandIndex;
         int OnePastLastCommandIndex = Line->OnePastLastCommandIndex;
         int FirstSelectionIndex = Line->FirstSelectionIndex;
         int OnePastLastSelectionIndex = Line->OnePastLastSelectionIndex;
 
-        Line->FirstSelectionIndex = DrawSelectionsWritten;
-
-        float LineMinX = Line->GlyphBox.MinX + VisualOffsetX;
-        float LineMinY = Line->GlyphBox.MinY + VisualOffsetY;
-        float LineMaxX = Line->GlyphBox.MaxX + VisualOffsetX;
-        float LineMaxY = Line->GlyphBox.MaxY + VisualOffsetY;
-
-        int LineVisible = BoxOverlap(LineMinX, LineMinY, LineMaxX, LineMaxY, 0, 0, ViewportWidth, ViewportHeight);
-
-        if(LineIndex == Editor->CursorPosition.LineIndex)
-        {
-            Result.Cursor.X += VisualOffsetX;
-            Result.Cursor.Y += VisualOffsetY;
-
-            if(!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_X))
-            {
-                Editor->CursorPosition.DesiredX += LogicalOffsetX;
-            }
-        }
-
-        for(int CommandIndex = FirstCommandIndex;
-            CommandIndex < OnePastLastCommandIndex;
-            ++CommandIndex)
-        {
-            draw_command *Command = &Result.Commands[CommandIndex];
-
-            Command->X += VisualOffsetX;
-            Command->Y += VisualOffsetY;
-
-            if(LineVisible &&
-               (Command->ScaledWidth > 0.0f) &&
-               // @Incomplete: We need to handle cases where the newline is on the left/in the middle of the line.
-               // !(Command->Flags & DRAW_COMMAND_FLAG_NEWLINE) && // Hide newlines.
-               BoxOverlap(Command->X, Command->Y, Command->X + Command->ScaledWidth, Command->Y + Command->ScaledHeight,
-                          0, 0, ViewportWidth, ViewportHeight))
-            {
-                Command->Flags |= DRAW_COMMAND_FLAG_VISIBLE;
-            }
-        }
+        OffsetAndCullCommands(&Result, FirstCommandIndex, OnePastLastCommandIndex,
+                              VisualOffsetX, Line->MinY + VisualOffsetY, ViewportWidth, ViewportHeight);
 
         for(int SelectionIndex = FirstSelectionIndex;
             SelectionIndex < OnePastLastSelectionIndex;
             ++SelectionIndex)
         {
-            draw_box *Selection = &Result.Selections[SelectionIndex];
-            Selection->MaxY = Line->GlyphBox.MaxY;
-            Selection->MinX += VisualOffsetX;
-            Selection->MinY += VisualOffsetY;
-            Selection->MaxX += VisualOffsetX;
-            Selection->MaxY += VisualOffsetY;
-
-            if(BoxOverlap(Selection->MinX, Selection->MinY, Selection->MaxX, Selection->MaxY,
+            draw_box Selection = Editor->Layout.Selections[SelectionIndex];
+            Selection.MaxY = Line->GlyphBox.MaxY;
+            Selection.MinX += VisualOffsetX;
+            Selection.MinY += VisualOffsetY;
+            Selection.MaxX += VisualOffsetX;
+            Selection.MaxY += VisualOffsetY;
+
+            if(BoxOverlap(Selection.MinX, Selection.MinY, Selection.MaxX, Selection.MaxY,
                           0, 0, ViewportWidth, ViewportHeight))
             {
-                Result.Selections[DrawSelectionsWritten++] = *Selection;
+                Result.Selections[Result.SelectionsCount++] = Selection;
             }
         }
-
-        Line->OnePastLastSelectionIndex = DrawSelectionsWritten;
     }
 
-    Result.SelectionsCount = DrawSelectionsWritten;
-
     // This copy of the draw list is used when processing editor commands
     // (see DoCommand).
     Editor->CurrentScrollX = ViewportMinX;
@@ -1520,6 +4363,7 @@ static void InsertCharacter(editor* Editor, character Char) {
         Editor->TextLength += 1;
         Editor->CursorPosition.CodepointIndex += 1;
         CarrySelection(Editor);
+        InvalidateText(Editor, Cursor, Cursor, Cursor + 1);
 
         Editor->Flags |= EDITOR_FLAG_MOVE_VIEWPOINT_TO_INCLUDE_CURSOR;
     }
@@ -1536,6 +4380,9 @@ static void ToggleSelectionStyle(editor* Editor, text_style Style) {
         character* Character = &Editor->Text[CodepointIndex];
         Character->Style ^= Style;
     }
+    if (GetSelectionEnd(Editor) > GetSelectionStart(Editor)) {
+        InvalidateText(Editor, GetSelectionStart(Editor), GetSelectionEnd(Editor), GetSelectionEnd(Editor));
+    }
 }
 
 static int UndoStateIsValid(editor *Editor, undo_state_header *Header)
@@ -1619,6 +4466,7 @@ static void DeleteCharacters(editor* Editor, int StartIdx, int EndIdx, int SkipU
         memmove(Editor->Text + StartIdx, Editor->Text + EndIdx, NumCharactersToMove * sizeof(character));
         Editor->TextLength -= NumToDelete;
         Editor->CursorPosition.CodepointIndex = StartIdx;
+        InvalidateText(Editor, StartIdx, EndIdx, StartIdx);
         Editor->Flags |= EDITOR_FLAG_MOVE_VIEWPOINT_TO_INCLUDE_CURSOR;
     }
 }
@@ -1715,24 +4563,31 @@ static int LineCodepointIndexAtX(editor* Editor, int LineIndex, float X) {
 
     if (LineIndex >= 0 && LineIndex < Editor->LineCount) {
         edit_line* Line = &Editor->Lines[LineIndex];
+        draw_command_list *DrawList = &Editor->DrawList;
+        float LineX = X - LineVisualOffsetX(Editor, Line);
 
         Result = Line->MinCodepointIndex;
-        draw_command *Command = 0;
-        int PrevCodepointIndex = ~0;
-        for (int LineCommandIndex = Line->FirstCommandIndex; LineCommandIndex < Line->OnePastLastCommandIndex; ++LineCommandIndex) {
-            Command = &Editor->DrawList.Commands[LineCommandIndex];
-            Result = Command->CodepointIndex;
-            // We try to round to the nearest cursor position, instead of simply snapping to the left side of the glyph.
-            if ((Command->CodepointIndex != PrevCodepointIndex) && ((Command->X + Command->ScaledWidth * 0.5f) > X)) {
-                break;
+
+        // We try to round to the nearest cursor position, instead of simply snapping to the left side of the glyph,
+        // so we look for the first glyph whose center is past X.
+        int Min = Line->FirstCommandIndex;
+        int Max = Line->OnePastLastCommandIndex;
+        while (Min < Max) {
+            int Mid = Min + (Max - Min) / 2;
+            if (DrawList->HitEdgesX[Mid] > LineX) {
+                Max = Mid;
+            } else {
+                Min = Mid + 1;
             }
-            PrevCodepointIndex = Command->CodepointIndex;
         }
 
-        if (Command) {
-            if ((Line->Direction == KBTS_DIRECTION_RTL) && (PrevCodepointIndex != ~0)) {
-                Result = PrevCodepointIndex;
-            }
+        // Past the end of the line, we stay on the last codepoint. In RTL, the glyph before the one we found is the
+        // one whose leading edge we are closest to.
+        if ((Min > Line->FirstCommandIndex) &&
+            ((Min == Line->OnePastLastCommandIndex) || (Line->Direction == KBTS_DIRECTION_RTL))) {
+            Result = DrawList->Commands[Min - 1].CodepointIndex;
+        } else if (Min < Line->OnePastLastCommandIndex) {
+            Result = DrawList->Commands[Min].CodepointIndex;
         }
     }
 
@@ -1871,6 +4726,7 @@ static void ApplyUndoState(editor *Editor, undo_state_header *Header)
     {
         undo_state *Undo = (undo_state *)Header;
 
+        InvalidateText(Editor, 0, Editor->TextLength + 1, Undo->TextLength + 1);
         memcpy(Editor->Text, Undo->Text, sizeof(*Undo->Text) * Undo->TextLength);
         Editor->TextLength = Undo->TextLength;
         Editor->TargetScrollX = Undo->TargetScrollX;
@@ -1905,7 +4761,7 @@ static void DoCommand(editor* Editor, editor_command Command) {
             float DesiredX = Editor->CursorPosition.DesiredX;
             // @Cleanup: We set DesiredX in FlushLine, we can probably do the same thing with DesiredY?
             if (!(Editor->Flags & EDITOR_FLAG_KEEP_DESIRED_Y)) {
-                DesiredY = Editor->Lines[Editor->CursorPosition.LineIndex].GlyphBox.MinY;
+                DesiredY = Editor->Lines[Editor->CursorPosition.LineIndex].MinY;
             }
 
             if (Command.Type == EDITOR_COMMAND_PAGEUP) {
@@ -1913,7 +4769,7 @@ static void DoCommand(editor* Editor, editor_command Command) {
             } else {
                 DesiredY += (float)Editor->FrameBufferHeight;
             }
-            if (DesiredY < Editor->Lines[0].GlyphBox.MinY) {
+            if (DesiredY < Editor->Lines[0].MinY) {
                 DesiredY = -INFINITY;
                 DesiredX = -INFINITY;
             } else if (DesiredY > (float)Editor->TotalHeightInPixels) {
@@ -1921,25 +4777,7 @@ static void DoCommand(editor* Editor, editor_command Command) {
                 DesiredX = INFINITY;
             }
 
-            int DesiredLine = 0;
-            int LineIndexIncrement = -1;
-            if (Command.Type == EDITOR_COMMAND_PAGEDOWN) {
-                DesiredLine = Editor->LineCount - 1;
-                LineIndexIncrement = 1;
-            }
-
-            for (int LineIndex = Editor->CursorPosition.LineIndex; (LineIndex >= 0) && (LineIndex < Editor->LineCount); LineIndex += LineIndexIncrement) {
-                edit_line *Line = &Editor->Lines[LineIndex];
-                float MinY = Line->GlyphBox.MinY;
-
-                if (Line->GlyphBox.MinY >= DesiredY) {
-                    DesiredLine = LineIndex;
-                }
-
-                if ((MinY >= DesiredY) == (LineIndexIncrement > 0)) {
-                    break;
-                }
-            }
+            int DesiredLine = MINIMUM(LineIndexAtY(Editor, DesiredY), Editor->LineCount - 1);
 
             // We've found a line.
             // Now, find the codpeoint.
@@ -1991,7 +4829,7 @@ static void DoCommand(editor* Editor, editor_command Command) {
 
         case EDITOR_COMMAND_MOUSE_MOVE:
         case EDITOR_COMMAND_MOUSE_PRESS: {
-            int DesiredLineIndex = (int)((Editor->CurrentScrollY + Command.Y) / (float)Editor->LineHeight);
+            int DesiredLineIndex = LineIndexAtY(Editor, Editor->CurrentScrollY + Command.Y);
             int CodepointIndex = Editor->TextLength;
             if (DesiredLineIndex >= Editor->LineCount) {
                 assert(Editor->LineCount);
@@ -154,8 +154,11 @@ static cached_glyph *FindOrCreateGlyph(app_state* App, font *Font, int GlyphInde
         Result->Font = Font;
         Result->GlyphIndex = GlyphIndex;
         Result->Scale = Scale;
-        stbtt_GetGlyphBitmapBoxSubpixel(&Font->Stbtt, GlyphIndex, Scale, Scale, 0, 0,
-                                        &Result->MinX, &Result->MinY, &Result->MaxX, &Result->MaxY);
+        glyph_metrics Metrics = GetGlyphMetrics(&App->Editor, Font, GlyphIndex, Scale);
+        Result->MinX = Metrics.MinX;
+        Result->MinY = Metrics.MinY;
+        Result->MaxX = Metrics.MaxX;
+        Result->MaxY = Metrics.MaxY;
         if (((Result->MaxX - Result->MinX) <= GLYPH_TEXTURE_SIZE) && ((Result->MaxY - Result->MinY) <= GLYPH_TEXTURE_SIZE)) {
             stbtt_MakeGlyphBitmapSubpixel(&Font->Stbtt, Result->Data, GLYPH_TEXTURE_SIZE, GLYPH_TEXTURE_SIZE, GLYPH_TEXTURE_SIZE,
                 Scale, Scale, 0, 0, GlyphIndex);
@@ -165,6 +168,19 @@ static cached_glyph *FindOrCreateGlyph(app_state* App, font *Font, int GlyphInde
     return Result;
 }
 
+// On demand, so that the frame loop stays quiet. A steady-state last frame should show no allocations at all, and
+// totals that keep going up between two presses with no edits in between mean that some frames still allocate.
+static void LogShaperStats(editor *Editor) {
+    pool_allocator *ShaperAllocator = &Editor->ShaperAllocator;
+    pool_frame_stats *LastFrame = &ShaperAllocator->LastFrame;
+    SDL_Log("Shaper, last frame: %d allocations (%d failed), %d frees. %zu bytes peak.",
+            LastFrame->AllocationCount, LastFrame->FailedAllocationCount, LastFrame->FreeCount, LastFrame->PeakBytesInUse);
+    SDL_Log("Shaper, total: %d allocations (%d failed), %d frees. %zu bytes in use, %zu peak.",
+            ShaperAllocator->AllocationCount, ShaperAllocator->FailedAllocationCount, ShaperAllocator->FreeCount,
+            ShaperAllocator->BytesInUse, ShaperAllocator->PeakBytesInUse);
+    SDL_Log("Shape configs: %zu bytes.", (size_t)(Editor->ShapeConfigArena.At - Editor->ShapeConfigArena.Base));
+}
+
 static void AppResize(app_state* App, int Width, int Height) {
     if (App->Texture)
         SDL_DestroyTexture(App->Texture);
@@ -214,7 +230,9 @@ static void AppDraw(app_state* App, uint32_t* Pixels, int Width, int Height, edi
         float CursorHeight = (float)Editor->LineHeight;
         float CursorWidth = 2.0f;
 
+        // The IME candidate window goes on the line of the cursor, so that it does not cover what is being typed.
         SDL_Rect TextInputRect = {0};
+        TextInputRect.y = (int)DrawList.Cursor.Y;
         TextInputRect.w = TextAreaWidth;
         TextInputRect.h = App->Editor.LineHeight;
         SDL_SetTextInputArea(App->Window, &TextInputRect, (int)DrawList.Cursor.X);
@@ -250,10 +268,11 @@ static void AppDraw(app_state* App, uint32_t* Pixels, int Width, int Height, edi
             App->ScrollMaxY = ScrollMaxY;
         }
 
-        for(int CommandIndex = 0; CommandIndex < (int)DrawList.Count; ++CommandIndex) {
+        for(int VisibleIndex = 0; VisibleIndex < (int)DrawList.VisibleCount; ++VisibleIndex) {
+            int CommandIndex = DrawList.VisibleCommandIndices[VisibleIndex];
             draw_command* Command = &DrawList.Commands[CommandIndex];
 
-            if(Command->Font && (Command->Flags & DRAW_COMMAND_FLAG_VISIBLE))
+            if(Command->Font)
             {
                 cached_glyph *CachedGlyph = FindOrCreateGlyph(App, Command->Font, Command->GlyphIndex, Command->Scale);
 
@@ -264,8 +283,8 @@ static void AppDraw(app_state* App, uint32_t* Pixels, int Width, int Height, edi
                 int SourceOffsetX = 0;
                 int SourceOffsetY = 0;
 
-                int OutX = (int)SDL_roundf(Command->X) + CachedGlyph->MinX;
-                int OutY = (int)SDL_roundf(Command->Y) + CachedGlyph->MinY;
+                int OutX = (int)SDL_roundf(DrawList.VisibleX[VisibleIndex]) + CachedGlyph->MinX;
+                int OutY = (int)SDL_roundf(DrawList.VisibleY[VisibleIndex]) + CachedGlyph->MinY;
 
                 if(OutX < 0) {
                     SourceOffsetX = -OutX;
@@ -369,6 +388,21 @@ SDL_AppResult SDL_AppInit(void** appstate, int argc, char *argv[]) {
     App->Style.SelectionForegroundColor = 0xFFEAFFFF;
     App->Style.ScrollbarThickness = 24;
 
+    // SDL creates this directory if needed. The string lives as long as the app does.
+    App->Editor.FontBlobCacheDirectory = SDL_GetPrefPath("refpad", "refpad");
+
+    // Fonts load on a few threads here, rather than in the middle of the first frame.
+    InitFonts(&App->Editor);
+
+    // The quick paste palette is very likely to get used, so have its shape configs ready before the first frame.
+    for (int PaletteIndex = 0; PaletteIndex < 10; ++PaletteIndex) {
+        const char *Text = (const char *)QuickPastePalette[PaletteIndex];
+        kbts_direction Direction;
+        kbts_script Script;
+        kbts_GuessTextPropertiesUtf8(Text, (int)StringLength(Text), &Direction, &Script);
+        ExpectScript(&App->Editor, Script);
+    }
+
     {
         App->CachedGlyphs = SDL_calloc(1, sizeof(cached_glyph) * GLYPH_CACHE_CAPACITY);
         uint8_t *TextureData = SDL_calloc(1, sizeof(uint8_t) * GLYPH_TEXTURE_SIZE * GLYPH_TEXTURE_SIZE * GLYPH_CACHE_CAPACITY);
@@ -756,6 +790,10 @@ SDL_AppResult SDL_AppEvent(void *AppState, SDL_Event *Event) {
                 }
             break;
 
+            case SDLK_F12:
+                LogShaperStats(&App->Editor);
+            break;
+
             case SDLK_Z:
             case SDLK_Y:
                 if (Event->key.mod & SDL_KMOD_CTRL) {